@@ -17,9 +17,8 @@ struct xt_ndpi_protocols {
   u_int16_t invflags;
 };
 struct xt_ndpi_tginfo {
-	#ifdef ADVANCE_Q3_NDPI
-       __u32 mark, mask;
-       __u16 p_proto_id:1,m_proto_id:1,any_proto_id,t_accept:1,t_mark:1,t_clsf:1;
-	#endif
+	__u32 flags;
 };
+/* set skb->mark and skb->priority from /proc/xt_ndpi/shaping */
+#define NDPI_TG_SHAPING    0x01
 #define NOT_YET_PROTOCOL   NDPI_LAST_IMPLEMENTED_PROTOCOL+1
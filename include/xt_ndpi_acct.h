@@ -0,0 +1,46 @@
+/*
+ *	xt_ndpi - Netfilter module to match nDPI-detected sessions
+ *
+ *	(C) 2013 Luca Deri <deri@ntop.org>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License version 2 as
+ *	published by the Free Software Foundation.
+ */
+
+#include <linux/types.h>
+
+/*
+ * Layout of /proc/xt_ndpi/acct once mmap()ed read only: a header, then for
+ * each of the two epochs nr_cpus tables of `slots' entries. The module only
+ * writes the tables of hdr->epoch. Writing to the file flips the epoch and
+ * returns once the previous one is no longer written: its tables hold the
+ * interval [since[old], since[epoch]) and stay as they are until the next
+ * flip. The same key shows up in several CPU tables, readers sum them.
+ */
+#define NDPI_ACCT_MAGIC		0x4e414354	/* "NACT" */
+#define NDPI_ACCT_VERSION	1
+#define NDPI_ACCT_HDR_SIZE	4096
+
+struct ndpi_acct_header {
+	__u32	magic, version;
+	__u32	slots;			/* per table, a power of two */
+	__u32	nr_cpus;
+	__u32	epoch;			/* being written, 0 or 1 */
+	__u32	generation;		/* flips so far */
+	__u64	since[2];		/* wall clock seconds each epoch started */
+};
+
+/* the end of the flow inside acct_local_nets, the one that opened it if neither is */
+struct ndpi_acct_slot {
+	__u32	addr[4];		/* IPv4 in addr[0] */
+	__u64	bytes;
+	__u32	packets;
+	__u16	proto;			/* nDPI protocol id */
+	__u8	family;			/* AF_INET, AF_INET6, 0 for a free slot */
+	__u8	pad;
+};
+
+#define NDPI_ACCT_TABLE( hdr, epoch, cpu )					\
+	((struct ndpi_acct_slot *) ((char *) (hdr) + NDPI_ACCT_HDR_SIZE)	\
+	 + ((epoch) * (hdr)->nr_cpus + (cpu)) * (hdr)->slots)
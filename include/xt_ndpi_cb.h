@@ -1,8 +1,14 @@
+/*
+ * Kept at the end of skb->cb, the IP layer still needs IPCB()/IP6CB() at
+ * its start after netfilter. The tag tells whether ndpi_proto was written
+ * for this very packet, see ndpi_cb_tag().
+ */
 struct xt_ndpi_cb {
+  u_int32_t tag;
   u_int16_t ndpi_proto;
 }xt_ndpi_cb_t;
 
-#define NDPI_CB(skb)                (*(struct xt_ndpi_cb*)&((skb)->cb))
+#define NDPI_CB(skb)                (*(struct xt_ndpi_cb*)&((skb)->cb[sizeof((skb)->cb) - sizeof(struct xt_ndpi_cb)]))
 #define NDPI_CB_APPID(skb)          (NDPI_CB(skb).ndpi_proto)
 
-#define NDPI_CB_RECORD(skb,entry)   do { NDPI_CB(skb).ndpi_proto = (u_int16_t)entry->ndpi_proto; } while (0)
+#define NDPI_CB_RECORD(skb,proto,t) do { NDPI_CB(skb).ndpi_proto = (u_int16_t)(proto); NDPI_CB(skb).tag = (t); } while (0)
@@ -127,9 +127,12 @@ iptables -t mangle -F LOCALPOLICYROUTING
 iptables -t filter -F APP_CTRL
 iptables -t filter -I APP_CTRL -m state --state NEW -j DROP
 
+# keep the classified flows across the reload
+[ -f /proc/xt_ndpi/flows ] && rm -f /var/run/xt_ndpi.flows && (umask 077; cat /proc/xt_ndpi/flows > /var/run/xt_ndpi.flows)
 modprobe -r xt_ndpi || echo "rmmod fail, you must rmmod custom or restart iptables or reboot"
 depmod
 modprobe xt_ndpi && echo "load mod ok"
+[ -f /var/run/xt_ndpi.flows ] && cat /var/run/xt_ndpi.flows > /proc/xt_ndpi/flows; rm -f /var/run/xt_ndpi.flows
 ldconfig
 
 # recover iptables
@@ -0,0 +1,384 @@
+/*
+ *	xt_ndpi - Netfilter module to match nDPI-detected sessions
+ *
+ *	(C) 2013 Luca Deri <deri@ntop.org>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License version 2 as
+ *	published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/in.h>
+#include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include <linux/netdevice.h>
+#include <linux/inet.h>
+#include <net/netfilter/nf_conntrack.h>
+
+#include "ndpi.h"
+#include "stats.h"
+#include "acct.h"
+#include "../include/xt_ndpi.h"
+#include "../include/xt_ndpi_acct.h"
+
+/* ************************************* */
+
+static unsigned int acct_slots;
+module_param( acct_slots, uint, 0444 );
+MODULE_PARM_DESC( acct_slots, "host x application counters per CPU and epoch, 0 disables (default 0)" );
+
+/*
+ * A flow is accounted to its end inside these networks: the host that
+ * opened it, else the one it was opened to (after DNAT), else the opener.
+ */
+static char *acct_local_nets = "10.0.0.0/8,172.16.0.0/12,192.168.0.0/16,fc00::/7";
+module_param( acct_local_nets, charp, 0444 );
+MODULE_PARM_DESC( acct_local_nets, "comma separated networks of the accounted hosts (default 10.0.0.0/8,172.16.0.0/12,192.168.0.0/16,fc00::/7)" );
+
+#define NDPI_ACCT_MAX_NETS	16
+
+struct acct_net {
+	u_int32_t	addr[4], mask[4];
+	u_int8_t	family;
+};
+
+static struct acct_net	acct_nets[NDPI_ACCT_MAX_NETS];
+static u_int32_t	acct_nets_count;
+
+#define NDPI_ACCT_MAX_SLOTS	(1 << 20)
+/* a key not found within that many slots is dropped, see acct_full */
+#define NDPI_ACCT_PROBES	8
+
+static struct ndpi_acct_header	*ndpi_acct;	/* vmalloc_user(), mapped by readers */
+static unsigned long		ndpi_acct_size;
+static DEFINE_MUTEX( acct_mutex );
+
+/* ************************************* */
+
+static inline u_int32_t acct_hash( const u_int32_t *addr, u_int16_t proto )
+{
+	return(jhash2( addr, 4, proto ) );
+}
+
+
+static struct ndpi_acct_slot *acct_find( struct ndpi_acct_slot *tbl, u_int32_t h,
+					 const u_int32_t *addr, u_int16_t proto, u_int8_t family )
+{
+	struct ndpi_acct_slot	*slot;
+	u_int32_t		i, mask = ndpi_acct->slots - 1;
+
+	for ( i = 0; i < NDPI_ACCT_PROBES; i++ )
+	{
+		slot = &tbl[(h + i) & mask];
+		if ( slot->family == 0 )
+			return(slot);
+		if ( slot->family == family && slot->proto == proto
+		     && memcmp( slot->addr, addr, sizeof(slot->addr) ) == 0 )
+			return(slot);
+	}
+	return(NULL);
+}
+
+
+static bool acct_addr_local( const u_int32_t *addr, u_int8_t family )
+{
+	const struct acct_net	*net;
+	u_int32_t		i;
+
+	for ( net = acct_nets; net < acct_nets + acct_nets_count; net++ )
+	{
+		if ( net->family != family )
+			continue;
+		for ( i = 0; i < 4; i++ )
+			if ( (addr[i] & net->mask[i]) != net->addr[i] )
+				break;
+		if ( i == 4 )
+			return(true);
+	}
+	return(false);
+}
+
+
+/* conntrack zeroes the tuple, IPv4 only fills the first word */
+static const u_int32_t *acct_local_addr( const struct nf_conn *ct, u_int8_t family )
+{
+	const u_int32_t *orig	= ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.all;
+	const u_int32_t *reply	= ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u3.all;
+
+	if ( !acct_addr_local( orig, family ) && acct_addr_local( reply, family ) )
+		return(reply);
+	return(orig);
+}
+
+
+void ndpi_acct_update( const struct nf_conn *ct, u_int16_t proto, u_int32_t len )
+{
+	struct ndpi_acct_header *hdr = ndpi_acct;
+	struct ndpi_acct_slot	*slot;
+	const u_int32_t		*addr;
+	u_int8_t		family;
+
+	if ( hdr == NULL )
+		return;
+
+	family	= nf_ct_l3num( ct );
+	addr	= acct_local_addr( ct, family );
+
+	/* BH is off: only this CPU writes its table, the epoch stays until we are done */
+	slot = acct_find( NDPI_ACCT_TABLE( hdr, ACCESS_ONCE( hdr->epoch ), smp_processor_id() ),
+			  acct_hash( addr, proto ), addr, proto, family );
+	if ( slot == NULL )
+	{
+		NDPI_STAT_INC( NDPI_STAT_ACCT_FULL );
+		return;
+	}
+
+	if ( slot->family == 0 )
+	{
+		memcpy( slot->addr, addr, sizeof(slot->addr) );
+		slot->proto	= proto;
+		slot->family	= family;
+	}
+	slot->packets++;
+	slot->bytes += len;
+}
+
+
+/*
+ * Start a new epoch and wait until the previous one is stable. Its tables
+ * are left for the readers, the ones cleared here held the epoch before.
+ */
+static void acct_flip( void )
+{
+	struct ndpi_acct_header *hdr = ndpi_acct;
+	u_int32_t		next = hdr->epoch ^ 1;
+
+	memset( NDPI_ACCT_TABLE( hdr, next, 0 ), 0,
+		(size_t) hdr->nr_cpus * hdr->slots * sizeof(struct ndpi_acct_slot) );
+	hdr->since[next] = get_seconds();
+	smp_wmb();
+	hdr->epoch = next;
+	hdr->generation++;
+
+	/* rules run under rcu_read_lock(), the old epoch is no longer written */
+	synchronize_net();
+}
+
+
+/* ************************************* */
+
+/*
+ * Text view of the last complete epoch, one line per host and protocol
+ * summed over the CPUs: a key is printed from the first table it is in.
+ */
+static void *acct_seq_start( struct seq_file *m, loff_t *pos )
+{
+	mutex_lock( &acct_mutex );
+	if ( ndpi_acct == NULL )
+		return(NULL);
+	if ( *pos == 0 )
+		return(SEQ_START_TOKEN);
+	return(*pos <= (loff_t) ndpi_acct->nr_cpus * ndpi_acct->slots ? pos : NULL);
+}
+
+
+static void *acct_seq_next( struct seq_file *m, void *v, loff_t *pos )
+{
+	++*pos;
+	return(*pos <= (loff_t) ndpi_acct->nr_cpus * ndpi_acct->slots ? pos : NULL);
+}
+
+
+static void acct_seq_stop( struct seq_file *m, void *v )
+{
+	mutex_unlock( &acct_mutex );
+}
+
+
+static int acct_seq_show( struct seq_file *m, void *v )
+{
+	struct ndpi_acct_header *hdr = ndpi_acct;
+	struct ndpi_acct_slot	*slot, *other;
+	u_int32_t		epoch = hdr->epoch ^ 1, cpu, i, h;
+	u_int64_t		packets, bytes;
+	char			*name;
+
+	if ( v == SEQ_START_TOKEN )
+	{
+		seq_printf( m, "# generation %u since %llu until %llu\n", hdr->generation,
+			    (unsigned long long) hdr->since[epoch], (unsigned long long) hdr->since[hdr->epoch] );
+		return(0);
+	}
+
+	i	= *(loff_t *) v - 1;
+	cpu	= i / hdr->slots;
+	slot	= &NDPI_ACCT_TABLE( hdr, epoch, cpu )[i % hdr->slots];
+	if ( slot->family == 0 )
+		return(0);
+
+	h	= acct_hash( slot->addr, slot->proto );
+	packets = bytes = 0;
+	for ( i = 0; i < hdr->nr_cpus; i++ )
+	{
+		other = acct_find( NDPI_ACCT_TABLE( hdr, epoch, i ), h, slot->addr, slot->proto, slot->family );
+		if ( other == NULL || other->family == 0 )
+			continue;
+		if ( i < cpu )
+			return(0);
+		packets += other->packets;
+		bytes	+= other->bytes;
+	}
+
+	name = (slot->proto == NOT_YET_PROTOCOL) ? "NotYet" : ndpi_get_proto_by_id( ndpi_struct, slot->proto );
+	if ( slot->family == AF_INET )
+		seq_printf( m, "%pI4", slot->addr );
+	else
+		seq_printf( m, "%pI6", slot->addr );
+	seq_printf( m, " %u %s %llu %llu\n", slot->proto, name ? name : "?",
+		    (unsigned long long) packets, (unsigned long long) bytes );
+	return(0);
+}
+
+
+static const struct seq_operations acct_seq_ops = {
+	.start	= acct_seq_start,
+	.next	= acct_seq_next,
+	.stop	= acct_seq_stop,
+	.show	= acct_seq_show,
+};
+
+
+static int ndpi_acct_open( struct inode *inode, struct file *file )
+{
+	return(seq_open( file, &acct_seq_ops ) );
+}
+
+
+/* any write closes the current epoch */
+static ssize_t ndpi_acct_write( struct file *file, const char __user *buffer, size_t count, loff_t *ppos )
+{
+	if ( ndpi_acct == NULL )
+		return(-ENODEV);
+
+	mutex_lock( &acct_mutex );
+	acct_flip();
+	mutex_unlock( &acct_mutex );
+	return(count);
+}
+
+
+/* the mapping holds the file, so the module and the area outlive it */
+static int ndpi_acct_mmap( struct file *file, struct vm_area_struct *vma )
+{
+	if ( ndpi_acct == NULL )
+		return(-ENODEV);
+	if ( vma->vm_flags & VM_WRITE )
+		return(-EPERM);
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return(remap_vmalloc_range( vma, ndpi_acct, vma->vm_pgoff ) );
+}
+
+
+const struct file_operations ndpi_acct_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ndpi_acct_open,
+	.read		= seq_read,
+	.write		= ndpi_acct_write,
+	.mmap		= ndpi_acct_mmap,
+	.llseek		= seq_lseek,
+	.release	= seq_release,
+};
+
+/* ********************************** */
+
+/* acct_local_nets, e.g. "10.0.0.0/8,fc00::/7" */
+static int acct_parse_nets( const char *nets )
+{
+	struct acct_net	*net;
+	const char	*p = nets, *end;
+	char		*e;
+	unsigned long	bits, max;
+	int		i;
+
+	acct_nets_count = 0;
+	while ( *p )
+	{
+		if ( acct_nets_count == NDPI_ACCT_MAX_NETS )
+			return(-EINVAL);
+		net = &acct_nets[acct_nets_count];
+		memset( net, 0, sizeof(*net) );
+
+		if ( in4_pton( p, -1, (u8 *) net->addr, '/', &end ) )
+			net->family = AF_INET, max = 32;
+		else if ( in6_pton( p, -1, (u8 *) net->addr, '/', &end ) )
+			net->family = AF_INET6, max = 128;
+		else
+			return(-EINVAL);
+		if ( *end != '/' )
+			return(-EINVAL);
+
+		bits = simple_strtoul( end + 1, &e, 10 );
+		if ( e == end + 1 || bits > max || (*e != ',' && *e != '\0') )
+			return(-EINVAL);
+		for ( i = 0; i < 4 && bits; i++, bits -= min_t( unsigned long, bits, 32 ) )
+			net->mask[i] = htonl( bits >= 32 ? ~0U : ~0U << (32 - bits) );
+		for ( i = 0; i < 4; i++ )
+			net->addr[i] &= net->mask[i];
+
+		acct_nets_count++;
+		p = *e ? e + 1 : e;
+	}
+	return(0);
+}
+
+
+int init_acct_engine( void )
+{
+	struct ndpi_acct_header *hdr;
+	u_int32_t		slots;
+
+	if ( acct_slots == 0 )
+		return(0);
+
+	if ( acct_parse_nets( acct_local_nets ) < 0 )
+	{
+		pr_err( "[NDPI] invalid acct_local_nets \"%s\"\n", acct_local_nets );
+		return(-EINVAL);
+	}
+
+	slots		= roundup_pow_of_two( min_t( u_int32_t, acct_slots, NDPI_ACCT_MAX_SLOTS ) );
+	ndpi_acct_size	= NDPI_ACCT_HDR_SIZE + 2UL * nr_cpu_ids * slots * sizeof(struct ndpi_acct_slot);
+
+	hdr = vmalloc_user( ndpi_acct_size );
+	if ( hdr == NULL )
+	{
+		pr_err( "[NDPI] no memory for %u accounting slots\n", slots );
+		return(-ENOMEM);
+	}
+
+	hdr->magic	= NDPI_ACCT_MAGIC;
+	hdr->version	= NDPI_ACCT_VERSION;
+	hdr->slots	= slots;
+	hdr->nr_cpus	= nr_cpu_ids;
+	hdr->since[0]	= get_seconds();
+	ndpi_acct	= hdr;
+
+	pr_info( "[NDPI] accounting %u hosts x applications per CPU [%lu KB]\n", slots, ndpi_acct_size >> 10 );
+	return(0);
+}
+
+
+/* after the rules are gone */
+void term_acct_engine( void )
+{
+	struct ndpi_acct_header *hdr = ndpi_acct;
+
+	ndpi_acct = NULL;
+	vfree( hdr );
+}
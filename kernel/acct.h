@@ -0,0 +1,26 @@
+/*
+ *	xt_ndpi - Netfilter module to match nDPI-detected sessions
+ *
+ *	(C) 2013 Luca Deri <deri@ntop.org>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License version 2 as
+ *	published by the Free Software Foundation.
+ */
+
+/*
+ * Packets and bytes per local host and application, see
+ * include/xt_ndpi_acct.h for the layout exported through /proc/xt_ndpi/acct.
+ * Disabled unless the module is loaded with acct_slots > 0.
+ */
+
+struct nf_conn;
+
+/* once per packet, from the rules with BH disabled */
+void ndpi_acct_update( const struct nf_conn *ct, u_int16_t proto, u_int32_t len );
+
+extern const struct file_operations ndpi_acct_fops;
+
+int init_acct_engine( void );
+
+void term_acct_engine( void );
@@ -0,0 +1,549 @@
+/*
+ *	xt_ndpi - Netfilter module to match nDPI-detected sessions
+ *
+ *	(C) 2013 Luca Deri <deri@ntop.org>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License version 2 as
+ *	published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/skbuff.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/random.h>
+#include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter_ipv4.h>
+#include <linux/netfilter_ipv6.h>
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_core.h>
+#include <asm/uaccess.h>
+
+#include "ndpi.h"
+#include "stats.h"
+#include "early.h"
+#include "../include/xt_ndpi.h"
+
+/* ************************************* */
+
+static unsigned int early_slots;
+module_param( early_slots, uint, 0444 );
+MODULE_PARM_DESC( early_slots, "flow tuples whose verdict is enforced before conntrack, 0 disables (default 0)" );
+
+#define NDPI_EARLY_MAX_SLOTS	(1 << 20)
+/* a tuple not placed within that many slots is not published, see early_full */
+#define NDPI_EARLY_PROBES	8
+
+enum { NDPI_EARLY_NONE, NDPI_EARLY_DROP, NDPI_EARLY_MARK };
+
+struct ndpi_early_action {
+	u_int32_t	mark, mask;
+	u_int8_t	action;
+};
+
+/*
+ * One direction of a published flow. It holds no reference on the ct: the
+ * entry is the tuple of that very ct, which the lookups check under RCU
+ * (the conntrack slab is SLAB_DESTROY_BY_RCU). The destroy paths of the ct
+ * remove it, otherwise the next lookup or publish probing its slot does.
+ */
+struct ndpi_early_flow {
+	struct nf_conntrack_tuple	tuple;
+	struct nf_conn			*ct;
+	unsigned long			extend;		/* jiffies a dropped packet keeps the ct alive */
+	u_int16_t			ndpi_proto;
+	u_int8_t			dir;
+	struct rcu_head			rcu;
+};
+
+/* actions are updated in place under the mutex, packets read them unlocked */
+static struct ndpi_early_action	*early_actions;
+static u_int32_t		num_early_actions;
+static DEFINE_MUTEX( early_mutex );
+
+/* slots are claimed and released with cmpxchg(), readers use RCU */
+static struct ndpi_early_flow	**early_table;
+static u_int32_t		early_mask;
+static u_int32_t		early_secret __read_mostly;
+
+/* ************************************* */
+
+static inline u_int32_t early_hash( const struct nf_conntrack_tuple *t )
+{
+	return(jhash2( (const u_int32_t *) &t->src, sizeof(t->src) / sizeof(u_int32_t),
+		       jhash_3words( jhash2( t->dst.u3.all, 4, early_secret ),
+				     t->dst.u.all, t->dst.protonum, early_secret ) ) );
+}
+
+
+/* under rcu_read_lock(), false once the ct died, even if its memory is reused */
+static inline bool early_ct_alive( const struct ndpi_early_flow *flow )
+{
+	struct nf_conn *ct = flow->ct;
+
+	return(atomic_read( &ct->ct_general.use ) != 0 && !nf_ct_is_dying( ct )
+	       && nf_ct_tuple_equal( &flow->tuple, &ct->tuplehash[flow->dir].tuple ) );
+}
+
+
+static void early_free_rcu( struct rcu_head *head )
+{
+	kfree( container_of( head, struct ndpi_early_flow, rcu ) );
+}
+
+
+static void early_reap( struct ndpi_early_flow **slot, struct ndpi_early_flow *flow )
+{
+	if ( cmpxchg( slot, flow, NULL ) == flow )
+		call_rcu( &flow->rcu, early_free_rcu );
+}
+
+
+static inline struct ndpi_early_action *early_action( u_int16_t ndpi_proto )
+{
+	if ( ndpi_proto >= num_early_actions || early_actions[ndpi_proto].action == NDPI_EARLY_NONE )
+		return(NULL);
+	smp_rmb();
+	return(&early_actions[ndpi_proto]);
+}
+
+
+/* ************************************* */
+
+static void early_insert( struct nf_conn *ct, enum ip_conntrack_dir dir, u_int16_t ndpi_proto )
+{
+	const struct nf_conntrack_tuple *t = &ct->tuplehash[dir].tuple;
+	struct ndpi_early_flow		**slot, *flow, *new = NULL;
+	u_int32_t			h = early_hash( t ), i;
+
+	for ( i = 0; i < NDPI_EARLY_PROBES; i++ )
+	{
+		slot = &early_table[(h + i) & early_mask];
+		flow = rcu_dereference( *slot );
+		if ( flow != NULL )
+		{
+			if ( flow->ct == ct && flow->dir == dir && nf_ct_tuple_equal( &flow->tuple, t ) )
+				goto out;
+			if ( early_ct_alive( flow ) )
+				continue;
+			early_reap( slot, flow );
+		}
+
+		if ( new == NULL )
+		{
+			new = kmalloc( sizeof(*new), GFP_ATOMIC );
+			if ( new == NULL )
+			{
+				NDPI_STAT_INC( NDPI_STAT_ALLOC_FAIL );
+				return;
+			}
+			new->tuple	= *t;
+			new->ct		= ct;
+			new->dir	= dir;
+			new->ndpi_proto = ndpi_proto;
+			/* conntrack has just refreshed it for this packet */
+			new->extend	= max_t( long, (long) (ct->timeout.expires - jiffies), HZ );
+		}
+
+		/* readers see a complete entry */
+		smp_wmb();
+		if ( cmpxchg( slot, NULL, new ) == NULL )
+			return;
+	}
+	NDPI_STAT_INC( NDPI_STAT_EARLY_FULL );
+out:
+	if ( new != NULL )
+		kfree( new );
+}
+
+
+void ndpi_early_publish( struct nf_conn *ct, u_int16_t ndpi_proto )
+{
+	if ( early_table == NULL || early_action( ndpi_proto ) == NULL || !nf_ct_is_confirmed( ct ) )
+		return;
+
+	rcu_read_lock();
+	early_insert( ct, IP_CT_DIR_ORIGINAL, ndpi_proto );
+	early_insert( ct, IP_CT_DIR_REPLY, ndpi_proto );
+	rcu_read_unlock();
+}
+
+
+void ndpi_early_forget( struct nf_conn *ct )
+{
+	struct ndpi_early_flow	**slot, *flow;
+	u_int32_t		h, i;
+	int			dir;
+
+	if ( early_table == NULL )
+		return;
+
+	rcu_read_lock();
+	for ( dir = IP_CT_DIR_ORIGINAL; dir < IP_CT_DIR_MAX; dir++ )
+	{
+		h = early_hash( &ct->tuplehash[dir].tuple );
+		for ( i = 0; i < NDPI_EARLY_PROBES; i++ )
+		{
+			slot = &early_table[(h + i) & early_mask];
+			flow = rcu_dereference( *slot );
+			if ( flow != NULL && flow->ct == ct )
+				early_reap( slot, flow );
+		}
+	}
+	rcu_read_unlock();
+}
+
+
+/* ************************************* */
+
+/*
+ * Conntrack never sees a dropped packet, so the ct would time out while
+ * the peer keeps sending and the flow come back as a new, mid-stream one
+ * nDPI can't classify. Once half of its timeout is gone, it is refreshed.
+ */
+static void early_keep_alive( const struct ndpi_early_flow *flow, struct sk_buff *skb )
+{
+	struct nf_conn *ct = flow->ct;
+
+	if ( !time_before( ct->timeout.expires, jiffies + flow->extend / 2 ) )
+		return;
+	if ( !atomic_inc_not_zero( &ct->ct_general.use ) )
+		return;
+	/* the reference may be on a ct reused in between */
+	if ( early_ct_alive( flow ) )
+		nf_ct_refresh( ct, skb, flow->extend );
+	nf_ct_put( ct );
+}
+
+
+static unsigned int ndpi_early_hook( struct sk_buff *skb, u_int16_t l3num )
+{
+	struct nf_conntrack_tuple	t;
+	struct ndpi_early_flow		**slot, *flow;
+	struct ndpi_early_action	*act;
+	u_int32_t			h, i;
+	unsigned int			verdict = NF_ACCEPT;
+
+	if ( !nf_ct_get_tuplepr( skb, skb_network_offset( skb ), l3num, &t ) )
+		return(NF_ACCEPT);
+
+	h = early_hash( &t );
+	rcu_read_lock();
+	for ( i = 0; i < NDPI_EARLY_PROBES; i++ )
+	{
+		slot = &early_table[(h + i) & early_mask];
+		flow = rcu_dereference( *slot );
+		if ( flow == NULL || !nf_ct_tuple_equal( &flow->tuple, &t ) )
+			continue;
+
+		if ( !early_ct_alive( flow ) )
+		{
+			early_reap( slot, flow );
+			break;
+		}
+		if ( (act = early_action( flow->ndpi_proto ) ) == NULL )
+			break;
+
+		if ( act->action == NDPI_EARLY_DROP )
+		{
+			early_keep_alive( flow, skb );
+			NDPI_STAT_INC( NDPI_STAT_EARLY_DROP );
+			verdict = NF_DROP;
+		} else {
+			NDPI_STAT_INC( NDPI_STAT_EARLY_MARK );
+			skb->mark = (skb->mark & ~act->mask) | act->mark;
+		}
+		break;
+	}
+	rcu_read_unlock();
+
+	return(verdict);
+}
+
+
+static unsigned int ndpi_early_hook4( unsigned int hooknum, struct sk_buff *skb,
+				      const struct net_device *in, const struct net_device *out,
+				      int (*okfn)( struct sk_buff * ) )
+{
+	return(ndpi_early_hook( skb, NFPROTO_IPV4 ) );
+}
+
+
+#ifdef NDPI_DETECTION_SUPPORT_IPV6
+static unsigned int ndpi_early_hook6( unsigned int hooknum, struct sk_buff *skb,
+				      const struct net_device *in, const struct net_device *out,
+				      int (*okfn)( struct sk_buff * ) )
+{
+	return(ndpi_early_hook( skb, NFPROTO_IPV6 ) );
+}
+#endif
+
+
+/* after defrag, so every packet carries its ports, and before conntrack */
+static struct nf_hook_ops ndpi_early_ops[] __read_mostly = {
+	{
+		.hook		= ndpi_early_hook4,
+		.owner		= THIS_MODULE,
+		.pf		= NFPROTO_IPV4,
+		.hooknum	= NF_INET_PRE_ROUTING,
+		.priority	= NF_IP_PRI_CONNTRACK_DEFRAG + 1,
+	},
+#ifdef NDPI_DETECTION_SUPPORT_IPV6
+	{
+		.hook		= ndpi_early_hook6,
+		.owner		= THIS_MODULE,
+		.pf		= NFPROTO_IPV6,
+		.hooknum	= NF_INET_PRE_ROUTING,
+		.priority	= NF_IP6_PRI_CONNTRACK_DEFRAG + 1,
+	},
+#endif
+};
+
+
+/* ************************************* */
+
+static int ndpi_early_show( struct seq_file *m, void *v )
+{
+	struct ndpi_early_action	*act;
+	u_int32_t			i, flows = 0;
+	char				*name;
+
+	seq_printf( m, "# %-18s %s\n", "protocol", "action" );
+	for ( i = 0; i < num_early_actions; i++ )
+	{
+		act = &early_actions[i];
+		if ( act->action == NDPI_EARLY_NONE )
+			continue;
+		name = ndpi_get_proto_by_id( ndpi_struct, i );
+		if ( act->action == NDPI_EARLY_DROP )
+			seq_printf( m, "%-20s drop\n", name ? name : "?" );
+		else
+			seq_printf( m, "%-20s mark 0x%08x/0x%08x\n", name ? name : "?", act->mark, act->mask );
+	}
+
+	if ( early_table == NULL )
+		return(0);
+	rcu_read_lock();
+	for ( i = 0; i <= early_mask; i++ )
+		if ( rcu_dereference( early_table[i] ) != NULL )
+			flows++;
+	rcu_read_unlock();
+	seq_printf( m, "# %u of %u slots in use\n", flows, early_mask + 1 );
+	return(0);
+}
+
+
+static int find_action( const char *name )
+{
+	u_int32_t	i;
+	char		*end, *proto;
+	unsigned long	id;
+
+	id = simple_strtoul( name, &end, 0 );
+	if ( *end == '\0' )
+		return(id < num_early_actions ? (int) id : -ENOENT);
+
+	for ( i = 0; i < num_early_actions; i++ )
+	{
+		proto = ndpi_get_proto_by_id( ndpi_struct, i );
+		if ( proto && !strcasecmp( name, proto ) )
+			return(i);
+	}
+	return(-ENOENT);
+}
+
+
+/*
+ * An action needs the protocol detected even when no rule matches on it,
+ * so each one set holds its dispatcher like a rule would.
+ */
+static int early_dispatch( int i, bool on )
+{
+	NDPI_PROTOCOL_BITMASK	protos;
+	int			rc;
+
+	if ( (early_actions[i].action != NDPI_EARLY_NONE) == on )
+		return(0);
+
+	NDPI_BITMASK_RESET( protos );
+	NDPI_ADD_PROTOCOL_TO_BITMASK( protos, i );
+	if ( !on )
+	{
+		ndpi_dispatch_put( &protos );
+		return(0);
+	}
+	if ( (rc = ndpi_dispatch_get( &protos ) ) > 0 )
+		ndpi_offload_revoke();
+	return(rc < 0 ? rc : 0);
+}
+
+
+static int parse_action( char *line )
+{
+	struct ndpi_early_action	*act;
+	char				name[32], verb[8], spec[32], *end;
+	u_int32_t			mark, mask = 0xffffffff;
+	int				i, n, rc;
+
+	n = sscanf( line, "%31s %7s %31s", name, verb, spec );
+	if ( n < 1 || name[0] == '#' )
+		return(0);
+	if ( n < 2 )
+		return(-EINVAL);
+	if ( (i = find_action( name ) ) < 0 )
+		return(i);
+	act = &early_actions[i];
+
+	/* published flows of the protocol keep their slots, the hook lets them pass */
+	if ( !strcmp( verb, "off" ) )
+	{
+		early_dispatch( i, false );
+		act->action = NDPI_EARLY_NONE;
+		return(0);
+	}
+	if ( !strcmp( verb, "drop" ) )
+	{
+		if ( (rc = early_dispatch( i, true ) ) < 0 )
+			return(rc);
+		act->action = NDPI_EARLY_NONE;
+		smp_wmb();
+		act->action = NDPI_EARLY_DROP;
+		return(0);
+	}
+	if ( strcmp( verb, "mark" ) || n < 3 )
+		return(-EINVAL);
+
+	mark = simple_strtoul( spec, &end, 0 );
+	if ( *end == '/' )
+		mask = simple_strtoul( end + 1, &end, 0 );
+	if ( *end != '\0' )
+		return(-EINVAL);
+	if ( (rc = early_dispatch( i, true ) ) < 0 )
+		return(rc);
+
+	act->action	= NDPI_EARLY_NONE;
+	smp_wmb();
+	act->mark	= mark & mask;
+	act->mask	= mask;
+	smp_wmb();
+	act->action	= NDPI_EARLY_MARK;
+	return(0);
+}
+
+
+static ssize_t ndpi_early_write( struct file *file, const char __user *buffer, size_t count, loff_t *ppos )
+{
+	char	*buf, *line, *next;
+	int	rc = 0;
+
+	if ( count == 0 || count > PAGE_SIZE )
+		return(-EINVAL);
+	if ( (buf = kmalloc( count + 1, GFP_KERNEL ) ) == NULL )
+		return(-ENOMEM);
+	if ( copy_from_user( buf, buffer, count ) )
+	{
+		kfree( buf );
+		return(-EFAULT);
+	}
+	buf[count] = '\0';
+
+	mutex_lock( &early_mutex );
+	for ( next = buf; (line = strsep( &next, "\n" ) ) != NULL && rc == 0; )
+		rc = parse_action( line );
+	mutex_unlock( &early_mutex );
+
+	kfree( buf );
+	return(rc < 0 ? rc : count);
+}
+
+
+static int ndpi_early_open( struct inode *inode, struct file *file )
+{
+	return(single_open( file, ndpi_early_show, NULL ) );
+}
+
+
+const struct file_operations ndpi_early_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ndpi_early_open,
+	.read		= seq_read,
+	.write		= ndpi_early_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* ********************************** */
+
+/* after init_ndpi_engine(), the protocol count comes from nDPI */
+int init_early_engine( void )
+{
+	u_int32_t	slots;
+	int		rc;
+
+	num_early_actions = ndpi_get_num_supported_protocols( ndpi_struct ) + 1;
+	early_actions = kcalloc( num_early_actions, sizeof(struct ndpi_early_action), GFP_KERNEL );
+	if ( early_actions == NULL )
+		return(-ENOMEM);
+
+	if ( early_slots == 0 )
+		return(0);
+
+	slots = roundup_pow_of_two( min_t( u_int32_t, early_slots, NDPI_EARLY_MAX_SLOTS ) );
+	early_table = vmalloc( slots * sizeof(*early_table) );
+	if ( early_table == NULL )
+	{
+		rc = -ENOMEM;
+		goto out_table;
+	}
+	memset( early_table, 0, slots * sizeof(*early_table) );
+	early_mask = slots - 1;
+	get_random_bytes( &early_secret, sizeof(early_secret) );
+
+	if ( (rc = nf_register_hooks( ndpi_early_ops, ARRAY_SIZE( ndpi_early_ops ) ) ) < 0 )
+		goto out_hooks;
+
+	pr_info( "[NDPI] early verdicts for %u flow tuples\n", slots );
+	return(0);
+out_hooks:
+	vfree( early_table );
+	early_table = NULL;
+out_table:
+	kfree( early_actions );
+	early_actions = NULL;
+	return(rc);
+}
+
+
+/* after the rules and the async workers are gone, nothing publishes anymore */
+void term_early_engine( void )
+{
+	struct ndpi_early_flow	*flow;
+	u_int32_t		i;
+
+	for ( i = 0; early_actions != NULL && i < num_early_actions; i++ )
+		early_dispatch( i, false );
+
+	if ( early_table != NULL )
+	{
+		nf_unregister_hooks( ndpi_early_ops, ARRAY_SIZE( ndpi_early_ops ) );
+		for ( i = 0; i <= early_mask; i++ )
+		{
+			flow = xchg( &early_table[i], NULL );
+			if ( flow != NULL )
+				kfree( flow );
+		}
+		/* entries reaped by the hook */
+		rcu_barrier();
+		vfree( early_table );
+		early_table = NULL;
+	}
+
+	kfree( early_actions );
+	early_actions = NULL;
+	num_early_actions = 0;
+}
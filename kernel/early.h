@@ -0,0 +1,36 @@
+/*
+ *	xt_ndpi - Netfilter module to match nDPI-detected sessions
+ *
+ *	(C) 2013 Luca Deri <deri@ntop.org>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License version 2 as
+ *	published by the Free Software Foundation.
+ */
+
+/*
+ * Verdicts enforced at PREROUTING, before conntrack and the rules. Once a
+ * flow is classified into an application that has an action, both its
+ * tuples are published into a hash table, and a hook right after defrag
+ * drops or marks their packets. Actions are read and written through
+ * /proc/xt_ndpi/early, one per line:
+ *	<protocol name|protocol id> drop
+ *	<protocol name|protocol id> mark <mark>[/<mask>]
+ *	<protocol name|protocol id> off
+ * A protocol with an action is detected even if no rule matches on it.
+ * Disabled unless the module is loaded with early_slots > 0.
+ */
+
+struct nf_conn;
+
+/* from the rules, once the protocol of ct is final */
+void ndpi_early_publish( struct nf_conn *ct, u_int16_t ndpi_proto );
+
+/* from the destroy paths of ct, or the LRU sweeper finding it dead */
+void ndpi_early_forget( struct nf_conn *ct );
+
+extern const struct file_operations ndpi_early_fops;
+
+int init_early_engine( void );
+
+void term_early_engine( void );
@@ -0,0 +1,149 @@
+/*
+ *	xt_ndpi - Netfilter module to match nDPI-detected sessions
+ *
+ *	(C) 2013 Luca Deri <deri@ntop.org>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License version 2 as
+ *	published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/vmalloc.h>
+#include <linux/seq_file.h>
+
+#include "ndpi.h"
+#include "hist.h"
+#include "../include/xt_ndpi.h"
+
+/* ************************************* */
+
+static int detect_hist = 0;
+module_param( detect_hist, bool, 0444 );
+MODULE_PARM_DESC( detect_hist, "log2 histograms of what classifying a flow takes, see /proc/xt_ndpi/hist (default 0)" );
+
+DEFINE_PER_CPU( struct ndpi_proto_hist *, ndpi_hist );
+u_int8_t	ndpi_hist_enabled __read_mostly;
+u_int32_t	ndpi_hist_protos;
+
+static const char *ndpi_hist_names[NDPI_HIST_MAX] = {
+	[NDPI_HIST_PACKETS]	= "packets",
+	[NDPI_HIST_BYTES]	= "bytes",
+	[NDPI_HIST_FLOW_NS]	= "flow_ns",
+	[NDPI_HIST_CALL_NS]	= "call_ns",
+};
+
+/* ************************************* */
+
+/* like the stats, buckets are summed without stopping the writers */
+static int ndpi_hist_show( struct seq_file *m, void *v )
+{
+	u_int64_t	sum[NDPI_HIST_BUCKETS], total;
+	u_int32_t	p, k, b, last;
+	int		cpu;
+	char		*name;
+
+	seq_printf( m, "# %-4s %-20s %-8s count per log2 bucket, [0] [1] [2,3] [4,7] ...\n", "id", "protocol", "kind" );
+	if ( !ndpi_hist_enabled )
+		return(0);
+
+	for ( p = 0; p < ndpi_hist_protos; p++ )
+	{
+		for ( k = 0; k < NDPI_HIST_MAX; k++ )
+		{
+			memset( sum, 0, sizeof(sum) );
+			total = 0;
+			for_each_possible_cpu( cpu )
+				for ( b = 0; b < NDPI_HIST_BUCKETS; b++ )
+					sum[b] += per_cpu( ndpi_hist, cpu )[p].bucket[k][b];
+			for ( b = 0, last = 0; b < NDPI_HIST_BUCKETS; b++ )
+			{
+				total += sum[b];
+				if ( sum[b] )
+					last = b;
+			}
+			if ( total == 0 )
+				continue;
+
+			name = ndpi_get_proto_by_id( ndpi_struct, p );
+			seq_printf( m, "%-6u %-20s %-8s", p, name ? name : "?", ndpi_hist_names[k] );
+			for ( b = 0; b <= last; b++ )
+				seq_printf( m, " %llu", (unsigned long long) sum[b] );
+			seq_printf( m, "\n" );
+		}
+	}
+	return(0);
+}
+
+
+/* any write starts the histograms over */
+static ssize_t ndpi_hist_write( struct file *file, const char __user *buffer, size_t count, loff_t *ppos )
+{
+	int cpu;
+
+	if ( !ndpi_hist_enabled )
+		return(-ENODEV);
+
+	for_each_possible_cpu( cpu )
+		memset( per_cpu( ndpi_hist, cpu ), 0, ndpi_hist_protos * sizeof(struct ndpi_proto_hist) );
+	return(count);
+}
+
+
+static int ndpi_hist_open( struct inode *inode, struct file *file )
+{
+	return(single_open( file, ndpi_hist_show, NULL ) );
+}
+
+
+const struct file_operations ndpi_hist_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ndpi_hist_open,
+	.read		= seq_read,
+	.write		= ndpi_hist_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* ********************************** */
+
+void term_hist_engine( void )
+{
+	int cpu;
+
+	ndpi_hist_enabled = 0;
+	for_each_possible_cpu( cpu )
+	{
+		vfree( per_cpu( ndpi_hist, cpu ) );
+		per_cpu( ndpi_hist, cpu ) = NULL;
+	}
+}
+
+
+/* after init_ndpi_engine(), the protocol count comes from nDPI */
+int init_hist_engine( void )
+{
+	unsigned long	size;
+	int		cpu;
+
+	if ( !detect_hist )
+		return(0);
+
+	ndpi_hist_protos = ndpi_get_num_supported_protocols( ndpi_struct ) + 1;
+	size = ndpi_hist_protos * sizeof(struct ndpi_proto_hist);
+
+	for_each_possible_cpu( cpu )
+	{
+		per_cpu( ndpi_hist, cpu ) = vmalloc_node( size, cpu_to_node( cpu ) );
+		if ( per_cpu( ndpi_hist, cpu ) == NULL )
+			goto out_nomem;
+		memset( per_cpu( ndpi_hist, cpu ), 0, size );
+	}
+
+	ndpi_hist_enabled = 1;
+	pr_info( "[NDPI] detection histograms for %u protocols [%lu KB per CPU]\n", ndpi_hist_protos, size >> 10 );
+	return(0);
+out_nomem:
+	term_hist_engine();
+	return(-ENOMEM);
+}
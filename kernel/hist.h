@@ -0,0 +1,53 @@
+/*
+ *	xt_ndpi - Netfilter module to match nDPI-detected sessions
+ *
+ *	(C) 2013 Luca Deri <deri@ntop.org>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License version 2 as
+ *	published by the Free Software Foundation.
+ */
+
+#include <linux/percpu.h>
+#include <linux/bitops.h>
+#include <linux/fs.h>
+
+/*
+ * What it takes nDPI to classify a flow, per CPU and final protocol, in
+ * log2 buckets: bucket b counts the values in [2^(b-1), 2^b), bucket 0
+ * the zeroes. Summed up when /proc/xt_ndpi/hist is read, any write clears
+ * them. Disabled unless the module is loaded with detect_hist=1.
+ */
+enum ndpi_hist_kind {
+	NDPI_HIST_PACKETS,		/* packets inspected until classified */
+	NDPI_HIST_BYTES,		/* IP bytes until classified */
+	NDPI_HIST_FLOW_NS,		/* time spent in nDPI on the flow */
+	NDPI_HIST_CALL_NS,		/* one call, by the protocol it returned */
+	NDPI_HIST_MAX
+};
+
+#define NDPI_HIST_BUCKETS	32
+
+struct ndpi_proto_hist {
+	u_int32_t	bucket[NDPI_HIST_MAX][NDPI_HIST_BUCKETS];
+};
+
+DECLARE_PER_CPU( struct ndpi_proto_hist *, ndpi_hist );
+extern u_int8_t			ndpi_hist_enabled;
+extern u_int32_t		ndpi_hist_protos;
+extern const struct file_operations ndpi_hist_fops;
+
+/* ********************************** */
+
+/* Callers run with BH disabled and check ndpi_hist_enabled first */
+static inline void ndpi_hist_add( u_int32_t proto, enum ndpi_hist_kind kind, u_int64_t value )
+{
+	if ( unlikely( proto >= ndpi_hist_protos ) )
+		return;
+
+	__get_cpu_var( ndpi_hist )[proto].bucket[kind][min_t( int, fls64( value ), NDPI_HIST_BUCKETS - 1 )]++;
+}
+
+int init_hist_engine( void );
+
+void term_hist_engine( void );
@@ -8,70 +8,235 @@
  *	published by the Free Software Foundation.
  */
 
+#include <linux/module.h>
 #include <linux/jiffies.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mempool.h>
+#include <linux/log2.h>
+#include <linux/timer.h>
+#include <linux/in.h>
 
 #include "ndpi.h"
 #include "lru.h"
+#include "stats.h"
+#include "early.h"
 
-/* Least recently used cache */
+/*
+ * Least recently used cache
+ *
+ * Lookups walk the hash chains under rcu_read_lock() only, writers hold
+ * the unit lock and nodes are freed after a grace period. A hit just sets
+ * the CLOCK bit of the node; eviction gives such nodes a second chance
+ * at the list head, so the fast path never writes the shared list.
+ */
 
 /* ************************************ */
 
 static u_int8_t traceLRU;
 struct LruCache *lru_cache;
 
+unsigned int cache_size = CACHE_SIZE;
+module_param( cache_size, uint, 0444 );
+MODULE_PARM_DESC( cache_size, "flows kept in the cache, 1024 to 2^28, resize through /proc/xt_ndpi/cache (default 32768)" );
+
+unsigned int cache_buckets = 0;
+module_param( cache_buckets, uint, 0444 );
+MODULE_PARM_DESC( cache_buckets, "hash buckets of the cache up to 2^28, rounded up to a power of 2 per unit, 0 is 4 per flow (default 0)" );
+
+static DEFINE_MUTEX( lru_resize_mutex );
+
+/*
+ * Idle expiry, in seconds, 0 keeps idle flows until they are evicted.
+ * A classified flow leaves with its conntrack, which knows better than an
+ * idle timer whether it is over, so only the undetected ones expire by
+ * default: they hold DPI state and inspection slots.
+ */
+static unsigned int expire_tcp = 0;
+module_param( expire_tcp, uint, 0644 );
+MODULE_PARM_DESC( expire_tcp, "seconds before an idle classified TCP flow is dropped, 0 waits for its conntrack (default 0)" );
+
+static unsigned int expire_udp = 0;
+module_param( expire_udp, uint, 0644 );
+MODULE_PARM_DESC( expire_udp, "seconds before an idle classified non TCP flow is dropped, 0 waits for its conntrack (default 0)" );
+
+static unsigned int expire_undetected = 30;
+module_param( expire_undetected, uint, 0644 );
+MODULE_PARM_DESC( expire_undetected, "seconds before an idle flow still under inspection is dropped (default 30)" );
+
+/*
+ * The sweeper visits a few units per timer tick, so the whole cache is
+ * walked once every LRU_SWEEP_SECS and no softirq sees a long pass.
+ */
+#define LRU_SWEEP_TICKS_PER_SEC	32
+#define LRU_SWEEP_SECS		4
+#define LRU_SWEEP_UNITS		max( NUM_LRU_CACHE_UNITS / (LRU_SWEEP_TICKS_PER_SEC * LRU_SWEEP_SECS), 1 )
+
+static struct timer_list	lru_sweep_timer;
+static u_int32_t		lru_sweep_next;
+
+static struct kmem_cache	*lru_node_cache;
+static mempool_t		*lru_node_pool;
+
+static struct kmem_cache	*lru_dpi_cache;
+static atomic_t			lru_dpi_count = ATOMIC_INIT( 0 );
+
 /* ************************************ */
 
-void init_lru_cache_unit( struct LruCacheUnit *cache_unit, u_int32_t max_size )
+static void freeCacheNodeRcu( struct rcu_head *head )
 {
-    u_int size;
+	mempool_free( container_of( head, struct LruCacheNode, rcu ), lru_node_pool );
+}
 
-    if ( unlikely( traceLRU ) )
-        pr_info( "[NDPI] %s()", __FUNCTION__ );
 
-    cache_unit->max_lru_size = max_size;
-    cache_unit->hash_size = 4 * max_size + 1;
-    cache_unit->current_size = 0;
+static void freeCacheNode( struct LruCacheNode *node )
+{
+	call_rcu( &node->rcu, freeCacheNodeRcu );
+}
+
+/* ************************************ */
 
-    size = cache_unit->hash_size * sizeof(struct LruCacheNode*);
-    if ( (cache_unit->hash = (struct LruCacheNode * *) kmalloc( size, GFP_ATOMIC ) ) == NULL )
+/* large caches get tables of up to 2MB per unit, not worth a high order page */
+static struct LruHashTable *alloc_hash_table( u_int32_t size )
+{
+    struct LruHashTable *tbl;
+    size_t bytes = sizeof(*tbl) + size * sizeof(struct LruCacheNode *);
+
+    if ( bytes <= 2 * PAGE_SIZE )
+        tbl = kzalloc( bytes, GFP_KERNEL );
+    else if ( (tbl = vmalloc( bytes ) ) != NULL )
+        memset( tbl, 0, bytes );
+    if ( tbl == NULL )
     {
         pr_info( "[NDPI ERROR] Not enough memory?" );
-        return;
-    } else
-        memset( cache_unit->hash, 0, size );
+        return(NULL);
+    }
+    tbl->size = size;
+    return(tbl);
+}
+
 
+/* process context, vfree() must not run from an RCU callback */
+static void free_hash_table( struct LruHashTable *tbl )
+{
+    if ( is_vmalloc_addr( tbl ) )
+        vfree( tbl );
+    else
+        kfree( tbl );
+}
+
+
+/* limits of cache_size and cache_buckets, at load and through /proc/xt_ndpi/cache */
+bool lru_cache_geometry_valid( unsigned long max_size, unsigned long buckets )
+{
+    return max_size >= NUM_LRU_CACHE_UNITS && max_size <= (1UL << 28) && buckets <= (1UL << 28);
+}
+
+
+/* per unit flows and buckets for a whole cache of max_size flows */
+static void lru_unit_geometry( u_int32_t max_size, u_int32_t buckets,
+			       u_int32_t *unit_size, u_int32_t *unit_buckets )
+{
+    *unit_size = max_t( u_int32_t, max_size / NUM_LRU_CACHE_UNITS, 2 );
+    if ( buckets == 0 )
+        buckets = 4 * max_size;
+    *unit_buckets = roundup_pow_of_two( max_t( u_int32_t, buckets / NUM_LRU_CACHE_UNITS, 1 ) );
+}
+
+
+/* ************************************ */
+
+static int init_lru_cache_unit( struct LruCacheUnit *cache_unit, u_int32_t max_size, u_int32_t buckets )
+{
+    if ( unlikely( traceLRU ) )
+        pr_info( "[NDPI] %s()", __FUNCTION__ );
+
+    spin_lock_init( &cache_unit->lock );
+    cache_unit->max_lru_size = max_size;
+    cache_unit->current_size = 0;
     cache_unit->list_head = cache_unit->list_tail = NULL;
+
+    cache_unit->hash = alloc_hash_table( buckets );
+    return(cache_unit->hash ? 0 : -ENOMEM);
 }
 
 
 /* ************************************ */
 
-void init_lru_cache( struct LruCache *cache, u_int32_t max_size )
+int init_lru_cache( struct LruCache *cache, u_int32_t max_size, u_int32_t buckets )
 {
-	int i, sz = max_size / NUM_LRU_CACHE_UNITS;
+	u_int32_t unit_size, unit_buckets;
+	int i;
 
+	lru_unit_geometry( max_size, buckets, &unit_size, &unit_buckets );
 	for ( i = 0; i < NUM_LRU_CACHE_UNITS; i++ )
-		init_lru_cache_unit( &cache->units[i], sz );
+	{
+		if ( init_lru_cache_unit( &cache->units[i], unit_size, unit_buckets ) < 0 )
+		{
+			while ( --i >= 0 )
+				free_hash_table( cache->units[i].hash );
+			return(-ENOMEM);
+		}
+	}
+
+	return(0);
 }
 
 
 /* ************************************ */
 
-void free_LruCacheEntryValue( struct LruCacheEntryValue *entry )
+struct LruCacheDpiState *alloc_dpi_state( void )
 {
-	/*PT test lock*/
-	if ( entry->src )
+	struct LruCacheDpiState *dpi;
+
+	/* flows under inspection are the expensive ones, keep them bounded */
+	if ( atomic_inc_return( &lru_dpi_count ) > max_inspecting )
 	{
-		kfree( entry->src ); entry->src = NULL;
+		NDPI_STAT_INC( NDPI_STAT_DPI_LIMIT );
+		goto out_count;
 	}
-	if ( entry->dst )
+
+	dpi = kmem_cache_zalloc( lru_dpi_cache, GFP_ATOMIC );
+	if ( dpi == NULL )
+	{
+		NDPI_STAT_INC( NDPI_STAT_ALLOC_FAIL );
+		goto out_count;
+	}
+
+	dpi->flow	= ndpi_flow_alloc();
+	dpi->src	= ndpi_id_alloc();
+	dpi->dst	= ndpi_id_alloc();
+	if ( dpi->flow == NULL || dpi->src == NULL || dpi->dst == NULL )
 	{
-		kfree( entry->dst ); entry->dst = NULL;
+		NDPI_STAT_INC( NDPI_STAT_ALLOC_FAIL );
+		free_dpi_state( dpi );
+		return(NULL);
 	}
-	if ( entry->flow )
+
+	return(dpi);
+out_count:
+	atomic_dec( &lru_dpi_count );
+	return(NULL);
+}
+
+
+void free_dpi_state( struct LruCacheDpiState *dpi )
+{
+	ndpi_id_free( dpi->src );
+	ndpi_id_free( dpi->dst );
+	ndpi_flow_free( dpi->flow );
+	kmem_cache_free( lru_dpi_cache, dpi );
+	atomic_dec( &lru_dpi_count );
+}
+
+
+/* ************************************ */
+
+void free_LruCacheEntryValue( struct LruCacheEntryValue *entry )
+{
+	if ( entry->dpi )
 	{
-		kfree( entry->flow ); entry->flow = NULL;
+		free_dpi_state( entry->dpi ); entry->dpi = NULL;
 	}
 }
 
@@ -91,11 +256,11 @@ void free_lru_cache_unit( struct LruCacheUnit *cache_unit )
 
 		free_LruCacheEntryValue( &head->node.value );
 
-		kfree( head );
+		freeCacheNode( head );
 		head = next;
 	}
 
-	kfree( cache_unit->hash );
+	free_hash_table( cache_unit->hash );
     cache_unit->hash = NULL;
 }
 
@@ -113,16 +278,51 @@ void free_lru_cache( struct LruCache *cache )
 
 /* ************************************ */
 
+static void delete_node_from_hash( struct LruCacheUnit *cache_unit, struct LruCacheNode *node )
+{
+	u_int32_t		hash_id = LRU_HASH_ID( cache_unit->hash, node->node.key );
+	struct LruCacheNode	*head   = cache_unit->hash->bucket[hash_id];
+	struct LruCacheNode	*prev   = NULL;
+
+	while ( head != NULL ) {
+		if (head == node) {
+			/* node found, readers may still be standing on it */
+			if ( prev == NULL )
+				rcu_assign_pointer( cache_unit->hash->bucket[hash_id], node->hash.next );
+			else {
+				rcu_assign_pointer( prev->hash.next, node->hash.next );
+			}
+
+			break;
+		} else {
+			prev = head;
+			head = head->hash.next;
+		}
+	}
+}
+
+
+/* ************************************ */
+
+static void link_node_to_lru_head( struct LruCacheUnit *cache_unit, struct LruCacheNode *node );
+
 static int delete_oldest_lru_cache_unit( struct LruCacheUnit *cache_unit )
 {
-	struct LruCacheNode	*node = cache_unit->list_tail;
-	u_int32_t		hash_id;
-	struct LruCacheNode	*head, *prev = NULL;
+	struct LruCacheNode	*node;
 	//static u_int32_t usenum;
 
 	if ( unlikely( traceLRU ) )
 		pr_info( "[NDPI] %s()", __FUNCTION__ );
 
+	/* [0] CLOCK: nodes hit since their last pass go back to the head */
+	while ( (node = cache_unit->list_tail) != NULL && node->referenced
+		&& node->lru_list.prev != NULL )
+	{
+		node->referenced = 0;
+		delete_node_from_lru_list( cache_unit, node );
+		link_node_to_lru_head( cache_unit, node );
+	}
+
 	/* [1] Remove the last list element */
 	if ( cache_unit->list_tail == NULL )
 	{
@@ -138,35 +338,18 @@ static int delete_oldest_lru_cache_unit( struct LruCacheUnit *cache_unit )
         cache_unit->list_tail->lru_list.next = NULL;
     }
 
-	hash_id = node->node.key % cache_unit->hash_size;
-	head    = cache_unit->hash[hash_id];
-
 	/* [2] Remove the node from the hash */
-	while ( head != NULL ) {
-		//if ( head->node.key == node->node.key )
-		if (head == node) {
-			/* node found */
-			if ( prev == NULL )
-				cache_unit->hash[hash_id] = node->hash.next;
-			else {
-				prev->hash.next = node->hash.next;
-			}
-
-			break;
-		} else {
-			prev = head;
-			head = head->hash.next;
-		}
-	}
+	delete_node_from_hash( cache_unit, node );
 
 	/* [3] Free the memory */
 	//usenum++;
 	//pr_info( "delete_oldest_lru_cache_unit USE NUM IS:%u \n",usenum);
 	
 	free_LruCacheEntryValue( &node->node.value );
-	kfree( node );
+	freeCacheNode( node );
     node = NULL;
 	cache_unit->current_size--;
+	NDPI_STAT_INC( NDPI_STAT_EVICTED );
 	return 0;
 }
 
@@ -191,9 +374,8 @@ void delete_node_from_lru_list( struct LruCacheUnit *cache_unit, struct LruCache
 	{
 		struct LruCacheNode *new_tail = (cache_unit->list_tail)->lru_list.prev;
 
-		if ( new_tail == NULL )
-			pr_info( "[NDPI ERROR] Internal error (NULL new_tail)" );
-		else
+		/* a NULL new_tail just means the list is empty now */
+		if ( new_tail != NULL )
             new_tail->lru_list.next = NULL;
 
         cache_unit->list_tail = new_tail;
@@ -203,8 +385,8 @@ void delete_node_from_lru_list( struct LruCacheUnit *cache_unit, struct LruCache
 
 /* ************************************ */
 
-static void add_node_to_lru_list( struct LruCacheUnit *cache_unit,
-				  struct LruCacheNode *node )
+static void link_node_to_lru_head( struct LruCacheUnit *cache_unit,
+				   struct LruCacheNode *node )
 {
     if ( cache_unit->list_head != NULL )
     {
@@ -223,6 +405,15 @@ static void add_node_to_lru_list( struct LruCacheUnit *cache_unit,
     }
 
     cache_unit->list_head = node; /* Add as head */
+}
+
+
+/* ************************************ */
+
+static void add_node_to_lru_list( struct LruCacheUnit *cache_unit,
+				  struct LruCacheNode *node )
+{
+    link_node_to_lru_head( cache_unit, node );
 
     if ( cache_unit->current_size > cache_unit->max_lru_size )
         delete_oldest_lru_cache_unit( cache_unit );
@@ -233,9 +424,10 @@ static void add_node_to_lru_list( struct LruCacheUnit *cache_unit,
 
 static struct LruCacheNode* allocCacheNode( LruKey key )
 {
-	struct LruCacheNode *node = (struct LruCacheNode *) kmalloc( sizeof(struct LruCacheNode), GFP_ATOMIC );
+	struct LruCacheNode *node = (struct LruCacheNode *) mempool_alloc( lru_node_pool, GFP_ATOMIC );
 
 	if (!node) {
+		NDPI_STAT_INC( NDPI_STAT_ALLOC_FAIL );
 		pr_info( "[NDPI ERROR] Not enough memory?" );
 		return NULL;
     }
@@ -254,7 +446,7 @@ static struct LruCacheNode* allocCacheNode( LruKey key )
 
 static struct LruCacheNode* add_to_lru_cache_unit( struct LruCacheUnit *cache_unit, LruKey key )
 {
-    u_int32_t		hash_id			= key % cache_unit->hash_size;
+    struct LruCacheNode	**bucket		= &cache_unit->hash->bucket[LRU_HASH_ID( cache_unit->hash, key )];
     struct LruCacheNode	*node			= NULL;
     u_int8_t		node_already_existing	= 0;
 
@@ -262,7 +454,7 @@ static struct LruCacheNode* add_to_lru_cache_unit( struct LruCacheUnit *cache_un
         pr_info( "[NDPI] %s(key=%lu)", __FUNCTION__, (unsigned long int) key );
 
     /* [1] Add to hash */
-    if ( cache_unit->hash[hash_id] == NULL )
+    if ( *bucket == NULL )
     {
         if ( (node = allocCacheNode( key ) ) == NULL )
         {
@@ -270,14 +462,14 @@ static struct LruCacheNode* add_to_lru_cache_unit( struct LruCacheUnit *cache_un
         }
 
         node->hash.next = NULL;
-        cache_unit->hash[hash_id] = node;
+        rcu_assign_pointer( *bucket, node );
         cache_unit->current_size++;
         add_node_to_lru_list( cache_unit, node );
         if (unlikely(traceLRU))
-            pr_info("NDPI DEBUG LRU1: key: %p unit: %llu hashid: %u\n", (void*)key, key%NUM_LRU_CACHE_UNITS, hash_id);
+            pr_info("NDPI DEBUG LRU1: key: %p unit: %llu hashid: %u\n", (void*)key, key%NUM_LRU_CACHE_UNITS, (u_int32_t) (bucket - cache_unit->hash->bucket));
     } else {
         /* Check if the element exists */
-        struct LruCacheNode *head = cache_unit->hash[hash_id];
+        struct LruCacheNode *head = *bucket;
 
         while ( head != NULL )
         {
@@ -285,6 +477,8 @@ static struct LruCacheNode* add_to_lru_cache_unit( struct LruCacheUnit *cache_un
                 /* key found */
                 node = head;
                 node_already_existing	= 1;
+                if ( !node->referenced )
+                    node->referenced = 1;
                 break;
             }
 
@@ -295,12 +489,12 @@ static struct LruCacheNode* add_to_lru_cache_unit( struct LruCacheUnit *cache_un
             if ( (node = allocCacheNode( key ) ) == NULL )
                 goto ret_add_to_lru_cache;
 
-            node->hash.next = cache_unit->hash[hash_id];
-            cache_unit->hash[hash_id] = node;
+            node->hash.next = *bucket;
+            rcu_assign_pointer( *bucket, node );
             cache_unit->current_size++;
             add_node_to_lru_list( cache_unit, node );
             if (unlikely(traceLRU))
-                pr_info("NDPI DEBUG LRU2: key: %p unit: %llu hashid: %u\n", (void*)key, key%NUM_LRU_CACHE_UNITS, hash_id);
+                pr_info("NDPI DEBUG LRU2: key: %p unit: %llu hashid: %u\n", (void*)key, key%NUM_LRU_CACHE_UNITS, (u_int32_t) (bucket - cache_unit->hash->bucket));
         }
     }
 
@@ -314,16 +508,17 @@ ret_add_to_lru_cache:
 /* Add if not existing or return existing otherwise */
 struct LruCacheNode* add_to_lru_cache( struct LruCache *cache, LruKey key )
 {
-	return(add_to_lru_cache_unit( &cache->units[key % NUM_LRU_CACHE_UNITS], key ) );
+	return(add_to_lru_cache_unit( LRU_CACHE_UNIT( cache, key ), key ) );
 }
 
 
 /* ************************************ */
 
+/* Caller holds the unit lock or rcu_read_lock() */
 static struct LruCacheEntryValue* find_lru_cache_unit( struct LruCacheUnit *cache_unit, LruKey key )
 {
-	u_int32_t			hash_id		= key % cache_unit->hash_size;
-	struct LruCacheNode		*head		= cache_unit->hash[hash_id];
+	struct LruHashTable		*tbl		= rcu_dereference( cache_unit->hash );
+	struct LruCacheNode		*head		= rcu_dereference( tbl->bucket[LRU_HASH_ID( tbl, key )] );
 	struct LruCacheEntryValue	* ret_val	= NULL;
 
 	if ( unlikely( traceLRU ) )
@@ -333,10 +528,13 @@ static struct LruCacheEntryValue* find_lru_cache_unit( struct LruCacheUnit *cach
 	{
 		if ( head->node.key == key )
 		{
+			/* promote without touching the list, the bit is only written once */
+			if ( !head->referenced )
+				head->referenced = 1;
 			ret_val = &head->node.value;
 			break;
 		} else {
-			head = head->hash.next;
+			head = rcu_dereference( head->hash.next );
 		}
 	}
 
@@ -348,7 +546,205 @@ static struct LruCacheEntryValue* find_lru_cache_unit( struct LruCacheUnit *cach
 
 struct LruCacheEntryValue* find_lru_cache( struct LruCache *cache, LruKey key )
 {
-	return(find_lru_cache_unit( &cache->units[key % NUM_LRU_CACHE_UNITS], key ) );
+	return(find_lru_cache_unit( LRU_CACHE_UNIT( cache, key ), key ) );
+}
+
+
+/* ************************************ */
+
+static int delete_from_lru_cache_unit( struct LruCacheUnit *cache_unit, LruKey key )
+{
+	struct LruCacheNode	*node	= cache_unit->hash->bucket[LRU_HASH_ID( cache_unit->hash, key )];
+
+	if ( unlikely( traceLRU ) )
+		pr_info( "[NDPI] %s(%lu)", __FUNCTION__, (long unsigned int) key );
+
+	while ( node != NULL && node->node.key != key )
+		node = node->hash.next;
+
+	if ( node == NULL )
+		return -1;
+
+	delete_node_from_hash( cache_unit, node );
+	delete_node_from_lru_list( cache_unit, node );
+	free_LruCacheEntryValue( &node->node.value );
+	freeCacheNode( node );
+	cache_unit->current_size--;
+	return 0;
+}
+
+
+/* ************************************ */
+
+/* Drop the entry of key right away, e.g. when its conntrack dies */
+int delete_from_lru_cache( struct LruCache *cache, LruKey key )
+{
+	return(delete_from_lru_cache_unit( LRU_CACHE_UNIT( cache, key ), key ) );
+}
+
+
+/* ************************************ */
+
+/*
+ * The nodes are relinked into the new buckets before the table is
+ * published. A lockless reader walking an old chain may get diverted into
+ * a new one and miss its flow: it then takes the locked slow path, which
+ * always sees a consistent unit.
+ */
+static int resize_lru_cache_unit( struct LruCacheUnit *cache_unit, u_int32_t max_size, u_int32_t buckets,
+				  struct LruHashTable **stale )
+{
+	struct LruHashTable	*tbl, *old;
+	struct LruCacheNode	*node, **bucket;
+
+	tbl = alloc_hash_table( buckets );
+	if ( tbl == NULL )
+		return(-ENOMEM);
+
+	spin_lock_bh( &cache_unit->lock );
+	for ( node = cache_unit->list_head; node != NULL; node = node->lru_list.next )
+	{
+		bucket = &tbl->bucket[LRU_HASH_ID( tbl, node->node.key )];
+		node->hash.next = *bucket;
+		*bucket = node;
+	}
+	old = cache_unit->hash;
+	rcu_assign_pointer( cache_unit->hash, tbl );
+
+	cache_unit->max_lru_size = max_size;
+	while ( cache_unit->current_size > cache_unit->max_lru_size )
+		if ( delete_oldest_lru_cache_unit( cache_unit ) < 0 )
+			break;
+	spin_unlock_bh( &cache_unit->lock );
+
+	old->stale = *stale;
+	*stale = old;
+	return(0);
+}
+
+
+int resize_lru_cache( struct LruCache *cache, u_int32_t max_size, u_int32_t buckets )
+{
+	struct LruHashTable *stale = NULL, *tbl;
+	u_int32_t unit_size, unit_buckets;
+	int i, rc = 0;
+
+	lru_unit_geometry( max_size, buckets, &unit_size, &unit_buckets );
+
+	mutex_lock( &lru_resize_mutex );
+	for ( i = 0; i < NUM_LRU_CACHE_UNITS; i++ )
+	{
+		if ( (rc = resize_lru_cache_unit( &cache->units[i], unit_size, unit_buckets, &stale ) ) < 0 )
+			break;
+		cond_resched();
+	}
+
+	/* one grace period for all the old tables, lockless readers may still walk them */
+	synchronize_rcu();
+	while ( (tbl = stale) != NULL )
+	{
+		stale = tbl->stale;
+		free_hash_table( tbl );
+	}
+
+	if ( rc == 0 )
+	{
+		cache_size	= max_size;
+		cache_buckets	= buckets;
+	} else
+		pr_err( "[NDPI] cache resize stopped at unit %d, out of memory\n", i );
+	mutex_unlock( &lru_resize_mutex );
+
+	return(rc);
+}
+
+
+/* ************************************ */
+
+static bool lru_entry_expired( const struct LruCacheEntryValue *entry, u_int32_t now )
+{
+	unsigned int timeout;
+
+	if ( !entry->protocol_detected )
+		timeout = expire_undetected;
+	else if ( entry->l4proto == IPPROTO_TCP )
+		timeout = expire_tcp;
+	else
+		timeout = expire_udp;
+
+	return timeout && (int32_t) (now - entry->last_seen) > (int32_t) (timeout * HZ);
+}
+
+
+static void expire_lru_cache_unit( struct LruCacheUnit *cache_unit, u_int32_t now )
+{
+	struct LruCacheNode *node, *next;
+
+	rcu_read_lock();
+	spin_lock_bh( &cache_unit->lock );
+	for ( node = cache_unit->list_head; node != NULL; node = next )
+	{
+		next = node->lru_list.next;
+
+		/* a NULL ct is left by a packet that could not get DPI state */
+		if ( node->node.value.ct != NULL && !lru_entry_ct_dead( &node->node.value )
+		     && !lru_entry_expired( &node->node.value, now ) )
+			continue;
+
+		/*
+		 * Without ct events nobody else tells the early table the ct is
+		 * gone. A ct already reused for another flow no longer hashes to
+		 * our tuples: those slots are reaped by the next probe instead.
+		 */
+		if ( node->node.value.ct != NULL && entry_matches_ct( &node->node.value, node->node.value.ct )
+		     && lru_entry_ct_dead( &node->node.value ) )
+			ndpi_early_forget( node->node.value.ct );
+
+		delete_node_from_hash( cache_unit, node );
+		delete_node_from_lru_list( cache_unit, node );
+		free_LruCacheEntryValue( &node->node.value );
+		freeCacheNode( node );
+		cache_unit->current_size--;
+		NDPI_STAT_INC( NDPI_STAT_EXPIRED );
+	}
+	spin_unlock_bh( &cache_unit->lock );
+	rcu_read_unlock();
+}
+
+
+static void lru_sweep( unsigned long data )
+{
+	struct LruCache	*cache	= (struct LruCache *) data;
+	u_int32_t	now	= (u_int32_t) jiffies;
+	int		i;
+
+	for ( i = 0; i < LRU_SWEEP_UNITS; i++ )
+	{
+		expire_lru_cache_unit( &cache->units[lru_sweep_next], now );
+		lru_sweep_next = (lru_sweep_next + 1) & (NUM_LRU_CACHE_UNITS - 1);
+	}
+
+	mod_timer( &lru_sweep_timer, jiffies + HZ / LRU_SWEEP_TICKS_PER_SEC );
+}
+
+
+/* ************************************ */
+
+u_int32_t lru_cache_flows( struct LruCache *cache )
+{
+	u_int32_t	flows = 0;
+	int		i;
+
+	for ( i = 0; i < NUM_LRU_CACHE_UNITS; i++ )
+		flows += ACCESS_ONCE( cache->units[i].current_size );
+
+	return(flows);
+}
+
+
+u_int32_t lru_cache_inspecting( void )
+{
+	return(atomic_read( &lru_dpi_count ) );
 }
 
 
@@ -358,28 +754,97 @@ int init_lru_engine( void )
 {
 	traceLRU = 0;
 
+	if ( !lru_cache_geometry_valid( cache_size, cache_buckets ) )
+	{
+		pr_err( "[NDPI] invalid cache_size %u or cache_buckets %u\n", cache_size, cache_buckets );
+		return(-EINVAL);
+	}
+
+	lru_node_cache = kmem_cache_create( "xt_ndpi_lru_node", sizeof(struct LruCacheNode), 0, SLAB_HWCACHE_ALIGN, NULL );
+	if ( lru_node_cache == NULL )
+		goto out_cache;
+	lru_node_pool = mempool_create_slab_pool( flow_reserve, lru_node_cache );
+	if ( lru_node_pool == NULL )
+		goto out_pool;
+	lru_dpi_cache = kmem_cache_create( "xt_ndpi_dpi_state", sizeof(struct LruCacheDpiState), 0, SLAB_HWCACHE_ALIGN, NULL );
+	if ( lru_dpi_cache == NULL )
+		goto out_dpi;
+
 	lru_cache = kmalloc( sizeof(struct LruCache), GFP_KERNEL );
 	if ( lru_cache == NULL )
 	{
 		pr_info( "[NDPI] ERROR: Null cache" );
-		return(-1);
+		goto out_lru;
 	}
 
-	init_lru_cache( lru_cache, CACHE_SIZE);
+	if ( init_lru_cache( lru_cache, cache_size, cache_buckets ) < 0 )
+	{
+		kfree( lru_cache );
+		lru_cache = NULL;
+		goto out_lru;
+	}
+
+	setup_timer( &lru_sweep_timer, lru_sweep, (unsigned long) lru_cache );
 	return(0);
+out_lru:
+	kmem_cache_destroy( lru_dpi_cache );
+	lru_dpi_cache = NULL;
+out_dpi:
+	mempool_destroy( lru_node_pool );
+	lru_node_pool = NULL;
+out_pool:
+	kmem_cache_destroy( lru_node_cache );
+	lru_node_cache = NULL;
+out_cache:
+	return(-ENOMEM);
 }
 
 
 /* ************************************ */
 
+/*
+ * The sweeper counts into the stats and unpublishes early verdicts, so it
+ * only runs while every engine is up: started last, stopped first.
+ */
+void lru_sweep_start( void )
+{
+	mod_timer( &lru_sweep_timer, jiffies + HZ / LRU_SWEEP_TICKS_PER_SEC );
+}
+
+
+void lru_sweep_stop( void )
+{
+	if ( lru_cache )
+		del_timer_sync( &lru_sweep_timer );
+}
+
+
 void term_lru_engine( void )
 {
 	if ( lru_cache )
 	{
+		del_timer_sync( &lru_sweep_timer );
 		free_lru_cache( lru_cache );
 		kfree( lru_cache );
         lru_cache = NULL;
 	}
+	/* the nodes go back to the pool after a grace period */
+	rcu_barrier();
+	if ( lru_dpi_cache )
+	{
+		kmem_cache_destroy( lru_dpi_cache );
+		lru_dpi_cache = NULL;
+	}
+	if ( lru_node_pool )
+	{
+		mempool_destroy( lru_node_pool );
+		lru_node_pool = NULL;
+	}
+	if ( lru_node_cache )
+	{
+		kmem_cache_destroy( lru_node_cache );
+		lru_node_cache = NULL;
+	}
 }
 
 
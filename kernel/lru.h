@@ -9,6 +9,11 @@
  */
 
 #include <linux/time.h>
+#include <linux/jiffies.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/jhash.h>
+#include <net/netfilter/nf_conntrack.h>
 
 #ifdef __i386__
 #define LruKey u_int32_t
@@ -17,26 +22,38 @@
 #define LruKey u_int64_t
 #endif
 
-#define CACHE_SIZE  (32768)
+#define CACHE_SIZE  (32768)         /* default of the cache_size parameter */
 
 #define MAX_MATCH_ABOVE_POOL 4
-struct LruCacheEntryValue {
+
+/* Heavyweight state of a flow still under inspection, dropped once it is classified */
+struct LruCacheDpiState {
 	u_int32_t	num_packets_processed;      /* this count includes SYN/ACK packets for TCP protocl */
-	u_int8_t	protocol_detected, host_name_checked;
 	/* nDPI */
-	u_int16_t		ndpi_proto;
 	struct ndpi_flow_struct *flow;
 	struct ndpi_id_struct	*src, *dst;
+	/* Cache */
+	const struct sk_buff *last_processed_skb;
+	int64_t last_stamp;
+	/* give-up policy */
+	u_int32_t	bytes;
+	unsigned long	first_seen;                 /* jiffies */
+	/* detect_hist */
+	u_int32_t	nsecs;                      /* spent in nDPI so far */
+};
 
+/* What every tracked flow keeps, detected flows only need this much */
+struct LruCacheEntryValue {
 	/* Linux */
 	struct nf_conn	*ct;
-	/* Cache */
-	const struct sk_buff *last_processed_skb;
-	int64_t last_stamp; 
-	u_int32_t	src_ip, dst_ip;
+	struct LruCacheDpiState *dpi;               /* NULL once the flow is classified */
+	u_int32_t	src_ip, dst_ip;                 /* IPv6 addresses are folded, see ndpi_addr32() */
 	u_int16_t	sport, dport;
+	u_int16_t	ndpi_proto;
+	u_int8_t	protocol_detected;
+	u_int8_t	proto, l4proto;
+	u_int32_t	last_seen;                      /* low bits of jiffies, for idle expiry */
 	int16_t 	above[MAX_MATCH_ABOVE_POOL+1];
-	u_int8_t	proto;
 };
 
 struct LruCacheEntry {
@@ -47,17 +64,28 @@ struct LruCacheEntry {
 struct LruCacheNode {
 	struct LruCacheEntry node;
 	struct {
-		struct LruCacheNode *next;              /* Hash collision list */
+		struct LruCacheNode *next;              /* Hash collision list, walked under RCU */
 	} hash;
 
 	struct {
-		struct LruCacheNode *prev, *next;       /* LRU */
+		struct LruCacheNode *prev, *next;       /* LRU, only touched under the unit lock */
 	} lru_list;
+
+	u_int8_t	referenced;                     /* CLOCK bit, set by lookups */
+	struct rcu_head	rcu;
+};
+
+/* Buckets of a unit, replaced as a whole when the cache is resized */
+struct LruHashTable {
+	u_int32_t		size;           /* a power of 2 */
+	struct LruHashTable	*stale;         /* resize: next old table to free */
+	struct LruCacheNode	*bucket[0];
 };
 
 struct LruCacheUnit {
-	u_int32_t		max_lru_size, hash_size, current_size;
-	struct LruCacheNode	**hash;
+	spinlock_t		lock;           /* serializes writers of this unit and its flows */
+	u_int32_t		max_lru_size, current_size;
+	struct LruHashTable	*hash;          /* RCU */
 	struct LruCacheNode	*list_head, *list_tail;
 };
 
@@ -65,24 +93,107 @@ struct LruCacheUnit {
  * #define NUM_LRU_CACHE_UNITS        64
  * #define NUM_LRU_CACHE_UNITS        256 //PT
  */
-#define NUM_LRU_CACHE_UNITS        1024
+#define NUM_LRU_CACHE_UNITS_SHIFT  10
+#define NUM_LRU_CACHE_UNITS        (1 << NUM_LRU_CACHE_UNITS_SHIFT)
 
 struct LruCache {
 	struct LruCacheUnit units[NUM_LRU_CACHE_UNITS];
 };
 
+/* the unit a key lives in, callers take its lock around any access to the key */
+#define LRU_CACHE_UNIT( cache, key )	(&(cache)->units[(key) & (NUM_LRU_CACHE_UNITS - 1)])
+/* the low bits picked the unit, the bucket comes from the bits above them */
+#define LRU_HASH_ID( tbl, key )		((u_int32_t) ((key) >> NUM_LRU_CACHE_UNITS_SHIFT) & ((tbl)->size - 1))
+
+/* once per tick at most, so busy flows don't keep dirtying the line */
+static inline void lru_entry_touch( struct LruCacheEntryValue *entry )
+{
+	u_int32_t now = (u_int32_t) jiffies;
+
+	if ( entry->last_seen != now )
+		entry->last_seen = now;
+}
+
+
+/*
+ * The entry only uses the addresses to notice a recycled ct, so an IPv6
+ * address is folded to 32 bits and IPv4 entries stay as small as they were.
+ */
+static inline u_int32_t ndpi_addr32( const union nf_inet_addr *addr, u_int16_t l3num )
+{
+	if ( l3num == NFPROTO_IPV6 )
+		return jhash2( addr->ip6, 4, 0 );
+	return addr->ip;
+}
+
+
+static inline bool entry_matches_ct( const struct LruCacheEntryValue *entry, const struct nf_conn *ct )
+{
+	const struct nf_conntrack_tuple *t = &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
+	u_int32_t src, dst;
+
+	if ( entry->proto != t->src.l3num )
+		return false;
+
+	src = ndpi_addr32( &t->src.u3, t->src.l3num );
+	dst = ndpi_addr32( &t->dst.u3, t->src.l3num );
+	return ( (entry->src_ip == src) && (entry->dst_ip == dst)
+		 && (entry->sport == t->src.u.all) && (entry->dport == t->dst.u.all) )
+		|| ( (entry->src_ip == dst) && (entry->dst_ip == src)
+		     && (entry->sport == t->dst.u.all) && (entry->dport == t->src.u.all) );
+}
+
+
+/*
+ * Entries hold no reference on their ct, so this is how they learn it is
+ * gone when the DESTROY notifier is not used (ct_events=0). The conntrack
+ * slab is SLAB_DESTROY_BY_RCU: under rcu_read_lock() a freed ct is still
+ * a nf_conn, either unused or reused for another flow.
+ */
+static inline bool lru_entry_ct_dead( const struct LruCacheEntryValue *entry )
+{
+	struct nf_conn *ct = entry->ct;
+
+	return atomic_read( &ct->ct_general.use ) == 0 || nf_ct_is_dying( ct ) || !entry_matches_ct( entry, ct );
+}
+
 /* ************************************ */
 
 extern struct LruCache *lru_cache;
+extern unsigned int cache_size, cache_buckets;
 
 /* ************************************ */
 
-void init_lru_cache( struct LruCache *cache, u_int32_t max_size );
+bool lru_cache_geometry_valid( unsigned long max_size, unsigned long buckets );
+
+
+int init_lru_cache( struct LruCache *cache, u_int32_t max_size, u_int32_t buckets );
+
+
+/*
+ * Process context only. Units are rehashed one at a time, each under its
+ * own lock, so packets only ever wait for the unit they hash to.
+ */
+int resize_lru_cache( struct LruCache *cache, u_int32_t max_size, u_int32_t buckets );
+
+
+/* flows currently held, and how many of them are still inspected */
+u_int32_t lru_cache_flows( struct LruCache *cache );
+
+
+u_int32_t lru_cache_inspecting( void );
 
 
 void free_LruCacheEntryValue( struct LruCacheEntryValue *entry );
 
 
+/* NULL when out of memory or when max_inspecting flows are already in progress */
+struct LruCacheDpiState *alloc_dpi_state( void );
+
+
+void free_dpi_state( struct LruCacheDpiState *dpi );
+
+
 void free_lru_cache( struct LruCache *cache );
 
 
@@ -92,12 +203,21 @@ struct LruCacheNode* add_to_lru_cache( struct LruCache *cache, LruKey key );
 struct LruCacheEntryValue* find_lru_cache( struct LruCache *cache, LruKey key );
 
 
+int delete_from_lru_cache( struct LruCache *cache, LruKey key );
+
+
 void delete_node_from_lru_list( struct LruCacheUnit *cache_unit, struct LruCacheNode *node );
 
 
 int init_lru_engine( void );
 
 
+void lru_sweep_start( void );
+
+
+void lru_sweep_stop( void );
+
+
 void term_lru_engine( void );
 
 
@@ -15,17 +15,34 @@
 #include <linux/if_arp.h>
 #include <linux/ip.h>
 #include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/workqueue.h>
+#include <linux/sched.h>
+#include <linux/vmalloc.h>
 #include <linux/netfilter/x_tables.h>
 #include <linux/types.h>
 #include <linux/netfilter.h>
+#include <net/netfilter/nf_conntrack.h>
 #include <net/netfilter/nf_conntrack_tuple.h>
 #include <net/netfilter/nf_conntrack_ecache.h>
+#include <net/netfilter/nf_conntrack_extend.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/inet.h>
+#include <asm/uaccess.h>
 #include "../include/xt_ndpi.h"
 #include "../include/xt_ndpi_cb.h"
 
 #include "ndpi.h"
 #include "lru.h"
+#include "stats.h"
+#include "policy.h"
+#include "acct.h"
+#include "shaping.h"
+#include "early.h"
+#include "hist.h"
 
 #define MATCH_PASS          0
 #define MATCH_BLOCK         1
@@ -43,7 +60,15 @@ const u_int8_t debug = 0;
 #define PROC_REMOVE( pde, net ) proc_net_remove( net, dir_name )
 #define PDE_ROOT	"xt_ndpi"
 #define PDE_PROTO	"proto"
-static struct proc_dir_entry *pde, *pde_proto;
+#define PDE_STATS	"stats"
+#define PDE_CACHE	"cache"
+#define PDE_POLICY	"policy"
+#define PDE_ACCT	"acct"
+#define PDE_SHAPING	"shaping"
+#define PDE_EARLY	"early"
+#define PDE_HIST	"hist"
+#define PDE_FLOWS	"flows"
+static struct proc_dir_entry *pde, *pde_proto, *pde_stats, *pde_cache, *pde_policy, *pde_acct, *pde_shaping, *pde_early, *pde_hist, *pde_flows;
 
 
 /*
@@ -52,6 +77,326 @@ static struct proc_dir_entry *pde, *pde_proto;
  */
 const u_int8_t guess_protocol = 1;
 
+/*
+ * At most this many bytes from the IP header on are handed to nDPI.
+ * Linear skbs are inspected in place, the others get the window copied
+ * into a per-CPU scratch buffer of this size.
+ */
+static unsigned int inspect_window = 2048;
+module_param( inspect_window, uint, 0444 );
+MODULE_PARM_DESC( inspect_window, "bytes of each packet inspected by nDPI (default 2048, max 65535)" );
+
+static DEFINE_PER_CPU( u_int8_t *, ndpi_scratch );
+
+/*
+ * Tag of the classification stored in NDPI_CB(skb). Received packets get
+ * their own tstamp (see net_enable_timestamp() in ndpi_init), but locally
+ * generated ones keep 0 until they leave, so the skb address and a header
+ * field that changes from packet to packet (the IP id, or the TCP sequence
+ * over IPv6) go in as well. What another layer or an earlier packet left in
+ * skb->cb then does not pass for ours.
+ */
+static u_int32_t ndpi_cb_secret __read_mostly;
+
+static inline u_int32_t ndpi_cb_packet_id( const struct sk_buff *skb, const struct nf_conn *ct )
+{
+	const struct ipv6hdr	*ip6;
+	__be32			seq, *p;
+
+	if ( nf_ct_l3num( ct ) != NFPROTO_IPV6 )
+		return ip_hdr( skb )->id;
+
+	ip6 = ipv6_hdr( skb );
+	if ( ip6->nexthdr != IPPROTO_TCP )
+		return ip6->payload_len;
+	p = skb_header_pointer( skb, skb_network_offset( skb ) + sizeof(*ip6) + offsetof( struct tcphdr, seq ),
+				sizeof(seq), &seq );
+	return p ? *p : 0;
+}
+
+
+static inline u_int32_t ndpi_cb_tag( const struct sk_buff *skb, const struct nf_conn *ct )
+{
+	u_int32_t stamp = (u_int32_t) skb->tstamp.tv64 ^ (u_int32_t) (skb->tstamp.tv64 >> 32);
+
+	return jhash_3words( (u_int32_t) (unsigned long) ct ^ (u_int32_t) (unsigned long) skb,
+			     stamp, ndpi_cb_packet_id( skb, ct ), ndpi_cb_secret ) | 1;
+}
+
+
+/* the first rule seeing the packet accounts it, the others find the tag */
+static inline void ndpi_cb_record( const struct sk_buff *skb, const struct nf_conn *ct, u_int16_t proto )
+{
+	u_int32_t tag = ndpi_cb_tag( skb, ct );
+
+	if ( NDPI_CB( skb ).tag != tag )
+		ndpi_acct_update( ct, proto, skb->len );
+	NDPI_CB_RECORD( skb, proto, tag );
+}
+
+/*
+ * The NDPI target does not need a verdict, so in async mode it only
+ * snapshots the inspection window of undetected packets into a ring and
+ * worker threads run nDPI later. Rings are per CPU and a flow always uses
+ * the same one, so its packets are inspected in order.
+ */
+static int async_classify = 0;
+module_param( async_classify, bool, 0444 );
+MODULE_PARM_DESC( async_classify, "NDPI target inspects packets in worker threads instead of inline (default 0)" );
+
+#define NDPI_ASYNC_RING_SIZE	128	/* a power of 2 */
+
+struct ndpi_async_item {
+	struct nf_conn	*ct;		/* holds a reference while queued */
+	u_int64_t	time;
+	u_int32_t	pkt_len;
+	u_int16_t	ip_len;
+	u_int8_t	*data;		/* inspect_window bytes in the ring buffer */
+};
+
+struct ndpi_async_ring {
+	spinlock_t		lock;
+	u_int32_t		head, tail;	/* producers move head, the worker tail */
+	int			cpu;
+	struct work_struct	work;
+	u_int8_t		*buf;
+	struct ndpi_async_item	item[NDPI_ASYNC_RING_SIZE];
+};
+
+static DEFINE_PER_CPU( struct ndpi_async_ring *, ndpi_async_ring );
+static struct workqueue_struct *ndpi_async_wq;
+
+/*
+ * Detected flows can keep their protocol in a slice of ct->mark, so later
+ * packets are answered from the conntrack itself, even once the cache
+ * entry is gone. The slice holds protocol + 1, 0 means not classified.
+ */
+static unsigned int ct_mark_mask = 0;
+module_param( ct_mark_mask, uint, 0444 );
+MODULE_PARM_DESC( ct_mark_mask, "contiguous ct->mark bits that store the detected protocol, 0 disables (default 0)" );
+
+static bool ct_mark_mask_valid( void )
+{
+	if ( ct_mark_mask == 0 )
+		return true;
+#ifdef CONFIG_NF_CONNTRACK_MARK
+	{
+		u_int32_t bits = ct_mark_mask >> __ffs( ct_mark_mask );
+
+		return (bits & (bits + 1)) == 0;
+	}
+#else
+	return false;
+#endif
+}
+
+#ifdef CONFIG_NF_CONNTRACK_MARK
+/* expected connections inherit the mark of their master, don't trust it */
+static inline int ndpi_ct_mark_get( const struct nf_conn *ct )
+{
+	u_int32_t v;
+
+	if ( ct_mark_mask == 0 || ct->master )
+		return -1;
+
+	v = (ct->mark & ct_mark_mask) >> __ffs( ct_mark_mask );
+	return v ? (int) v - 1 : -1;
+}
+
+static inline void ndpi_ct_mark_set( struct nf_conn *ct, u_int32_t proto )
+{
+	u_int32_t shift, v;
+
+	if ( ct_mark_mask == 0 || ct->master )
+		return;
+
+	shift = __ffs( ct_mark_mask );
+	if ( proto + 1 > (ct_mark_mask >> shift) )
+		return;
+
+	v = (proto + 1) << shift;
+	if ( (ct->mark & ct_mark_mask) != v )
+	{
+		ct->mark = (ct->mark & ~ct_mark_mask) | v;
+		nf_conntrack_event_cache( IPCT_MARK, ct );
+	}
+}
+#else
+static inline int ndpi_ct_mark_get( const struct nf_conn *ct ) { return -1; }
+static inline void ndpi_ct_mark_set( struct nf_conn *ct, u_int32_t proto ) { }
+#endif
+
+/*
+ * A classified flow no loaded ndpi rule matches on does not need the rules
+ * anymore, unless an NDPI --shaping target is loaded. It gets offload_mark
+ * in ct->mark so that a connmark rule at the top of the chains accepts its
+ * packets before anything else runs, e.g.
+ *	iptables -t mangle -I PREROUTING -m connmark --mark 0x80000000/0x80000000 -j ACCEPT
+ * The bits are taken back from every conntrack when a rule starts matching
+ * on a protocol no rule matched on before.
+ */
+static unsigned int offload_mark = 0;
+module_param( offload_mark, uint, 0444 );
+MODULE_PARM_DESC( offload_mark, "ct->mark bits set on classified flows no rule matches on, 0 disables (default 0)" );
+
+#if defined( CONFIG_NF_CONNTRACK_MARK ) || defined( NDPI_CT_EXT_ID )
+/*
+ * Calls fn on every confirmed conntrack, holding a reference on it. The
+ * hash is walked under RCU a bucket at a time, like the readers of
+ * /proc/net/nf_conntrack, so the conntrack lock is never held and packets
+ * keep flowing. Process context, fn must not take the unit lock of ct with
+ * the reference it drops: the last one runs ndpi_ct_ext_destroy().
+ */
+static void ndpi_ct_walk( void (*fn)( struct nf_conn *ct, void *data ), void *data )
+{
+	struct nf_conntrack_tuple_hash	*h;
+	struct hlist_nulls_node		*n;
+	struct nf_conn			*ct;
+	unsigned int			i;
+
+	for ( i = 0; i < nf_conntrack_htable_size; i++ )
+	{
+		rcu_read_lock();
+		hlist_nulls_for_each_entry_rcu( h, n, &init_net.ct.hash[i], hnnode )
+		{
+			if ( NF_CT_DIRECTION( h ) != IP_CT_DIR_ORIGINAL )
+				continue;
+			ct = nf_ct_tuplehash_to_ctrack( h );
+			if ( !atomic_inc_not_zero( &ct->ct_general.use ) )
+				continue;
+			fn( ct, data );
+			nf_ct_put( ct );
+		}
+		rcu_read_unlock();
+		cond_resched();
+	}
+}
+#endif
+
+#ifdef CONFIG_NF_CONNTRACK_MARK
+static inline void ndpi_offload_set( struct nf_conn *ct, u_int16_t proto )
+{
+	if ( offload_mark == 0 || (ct->mark & offload_mark) == offload_mark || ndpi_proto_wanted( proto ) )
+		return;
+
+	ct->mark |= offload_mark;
+	nf_conntrack_event_cache( IPCT_MARK, ct );
+	NDPI_STAT_INC( NDPI_STAT_OFFLOADED );
+}
+
+
+/* only the offloaded flows are written and reported */
+static void ndpi_offload_clear( struct nf_conn *ct, void *data )
+{
+	if ( (ct->mark & offload_mark) != 0 )
+	{
+		local_bh_disable();
+		ct->mark &= ~offload_mark;
+		nf_conntrack_event_cache( IPCT_MARK, ct );
+		local_bh_enable();
+	}
+}
+
+
+static void ndpi_offload_revoke_work( struct work_struct *work )
+{
+	/* packets that checked the old set have set their bits by now */
+	synchronize_net();
+	ndpi_ct_walk( ndpi_offload_clear, NULL );
+	local_bh_disable();
+	NDPI_STAT_INC( NDPI_STAT_OFFLOAD_REVOKED );
+	local_bh_enable();
+}
+
+static DECLARE_WORK( ndpi_offload_work, ndpi_offload_revoke_work );
+
+
+/*
+ * Process context, once a rule made more protocols wanted. The walk is
+ * left to a work item: the checkentries of one table load find it still
+ * pending and share a single pass, started before the table is in place.
+ */
+void ndpi_offload_revoke( void )
+{
+	if ( offload_mark != 0 )
+		schedule_work( &ndpi_offload_work );
+}
+
+
+static void ndpi_offload_flush( void )
+{
+	cancel_work_sync( &ndpi_offload_work );
+}
+#else
+static inline void ndpi_offload_set( struct nf_conn *ct, u_int16_t proto ) { }
+void ndpi_offload_revoke( void ) { }
+static inline void ndpi_offload_flush( void ) { }
+#endif
+
+/*
+ * Inspection budget of each CPU. Once dpi_budget packets were handed to
+ * nDPI within the current jiffy, new flows are not inspected: they are
+ * finalized at once, with the protocol guessed from the ports, and only
+ * one in shed_sample of them is inspected anyway. Flows already under
+ * inspection keep going, so an overload bounds how fast the inspected set
+ * grows instead of starving the packets of it.
+ */
+static unsigned int dpi_budget = 0;
+module_param( dpi_budget, uint, 0644 );
+MODULE_PARM_DESC( dpi_budget, "packets inspected per CPU and jiffy before new flows are shed, 0 disables (default 0)" );
+
+static unsigned int shed_sample = 0;
+module_param( shed_sample, uint, 0644 );
+MODULE_PARM_DESC( shed_sample, "one in that many shed flows is inspected anyway, 0 for none (default 0)" );
+
+struct ndpi_budget {
+	unsigned long	jiffy;
+	u_int32_t	used;
+	u_int32_t	shed;
+};
+
+static DEFINE_PER_CPU( struct ndpi_budget, ndpi_budget );
+
+/* BH disabled, the packet is about to be inspected */
+static inline void ndpi_budget_charge( void )
+{
+	struct ndpi_budget *b;
+
+	if ( ACCESS_ONCE( dpi_budget ) == 0 )
+		return;
+
+	b = &__get_cpu_var( ndpi_budget );
+	if ( b->jiffy != jiffies )
+	{
+		b->jiffy	= jiffies;
+		b->used		= 0;
+	}
+	b->used++;
+}
+
+
+/* true when the new flow has to go without inspection */
+static inline bool ndpi_budget_shed( void )
+{
+	unsigned int		budget = ACCESS_ONCE( dpi_budget ), sample = ACCESS_ONCE( shed_sample );
+	struct ndpi_budget	*b;
+
+	if ( budget == 0 )
+		return false;
+
+	b = &__get_cpu_var( ndpi_budget );
+	if ( b->jiffy != jiffies || b->used < budget )
+		return false;
+
+	if ( sample && ++b->shed % sample == 0 )
+	{
+		NDPI_STAT_INC( NDPI_STAT_SHED_SAMPLED );
+		return false;
+	}
+	NDPI_STAT_INC( NDPI_STAT_SHED );
+	return true;
+}
+
 /* prototype define */
 static int ndpi_process_packet(const struct sk_buff *_skb,
 				 const struct xt_ndpi_protocols *match_info,
@@ -204,7 +549,7 @@ static char* print_lru_ct_entry( struct LruCacheEntryValue *entry, char *buff, u
 		  protoname( entry->proto, buf0, sizeof(buf0) - 1 ),
 		  intoaV4( ntohl( entry->src_ip ), buf1, sizeof(buf1) - 1 ), ntohs( entry->sport ),
 		  intoaV4( ntohl( entry->dst_ip ), buf2, sizeof(buf2) - 1 ), ntohs( entry->dport ),
-		  entry->num_packets_processed,
+		  entry->dpi ? entry->dpi->num_packets_processed : 0,
 		  (entry->ndpi_proto == NOT_YET_PROTOCOL)
 		  ? "NotYet" : ndpi_get_proto_name( ndpi_struct, entry->ndpi_proto )
 		  );
@@ -225,47 +570,206 @@ static void ndpi_flow_end_notify( struct LruCacheEntryValue *entry )
 
 /* ********************************************* */
 
+#ifdef NDPI_CT_EXT_ID
+/*
+ * Flow state kept in a conntrack extension area: found by pointer arithmetic
+ * from the ct and released together with it.
+ * NDPI_CT_EXT_ID must name a nf_ct_ext_id slot nobody else registers
+ * (see kernel/Makefile), otherwise every flow lives in the LRU.
+ */
+static void ndpi_ct_ext_destroy( struct nf_conn *ct )
+{
+	struct LruCacheEntryValue	*entry = __nf_ct_ext_find( ct, NDPI_CT_EXT_ID );
+	struct LruCacheUnit		*unit;
+
+	ndpi_early_forget( ct );
+	if ( entry == NULL )
+		return;
+
+	/*
+	 * The cleanup at unload and the destroy of the last reference
+	 * can run on the same ct: whoever takes the unit lock first releases
+	 * the state, the other one finds entry->ct cleared.
+	 */
+	unit = LRU_CACHE_UNIT( lru_cache, toLruKey( ct ) );
+	spin_lock_bh( &unit->lock );
+	if ( entry->ct )
+	{
+		ndpi_flow_end_notify( entry );
+		free_LruCacheEntryValue( entry );
+		entry->ct = NULL;
+	}
+	spin_unlock_bh( &unit->lock );
+}
+
+
+static struct nf_ct_ext_type ndpi_ct_extend __read_mostly = {
+	.len		= sizeof(struct LruCacheEntryValue),
+	.align		= __alignof__(struct LruCacheEntryValue),
+	.destroy	= ndpi_ct_ext_destroy,
+	.id		= NDPI_CT_EXT_ID,
+};
+
+
+/* release the state of the live conntracks, they outlive the module */
+static int ndpi_ct_ext_cleanup( struct nf_conn *ct, void *data )
+{
+	ndpi_ct_ext_destroy( ct );
+	return(0); /* keep the conntrack */
+}
+#endif
+
+
+/* ********************************************* */
+
+#ifdef CONFIG_NF_CONNTRACK_EVENTS
+/*
+ * Release the LRU entry as soon as its conntrack dies. The kernel has a
+ * single notifier slot and taking it leaves ctnetlink (conntrack -E, conntrackd)
+ * without events, so it is only used with ct_events=1. Otherwise the state
+ * goes with the ct extension, or the LRU sweep frees the entries of dead cts.
+ */
+static int ct_events = 0;
+module_param( ct_events, bool, 0444 );
+MODULE_PARM_DESC( ct_events, "take the conntrack event notifier to free flows on DESTROY, ctnetlink gets no events (default 0)" );
+
+static int ndpi_ct_event( unsigned int events, struct nf_ct_event *item )
+{
+	struct nf_conn			*ct = item->ct;
+	LruKey				key;
+	struct LruCacheUnit		*unit;
+	struct LruCacheEntryValue	*entry;
+
+	if ( !(events & (1 << IPCT_DESTROY) ) )
+		return(0);
+
+	ndpi_early_forget( ct );
+
+	key	= toLruKey( ct );
+	unit	= LRU_CACHE_UNIT( lru_cache, key );
+
+	spin_lock_bh( &unit->lock );
+	entry = find_lru_cache( lru_cache, key );
+	if ( entry && entry->ct == ct )
+	{
+		ndpi_flow_end_notify( entry );
+		delete_from_lru_cache( lru_cache, key );
+	}
+	spin_unlock_bh( &unit->lock );
+
+	return(0);
+}
+
+
+static struct nf_ct_event_notifier ndpi_ct_notifier = {
+	.fcn = ndpi_ct_event,
+};
+
+/* set when the DESTROY notifier could be registered */
+static u_int8_t ct_notifier_registered;
+#endif
+
+
+/* ********************************************* */
+
+/**
+ * find the flow state of ct, creating it if needed
+ * New conntracks get it in their extension area (it can only grow before
+ * the ct is confirmed), flows first seen mid-stream fall back to the LRU.
+ * Caller holds the lock of the LRU unit of key.
+ */
+static struct LruCacheEntryValue *get_flow_entry( struct nf_conn *ct, LruKey key )
+{
+	struct LruCacheNode *node;
+#ifdef NDPI_CT_EXT_ID
+	struct LruCacheEntryValue *entry = __nf_ct_ext_find( ct, NDPI_CT_EXT_ID );
+
+	if ( entry )
+		return(entry);
+
+	if ( !nf_ct_is_confirmed( ct ) )
+	{
+		entry = __nf_ct_ext_add( ct, NDPI_CT_EXT_ID, GFP_ATOMIC );
+		if ( entry )
+		{
+			memset( entry, 0, sizeof(*entry) );
+			return(entry);
+		}
+	}
+#endif
+	node = add_to_lru_cache( lru_cache, key );
+	if ( node == NULL )
+		return(NULL);
+
+	return(&node->node.value);
+}
+
+
+/* Caller holds the unit lock or rcu_read_lock() */
+static struct LruCacheEntryValue *find_flow_entry( struct nf_conn *ct, LruKey key )
+{
+	struct LruCacheEntryValue *entry = NULL;
+
+#ifdef NDPI_CT_EXT_ID
+	entry = __nf_ct_ext_find( ct, NDPI_CT_EXT_ID );
+#endif
+	if ( entry == NULL )
+		entry = find_lru_cache( lru_cache, key );
+
+	return(entry);
+}
+
+
+/* ********************************************* */
+
+/*
+ * ndpi_detected_verdict() reads a detected entry without the unit lock, so
+ * a recycled entry is unpublished before its tuple changes under the reader.
+ */
+static void init_entry_tuple( struct LruCacheEntryValue *entry, struct nf_conn *ct )
+{
+    const struct nf_conntrack_tuple *t = &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
+
+    entry->protocol_detected = 0;
+    smp_wmb();
+    entry->ct = ct;
+    entry->src_ip = ndpi_addr32(&t->src.u3, t->src.l3num);
+    entry->dst_ip = ndpi_addr32(&t->dst.u3, t->src.l3num);
+    entry->sport  = t->src.u.all;
+    entry->dport  = t->dst.u.all;
+    memset(entry->above, 0, sizeof(entry->above));
+    entry->proto  = t->src.l3num;
+    entry->l4proto = t->dst.protonum;
+    lru_entry_touch(entry);
+}
+
+
 static int init_entry_with_ct( struct LruCacheEntryValue *entry, struct nf_conn *ct )
 {
-    int ret = 0;
+    struct LruCacheDpiState *dpi;
+
     debug_print("call %s\n", __FUNCTION__ );
-    if(!entry->src)   entry->src  = kmalloc( ndpi_proto_size, GFP_ATOMIC );
-    if(!entry->dst)   entry->dst  = kmalloc( ndpi_proto_size, GFP_ATOMIC );
-    if(!entry->flow)  entry->flow = kmalloc( ndpi_flow_struct_size, GFP_ATOMIC );
+    if(!entry->dpi)   entry->dpi = alloc_dpi_state();
 
-    if (entry->src == NULL || entry->dst == NULL || entry->flow == NULL) {
-        ret = -1;
-        goto init_entry_alloc_error;
-    }
+    /* out of memory, or too many flows under inspection already */
+    if (entry->dpi == NULL)
+        return -1;
 
     pr_debug("%s:%d: set protocol_detected = 0\n", __FUNCTION__, __LINE__);
-    /* init by declare order */
-    entry->num_packets_processed = 0;
-    entry->protocol_detected     = 0;
-    entry->host_name_checked     = 0;
+    init_entry_tuple(entry, ct);
+    dpi = entry->dpi;
     entry->ndpi_proto            = NDPI_PROTOCOL_UNKNOWN;
-    memset(entry->flow, 0, ndpi_flow_struct_size);
-    memset(entry->src,  0, ndpi_proto_size);
-    memset(entry->dst,  0, ndpi_proto_size);
-    entry->ct = ct;
-    entry->last_processed_skb = NULL;
-    entry->last_stamp = 0;
-    entry->src_ip = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip;
-    entry->dst_ip = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u3.ip;
-    entry->sport  = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.all;
-    entry->dport  = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.all;
-    memset(entry->above, 0, sizeof(entry->above));
-    entry->proto  = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.l3num;
+    dpi->num_packets_processed = 0;
+    memset(dpi->flow, 0, ndpi_flow_struct_size);
+    memset(dpi->src,  0, ndpi_proto_size);
+    memset(dpi->dst,  0, ndpi_proto_size);
+    dpi->last_processed_skb = NULL;
+    dpi->last_stamp = 0;
+    dpi->bytes = 0;
+    dpi->first_seen = jiffies;
+    dpi->nsecs = 0;
 
     return 0;
-
-    /* allocate error */
-init_entry_alloc_error:
-    pr_err("%s:%d: INNER ERROR return -1\n", __FUNCTION__, __LINE__);
-    kfree(entry->src);  entry->src = NULL;
-    kfree(entry->dst);  entry->dst = NULL;
-    kfree(entry->flow); entry->flow = NULL;
-    return ret;
 }
 
 
@@ -287,86 +791,273 @@ static inline void dumpLruCacheEntryValue( struct LruCacheEntryValue *entry, boo
 }
 
 
-/**
- * process a packet
- * _skb: indicate a packet
- * match_info:  if not NULL, this function is invoked by `ndpi_match()`
- * target_info: if not NULL, this function is invoked by `ndpi_tg()`
- * ct:   indicate a fllow containing the packet
- * @return: MATCH_PASS:  pass the packet
- *          MATCH_BLOCK: block the packet
- * NOTE match_info and target_info are that only one is not NULL
+/*
+ * Run nDPI on one packet of a flow still under inspection and decide
+ * whether it is classified now. Caller holds the unit lock.
  */
-static int ndpi_process_packet(const struct sk_buff *_skb,
-				 const struct xt_ndpi_protocols *match_info,
-                 const struct xt_ndpi_tginfo    *target_info,
-                 struct nf_conn *ct)
+static void ndpi_inspect_packet( struct LruCacheEntryValue *entry, struct nf_conn *ct,
+				 const u_int8_t *ip, u_int16_t ip_len, u_int32_t pkt_len, u_int64_t time )
 {
-	LruKey                    key = toLruKey(ct);
-	struct LruCacheEntryValue *entry;
-	struct LruCacheNode       *node;
-	u_int64_t                 time;
-	struct timeval			  tv;
-	const struct iphdr        *iph;
-	u_int16_t                 ip_len;
-	u_int8_t                  *ip;
-	struct sk_buff            *copied_skb;
-#ifdef NDPI_ENABLE_DEBUG_MESSAGES
-	char buff[256];
-#endif
-	int verdict = MATCH_DFL_VERDICT;
-    struct xt_ndpi_protocols dummy_info;
-    struct xt_ndpi_protocols const *info;
+	struct LruCacheDpiState *dpi = entry->dpi;
+	u_int8_t l4proto = nf_ct_protonum( ct );
+	u_int64_t start = 0, nsecs;
 
-    if ((match_info && target_info) || (!match_info && !target_info)) {
-        pr_err("%s:%d: INEER ERROR, match_info and target_info are that only one is not NULL",
-                __FUNCTION__, __LINE__);
-        return MATCH_DFL_VERDICT;
-    }
-    /* Init the dummy xt_ndpi_protocols info for ndpi_tg function to avoid error */
-    if (!match_info && target_info) {
-        debug_print("%s:%d: Init dummy_info for ndpi_tg\n", __FUNCTION__, __LINE__);
-        memset(&dummy_info, 0, sizeof(dummy_info));
-        match_info = &dummy_info;
-    }
-    info = match_info;
+	dpi->num_packets_processed++;
+	dpi->bytes += pkt_len;
+	NDPI_STAT_INC( NDPI_STAT_INSPECTED );
 
-#ifdef NDPI_ENABLE_DEBUG_MESSAGES
-	pr_info( "[NDPI] Begin function ndpi_process_packet(%lu)  nfctinfo:%u\n", (long unsigned int)key, _skb->nfctinfo);
-	ndpi_print_bitmask( info, "--------1) START------------" );
-#endif
+	if ( ndpi_hist_enabled )
+		start = sched_clock();
 
-	/*
-	 * We need that as two chains (e.g. INPUT and OUTPUT) can receive
-	 * packet for the same flow
-	 */
-#ifdef NDPI_ENABLE_DEBUG_MESSAGES
-	pr_info( "[NDPI] add_to_lru#2\n" );
-#endif
-	node = add_to_lru_cache( lru_cache, key );
-#ifdef NDPI_ENABLE_DEBUG_MESSAGES
-	pr_info("[NDPI] add_to_lru over#2\n" );
-#endif
+	/* the dissector lists may be swapped by a rule update */
+	rcu_read_lock();
+	entry->ndpi_proto = ndpi_detection_process_packet( ndpi_struct, dpi->flow, ip, ip_len, time, dpi->src, dpi->dst );
+	rcu_read_unlock();
 
-	if (node == NULL) {
-		pr_warning("%s:%d: add_to_lru_cache() returned NULL\n", __FUNCTION__, __LINE__);
-		return MATCH_DFL_VERDICT;
+	if ( ndpi_hist_enabled )
+	{
+		nsecs = sched_clock() - start;
+		dpi->nsecs += nsecs;
+		ndpi_hist_add( entry->ndpi_proto, NDPI_HIST_CALL_NS, nsecs );
 	}
 
-    entry = &node->node.value;
-
-    /* New entry just created */
-	if (entry->ct == NULL) {
-#ifdef NDPI_ENABLE_DEBUG_MESSAGES
-		pr_info( "[NDPI] New entry just created\n" );
+    /* detected, or the give-up policy says nDPI had its chance (see policy.h) */
+    if ((entry->ndpi_proto != NDPI_PROTOCOL_UNKNOWN && !ndpi_giveup_partial(entry->ndpi_proto))
+            || ndpi_giveup(entry->ndpi_proto, l4proto, dpi)) {
+		if ( (entry->ndpi_proto == NDPI_PROTOCOL_UNKNOWN) && guess_protocol )
+		{
+			entry->ndpi_proto = ndpi_guess_undetected_protocol( ndpi_struct, l4proto,
+									    ntohl( entry->src_ip ), ntohs( entry->sport ),
+									    ntohl( entry->dst_ip ), ntohs( entry->dport ) );
+			if (unlikely( debug ))
+				pr_info( "[NDPI][NDPI2] process dont find, guessed \n" );
+		}
+		/* lockless readers trust ndpi_proto once they see the flag */
+		smp_wmb();
+		entry->protocol_detected = 1;   /* We have made a decision */
+		ndpi_ct_mark_set( ct, entry->ndpi_proto );
+		ndpi_offload_set( ct, entry->ndpi_proto );
+		ndpi_early_publish( ct, entry->ndpi_proto );
+		ndpi_stat_proto( entry->ndpi_proto, 1, 0 );
+		if ( ndpi_hist_enabled )
+		{
+			ndpi_hist_add( entry->ndpi_proto, NDPI_HIST_PACKETS, dpi->num_packets_processed );
+			ndpi_hist_add( entry->ndpi_proto, NDPI_HIST_BYTES, dpi->bytes );
+			ndpi_hist_add( entry->ndpi_proto, NDPI_HIST_FLOW_NS, dpi->nsecs );
+		}
+		if (unlikely( debug ))
+			pr_info( "[NDPI][NDPI2] set protocol_detected=1" );
+
+		free_LruCacheEntryValue( entry ); /* Free nDPI memory */
+
+	} else {
+		/*
+		 * In this case we have not yet detected the protocol but the user has specified unknown as protocol
+		 */
+        if (entry->ndpi_proto == NDPI_PROTOCOL_UNKNOWN)
+            entry->ndpi_proto = NOT_YET_PROTOCOL;
+	}
+}
+
+
+/*
+ * Finalize a new or recycled flow without inspecting it, see dpi_budget.
+ * Caller holds the unit lock.
+ */
+static void ndpi_shed_flow( struct LruCacheEntryValue *entry, struct nf_conn *ct )
+{
+	free_LruCacheEntryValue( entry );
+	init_entry_tuple( entry, ct );
+
+	entry->ndpi_proto = NDPI_PROTOCOL_UNKNOWN;
+	if ( guess_protocol )
+		entry->ndpi_proto = ndpi_guess_undetected_protocol( ndpi_struct, nf_ct_protonum( ct ),
+								    ntohl( entry->src_ip ), ntohs( entry->sport ),
+								    ntohl( entry->dst_ip ), ntohs( entry->dport ) );
+	smp_wmb();
+	entry->protocol_detected = 1;
+	ndpi_ct_mark_set( ct, entry->ndpi_proto );
+	ndpi_offload_set( ct, entry->ndpi_proto );
+	ndpi_early_publish( ct, entry->ndpi_proto );
+	ndpi_stat_proto( entry->ndpi_proto, 1, 0 );
+}
+
+
+/* ********************************************* */
+
+/* Caller holds the unit lock of ct, so bottom halves are off */
+static int ndpi_async_enqueue( struct nf_conn *ct, LruKey key, const u_int8_t *ip, u_int16_t ip_len,
+			       u_int32_t pkt_len, u_int64_t time )
+{
+	struct ndpi_async_ring	*ring;
+	struct ndpi_async_item	*item;
+	int			cpu = key % nr_cpu_ids;
+
+	if ( !cpu_online( cpu ) )
+		cpu = smp_processor_id();
+	ring = per_cpu( ndpi_async_ring, cpu );
+
+	spin_lock( &ring->lock );
+	if ( ring->head - ring->tail >= NDPI_ASYNC_RING_SIZE )
+	{
+		spin_unlock( &ring->lock );
+		NDPI_STAT_INC( NDPI_STAT_ASYNC_FULL );
+		return(-ENOSPC);
+	}
+
+	item = &ring->item[ring->head & (NDPI_ASYNC_RING_SIZE - 1)];
+	nf_conntrack_get( &ct->ct_general );
+	item->ct	= ct;
+	item->time	= time;
+	item->pkt_len	= pkt_len;
+	item->ip_len	= ip_len;
+	memcpy( item->data, ip, ip_len );
+	ring->head++;
+	spin_unlock( &ring->lock );
+
+	queue_work_on( ring->cpu, ndpi_async_wq, &ring->work );
+	NDPI_STAT_INC( NDPI_STAT_ASYNC_QUEUED );
+	return(0);
+}
+
+
+static void ndpi_async_classify( struct ndpi_async_item *item )
+{
+	struct nf_conn			*ct	= item->ct;
+	LruKey				key	= toLruKey( ct );
+	struct LruCacheUnit		*unit	= LRU_CACHE_UNIT( lru_cache, key );
+	struct LruCacheEntryValue	*entry;
+
+	spin_lock_bh( &unit->lock );
+	/* the flow may have been classified, recycled or dropped meanwhile */
+	entry = find_flow_entry( ct, key );
+	if ( entry && entry->ct == ct && !entry->protocol_detected && entry->dpi && entry_matches_ct( entry, ct ) )
+		ndpi_inspect_packet( entry, ct, item->data, item->ip_len, item->pkt_len, item->time );
+	spin_unlock_bh( &unit->lock );
+}
+
+
+/* The slot at tail is only reused once tail moves past it */
+static void ndpi_async_work( struct work_struct *work )
+{
+	struct ndpi_async_ring *ring = container_of( work, struct ndpi_async_ring, work );
+	struct ndpi_async_item *item;
+
+	for ( ;; )
+	{
+		spin_lock_bh( &ring->lock );
+		if ( ring->tail == ring->head )
+		{
+			spin_unlock_bh( &ring->lock );
+			break;
+		}
+		item = &ring->item[ring->tail & (NDPI_ASYNC_RING_SIZE - 1)];
+		spin_unlock_bh( &ring->lock );
+
+		ndpi_async_classify( item );
+		nf_ct_put( item->ct );
+
+		spin_lock_bh( &ring->lock );
+		ring->tail++;
+		spin_unlock_bh( &ring->lock );
+		cond_resched();
+	}
+}
+
+
+/* ********************************************* */
+
+/**
+ * process a packet
+ * _skb: indicate a packet
+ * match_info:  if not NULL, this function is invoked by `ndpi_match()`
+ * target_info: if not NULL, this function is invoked by `ndpi_tg()`
+ * ct:   indicate a fllow containing the packet
+ * @return: MATCH_PASS:  pass the packet
+ *          MATCH_BLOCK: block the packet
+ * NOTE match_info and target_info are that only one is not NULL
+ */
+static int ndpi_process_packet(const struct sk_buff *_skb,
+				 const struct xt_ndpi_protocols *match_info,
+                 const struct xt_ndpi_tginfo    *target_info,
+                 struct nf_conn *ct)
+{
+	LruKey                    key = toLruKey(ct);
+	struct LruCacheEntryValue *entry;
+	struct LruCacheDpiState   *dpi;
+	u_int64_t                 time;
+	struct timeval			  tv;
+	u_int16_t                 ip_len;
+	const u_int8_t            *ip;
+#ifdef NDPI_ENABLE_DEBUG_MESSAGES
+	char buff[256];
 #endif
+	int verdict = MATCH_DFL_VERDICT;
+	int mark_proto;
+    struct xt_ndpi_protocols dummy_info;
+    struct xt_ndpi_protocols const *info;
+
+    if ((match_info && target_info) || (!match_info && !target_info)) {
+        pr_err("%s:%d: INEER ERROR, match_info and target_info are that only one is not NULL",
+                __FUNCTION__, __LINE__);
+        return MATCH_DFL_VERDICT;
+    }
+    /* Init the dummy xt_ndpi_protocols info for ndpi_tg function to avoid error */
+    if (!match_info && target_info) {
+        debug_print("%s:%d: Init dummy_info for ndpi_tg\n", __FUNCTION__, __LINE__);
+        memset(&dummy_info, 0, sizeof(dummy_info));
+        match_info = &dummy_info;
+    }
+    info = match_info;
+
+#ifdef NDPI_ENABLE_DEBUG_MESSAGES
+	pr_info( "[NDPI] Begin function ndpi_process_packet(%lu)  nfctinfo:%u\n", (long unsigned int)key, _skb->nfctinfo);
+	ndpi_print_bitmask( info, "--------1) START------------" );
+#endif
+
+	/*
+	 * We need that as two chains (e.g. INPUT and OUTPUT) can receive
+	 * packet for the same flow
+	 */
+#ifdef NDPI_ENABLE_DEBUG_MESSAGES
+	pr_info( "[NDPI] add_to_lru#2\n" );
+#endif
+	entry = get_flow_entry( ct, key );
+#ifdef NDPI_ENABLE_DEBUG_MESSAGES
+	pr_info("[NDPI] add_to_lru over#2\n" );
+#endif
+
+	if (entry == NULL) {
+		pr_warning("%s:%d: get_flow_entry() returned NULL\n", __FUNCTION__, __LINE__);
+		return MATCH_DFL_VERDICT;
+	}
+
+    /* New entry just created */
+	if (entry->ct == NULL) {
+#ifdef NDPI_ENABLE_DEBUG_MESSAGES
+		pr_info( "[NDPI] New entry just created\n" );
+#endif
+        NDPI_STAT_INC(NDPI_STAT_NEW_FLOW);
+
+        /* The cache lost the flow but the conntrack still knows its protocol */
+        if ((mark_proto = ndpi_ct_mark_get(ct)) >= 0) {
+            init_entry_tuple(entry, ct);
+            entry->ndpi_proto = mark_proto;
+            smp_wmb();
+            entry->protocol_detected = 1;
+
+        /* over the inspection budget of this CPU */
+        } else if (ndpi_budget_shed()) {
+            ndpi_shed_flow(entry, ct);
+
         /* init the new entry */
-		if (init_entry_with_ct(entry, ct) != 0) {
+        } else if (init_entry_with_ct(entry, ct) != 0) {
 			/*
-			 * Not enough memory: we let the LRU polish the cache
-			 * without explicitly deleting the entry
+			 * No inspection slot: we let the LRU polish the cache
+			 * without explicitly deleting the entry, the next packet retries
 			 */
-			pr_warning("%s:%d Found NEW flow but NOT ENOUGH MEMORY!\n", __FUNCTION__, __LINE__);
+			if (unlikely(debug))
+				pr_warning("%s:%d Found NEW flow but no DPI state available\n", __FUNCTION__, __LINE__);
 			return MATCH_DFL_VERDICT;
         }
 #ifdef NDPI_ENABLE_DEBUG_MESSAGES
@@ -376,19 +1067,9 @@ static int ndpi_process_packet(const struct sk_buff *_skb,
 
     /* The existing entry */
 	} else {
+        lru_entry_touch(entry);
         /* Looks like netfilter recycles stuff */
-		if (
-			( (entry->src_ip == ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip)
-			  && (entry->dst_ip == ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u3.ip)
-			  && (entry->sport == ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.all)
-			  && (entry->dport == ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.all)
-			  && (entry->proto == ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.l3num) )
-			||
-			( (entry->src_ip == ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u3.ip)
-			  && (entry->dst_ip == ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip)
-			  && (entry->sport == ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.all)
-			  && (entry->dport == ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.all)
-			  && (entry->proto == ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.l3num) ) )
+		if ( entry_matches_ct( entry, ct ) )
 		{
 #ifdef NDPI_ENABLE_DEBUG_MESSAGES
 			if ( (htons( entry->sport ) != 22) && (htons( entry->dport ) != 22) )
@@ -404,9 +1085,12 @@ static int ndpi_process_packet(const struct sk_buff *_skb,
 #endif
             /* Export all data */
             ndpi_flow_end_notify( entry );
+            NDPI_STAT_INC( NDPI_STAT_RECYCLED );
 
             /* Reset data and start over */
-			if (init_entry_with_ct( entry, ct ) != 0) {
+			if (ndpi_budget_shed()) {
+				ndpi_shed_flow( entry, ct );
+			} else if (init_entry_with_ct( entry, ct ) != 0) {
                 pr_warning("%s:%d Fail will cause flow is NULL\n", __FUNCTION__, __LINE__);
                 return MATCH_DFL_VERDICT;
 			}
@@ -417,7 +1101,7 @@ static int ndpi_process_packet(const struct sk_buff *_skb,
 	if ( !entry->protocol_detected ) {
         if (unlikely( debug ))
             pr_info( "[NDPI]  Found existing not detected flow [key: %lu][num_packets_processed: %u]\n",
-                    (long unsigned int) key, entry->num_packets_processed );
+                    (long unsigned int) key, entry->dpi->num_packets_processed );
 	}
 #endif
 
@@ -434,93 +1118,60 @@ static int ndpi_process_packet(const struct sk_buff *_skb,
                     (entry->ndpi_proto == NOT_YET_PROTOCOL)? "NotYet": ndpi_get_proto_name(ndpi_struct, entry->ndpi_proto) );
 		if (unlikely( debug ))
 			pr_info( "[NDPI] Found existing detected flow detected  [key: %lu][num_packets_processed: %u]. Returning verdict %d \n",
-				 (long unsigned int) key, entry->num_packets_processed, verdict );
+				 (long unsigned int) key, entry->dpi ? entry->dpi->num_packets_processed : 0, verdict );
 #endif
 		dumpLruCacheEntryValue( entry, verdict );
-		NDPI_CB_RECORD( _skb, entry );
+		ndpi_cb_record( _skb, ct, entry->ndpi_proto );
+		ndpi_stat_proto( entry->ndpi_proto, 0, _skb->len );
 
 		return verdict;
 	}
 
 	/* PT:here my some influence */
-	if ( entry->last_processed_skb == _skb && entry ->last_stamp == _skb -> tstamp.tv64) {
+	dpi = entry->dpi;
+	if ( dpi->last_processed_skb == _skb && dpi->last_stamp == _skb -> tstamp.tv64) {
 		/*
 		 * This looks a duplicated packet, so let's discard it as it was probably
 		 * processed by another nDPI-based rule
 		 */
         debug_print( "[NDPI] Duplicated packet, discard it\n" );
-		NDPI_CB_RECORD( _skb, entry );
+		NDPI_STAT_INC( NDPI_STAT_DUPLICATE );
+		ndpi_cb_record( _skb, ct, entry->ndpi_proto );
 
         /* FTP_CONTROL never be mark as detected */
 		verdict = GET_MATCH_ABOVE(info, entry, NDPI_COMPARE_PROTOCOL_TO_BITMASK(info->protocols, entry->ndpi_proto))? MATCH_BLOCK: MATCH_PASS;
         return verdict;
 	}
 
-    entry->last_processed_skb = _skb;
-	entry->last_stamp = _skb->tstamp.tv64;
+    dpi->last_processed_skb = _skb;
+	dpi->last_stamp = _skb->tstamp.tv64;
 
-	copied_skb = skb_copy( _skb, GFP_ATOMIC );
-	
-	if ( copied_skb == NULL ) {
+	/* nDPI only needs the headers and the first bytes of payload */
+	ip_len = min_t( unsigned int, _skb->len - skb_network_offset( _skb ), inspect_window );
+	ip = skb_header_pointer( _skb, skb_network_offset( _skb ), ip_len, __get_cpu_var( ndpi_scratch ) );
+	if ( ip == NULL ) {
+		NDPI_STAT_INC( NDPI_STAT_SKB_FAIL );
 		if (unlikely( debug ))
-			pr_info( "[NDPI] skb_copy() failed.\n" );
+			pr_info( "[NDPI] skb_header_pointer() failed.\n" );
 		return verdict;
 	}
 
-	iph	= ip_hdr(copied_skb);
-	ip_len	= copied_skb->len, ip = (u_int8_t *) iph;
 	if (unlikely( debug ))
-		pr_info( "[NDPI] ndpi_process_packet(%p, ip_len=%u)\n", _skb, copied_skb->len );
+		pr_info( "[NDPI] ndpi_process_packet(%p, ip_len=%u)\n", _skb, ip_len );
 
 	do_gettimeofday( &tv );
 	time = ( (u_int64_t) tv.tv_sec) * ndpi_detection_tick_resolution + tv.tv_usec / (1000000 / ndpi_detection_tick_resolution);
+	ndpi_budget_charge();
 
-	entry->num_packets_processed++;
+	if ( target_info == NULL || ndpi_async_wq == NULL
+	     || ndpi_async_enqueue( ct, key, ip, ip_len, _skb->len - skb_network_offset( _skb ), time ) < 0 )
+		ndpi_inspect_packet( entry, ct, ip, ip_len, _skb->len - skb_network_offset( _skb ), time );
+	else if ( entry->ndpi_proto == NDPI_PROTOCOL_UNKNOWN )
+		entry->ndpi_proto = NOT_YET_PROTOCOL;
 
-	entry->ndpi_proto = ndpi_detection_process_packet( ndpi_struct, entry->flow, ip, ip_len, time, entry->src, entry->dst );
-
-    if (entry->ndpi_proto != NDPI_PROTOCOL_FTP_CONTROL   /* always check ftp_control */
-            && (   (entry->ndpi_proto == NDPI_PROTOCOL_HTTP && entry->flow->packet_counter >= 5)  /* give up after some counts */
-                || (iph->protocol == IPPROTO_UDP && entry->num_packets_processed >= 20)
-                || (iph->protocol == IPPROTO_TCP && entry->num_packets_processed >= 20)
-                || (entry->ndpi_proto != NDPI_PROTOCOL_UNKNOWN && entry->ndpi_proto != NDPI_PROTOCOL_HTTP))) {
-		entry->protocol_detected = 1;   /* We have made a decision */
-		if (unlikely( debug ))
-			pr_info( "[NDPI][NDPI2] set protocol_detected=1" );
-		if ( (entry->ndpi_proto == NDPI_PROTOCOL_UNKNOWN) && guess_protocol )
-		{
-			entry->ndpi_proto = ndpi_guess_undetected_protocol( ndpi_struct, iph->protocol,
-									    ntohl( entry->src_ip ), ntohs( entry->sport ),
-									    ntohl( entry->dst_ip ), ntohs( entry->dport ) );
-			if (unlikely( debug ))
-				pr_info( "[NDPI][NDPI2] process dont find, guessed \n" );
-		}
-
-		NDPI_CB_RECORD( _skb, entry );
-		verdict = GET_MATCH_ABOVE(info, entry, NDPI_COMPARE_PROTOCOL_TO_BITMASK(info->protocols, entry->ndpi_proto))? MATCH_BLOCK: MATCH_PASS;
-#ifdef NDPI_ENABLE_DEBUG_MESSAGES
-		pr_info( "[NDPI] line:374 after guessed, verdict %d [Proto: %s]\n", verdict, (entry->ndpi_proto == NOT_YET_PROTOCOL)
-			 ? "NotYet" : ndpi_get_proto_name( ndpi_struct, entry->ndpi_proto ) );
-
-#endif
-		free_LruCacheEntryValue( entry ); /* Free nDPI memory */
-
-	} else {
-		/*
-		 * In this case we have not yet detected the protocol but the user has specified unknown as protocol
-		 */
-        if (entry->ndpi_proto == NDPI_PROTOCOL_UNKNOWN)
-            entry->ndpi_proto = NOT_YET_PROTOCOL;
-		verdict = GET_MATCH_ABOVE(info, entry, NDPI_COMPARE_PROTOCOL_TO_BITMASK(info->protocols, entry->ndpi_proto))? MATCH_BLOCK: MATCH_PASS;
-		NDPI_CB_RECORD(_skb,entry);
-#ifdef NDPI_ENABLE_DEBUG_MESSAGES
-		pr_info( "[NDPI] line:%d force set proto=NOT_YET_PROTOCOL  skip compare verdict %d [Proto: %s] num_packets_processed:%u\n",
-                __LINE__, verdict, (entry->ndpi_proto == NOT_YET_PROTOCOL)
-			 ? "NotYet" : ndpi_get_proto_name( ndpi_struct, entry->ndpi_proto ), entry->num_packets_processed);
-#endif
-	}
-
-	kfree_skb( copied_skb );
+	verdict = GET_MATCH_ABOVE(info, entry, NDPI_COMPARE_PROTOCOL_TO_BITMASK(info->protocols, entry->ndpi_proto))? MATCH_BLOCK: MATCH_PASS;
+	ndpi_cb_record( _skb, ct, entry->ndpi_proto );
+	ndpi_stat_proto( entry->ndpi_proto, 0, _skb->len );
 
 #ifdef NDPI_ENABLE_DEBUG_MESSAGES
 	pr_info( "[NDPI] Returning verdict %d [Proto: %s]\n", verdict, (entry->ndpi_proto == NOT_YET_PROTOCOL)
@@ -536,6 +1187,109 @@ static int ndpi_process_packet(const struct sk_buff *_skb,
 }
 
 
+/* ********************************************* */
+
+/* -1 when a --match-above rule has to update the per-flow counters */
+static inline int ndpi_proto_verdict( const struct xt_ndpi_protocols *info, int proto )
+{
+	if ( info == NULL || !NDPI_COMPARE_PROTOCOL_TO_BITMASK( info->protocols, proto ) )
+		return MATCH_PASS;
+	if ( info->match_above < 0 )
+		return MATCH_BLOCK;
+	return -1;
+}
+
+
+/*
+ * Lockless verdict for flows that are already classified, which is what
+ * almost every packet hits. The protocol comes from ct->mark when
+ * ct_mark_mask is set, from the flow cache otherwise. Returns -1 when the
+ * slow path has to run: unknown or undetected flow, or a --match-above
+ * rule that has to update the per-flow counters.
+ */
+static int ndpi_detected_verdict( const struct sk_buff *skb,
+				  const struct xt_ndpi_protocols *info,
+				  struct nf_conn *ct )
+{
+	struct LruCacheEntryValue *entry = NULL;
+	int proto = ndpi_ct_mark_get( ct );
+	int verdict = -1;
+
+	if ( proto < 0 )
+	{
+		rcu_read_lock();
+		entry = find_flow_entry( ct, toLruKey( ct ) );
+		if ( entry && entry->protocol_detected )
+		{
+			/* pairs with init_entry_tuple() and the publication of the protocol */
+			smp_rmb();
+			if ( entry->ct == ct && entry_matches_ct( entry, ct ) )
+			{
+				proto = entry->ndpi_proto;
+				smp_rmb();
+				/* recycled under us */
+				if ( entry->protocol_detected )
+					lru_entry_touch( entry );
+				else
+					proto = -1;
+			}
+		}
+		rcu_read_unlock();
+
+		if ( proto < 0 )
+			return -1;
+	}
+
+	/*
+	 * OUTPUT packets get here in process context with BH enabled: the
+	 * per CPU counters and accounting slots below must not be shared
+	 * with a softirq or another CPU half way through an update.
+	 */
+	local_bh_disable();
+	/* classified before the rules that wanted it were removed */
+	ndpi_offload_set( ct, proto );
+	/* or before its application got an early action */
+	ndpi_early_publish( ct, proto );
+
+	verdict = ndpi_proto_verdict( info, proto );
+	if ( verdict >= 0 )
+	{
+		ndpi_cb_record( skb, ct, proto );
+		NDPI_STAT_INC( NDPI_STAT_FAST_PATH );
+		ndpi_stat_proto( proto, 0, skb->len );
+	}
+	local_bh_enable();
+
+	return verdict;
+}
+
+
+/* ********************************************* */
+
+/*
+ * An earlier ndpi rule or the NDPI target has classified this very skb:
+ * answer from skb->cb, no lock and no flow lookup.
+ */
+static int ndpi_cb_verdict( const struct sk_buff *skb,
+			    const struct xt_ndpi_protocols *info,
+			    const struct nf_conn *ct )
+{
+	int verdict;
+
+	if ( NDPI_CB( skb ).tag != ndpi_cb_tag( skb, ct ) )
+		return -1;
+
+	verdict = ndpi_proto_verdict( info, NDPI_CB( skb ).ndpi_proto );
+	if ( verdict >= 0 )
+	{
+		local_bh_disable();
+		NDPI_STAT_INC( NDPI_STAT_CB_HIT );
+		local_bh_enable();
+	}
+	return verdict;
+}
+
+
 /* ********************************************* */
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION( 2, 6, 35 )
@@ -547,6 +1301,7 @@ static bool ndpi_match( const struct sk_buff *skb, struct xt_action_param *par )
 	int verdict;
 	struct nf_conn *ct;
     enum ip_conntrack_info ctinfo;
+    struct LruCacheUnit *unit;
 	const struct xt_ndpi_protocols *match_info = par->matchinfo;
 	if (unlikely( debug ))
 		pr_info( "[NDPI] ndpi_match fragoff:%d thoff:%u hooknum:%u family:%u hotdrop:%d\n", par->fragoff, par->thoff, par->hooknum, par->family, *par->hotdrop );
@@ -565,10 +1320,17 @@ static bool ndpi_match( const struct sk_buff *skb, struct xt_action_param *par )
 		return MATCH_PASS;
 	}
 
-	/* process the packet */
-    spin_lock_bh(&ndpi_lock);
+	verdict = ndpi_cb_verdict(skb, match_info, ct);
+	if (verdict < 0)
+		verdict = ndpi_detected_verdict(skb, match_info, ct);
+	if (verdict >= 0)
+		return verdict;
+
+	/* process the packet, only flows sharing the LRU unit are serialized */
+    unit = LRU_CACHE_UNIT(lru_cache, toLruKey(ct));
+    spin_lock_bh(&unit->lock);
 	verdict = ndpi_process_packet(skb, match_info, NULL, ct);
-    spin_unlock_bh(&ndpi_lock);
+    spin_unlock_bh(&unit->lock);
 
 	if (unlikely(debug) &&  verdict == MATCH_BLOCK)
 		pr_debug( "[NDPI] Dropping ...\n" );
@@ -577,6 +1339,35 @@ static bool ndpi_match( const struct sk_buff *skb, struct xt_action_param *par )
 }
 
 
+/* only the dissectors of the protocols some rule matches on are run */
+#if LINUX_VERSION_CODE < KERNEL_VERSION( 2, 6, 35 )
+static bool ndpi_mt_check( const struct xt_mtchk_param *par )
+#else
+static int ndpi_mt_check( const struct xt_mtchk_param *par )
+#endif
+{
+	const struct xt_ndpi_protocols *info = par->matchinfo;
+	int rc = ndpi_dispatch_get( &info->protocols );
+
+	/* flows of these protocols have to go through the rules again */
+	if ( rc > 0 )
+		ndpi_offload_revoke();
+#if LINUX_VERSION_CODE < KERNEL_VERSION( 2, 6, 35 )
+	return(rc >= 0);
+#else
+	return(rc < 0 ? rc : 0);
+#endif
+}
+
+
+static void ndpi_mt_destroy( const struct xt_mtdtor_param *par )
+{
+	const struct xt_ndpi_protocols *info = par->matchinfo;
+
+	ndpi_dispatch_put( &info->protocols );
+}
+
+
 /* ********************************************************** */
 
 static struct xt_match ndpi_regs[] __read_mostly = {
@@ -585,9 +1376,23 @@ static struct xt_match ndpi_regs[] __read_mostly = {
 		.revision	= 0,
 		.family		= NFPROTO_IPV4,
 		.match		= ndpi_match,
+		.checkentry	= ndpi_mt_check,
+		.destroy	= ndpi_mt_destroy,
 		.matchsize	= sizeof(struct xt_ndpi_protocols),
 		.me		= THIS_MODULE,
-	}
+	},
+#ifdef NDPI_DETECTION_SUPPORT_IPV6
+	{
+		.name		= "ndpi",
+		.revision	= 0,
+		.family		= NFPROTO_IPV6,
+		.match		= ndpi_match,
+		.checkentry	= ndpi_mt_check,
+		.destroy	= ndpi_mt_destroy,
+		.matchsize	= sizeof(struct xt_ndpi_protocols),
+		.me		= THIS_MODULE,
+	},
+#endif
 };
 
 static int nproto_proc_read( char *page, char **start, off_t off, int count, int *eof, void *data )
@@ -606,6 +1411,376 @@ static int nproto_proc_read( char *page, char **start, off_t off, int count, int
 }
 
 
+/* occupancy of the flow cache, writing "<flows> [<buckets>]" resizes it */
+static int ncache_proc_read( char *page, char **start, off_t off, int count, int *eof, void *data )
+{
+	return(sprintf( page, "size %u\nbuckets %u\nflows %u\ninspecting %u\nevicted %llu\n",
+			cache_size, cache_buckets ? cache_buckets : 4 * cache_size,
+			lru_cache_flows( lru_cache ), lru_cache_inspecting(),
+			(unsigned long long) ndpi_stat_sum( NDPI_STAT_EVICTED ) ) );
+}
+
+
+static int ncache_proc_write( struct file *file, const char __user *buffer, unsigned long count, void *data )
+{
+	char		buf[32], *end;
+	unsigned long	size, buckets = 0;
+	int		rc;
+
+	if ( count == 0 || count >= sizeof(buf) )
+		return(-EINVAL);
+	if ( copy_from_user( buf, buffer, count ) )
+		return(-EFAULT);
+	buf[count] = '\0';
+
+	size = simple_strtoul( buf, &end, 0 );
+	while ( *end == ' ' )
+		end++;
+	if ( *end != '\0' && *end != '\n' )
+		buckets = simple_strtoul( end, &end, 0 );
+	if ( !lru_cache_geometry_valid( size, buckets ) )
+		return(-EINVAL);
+
+	rc = resize_lru_cache( lru_cache, size, buckets );
+	return(rc < 0 ? rc : count);
+}
+
+
+/* ********************************************************** */
+
+/*
+ * Classified flows across a module reload. Reading /proc/xt_ndpi/flows
+ * lists them, one per line:
+ *	<l3num> <l4num> <src> <sport> <dst> <dport> <protocol name>
+ * the tuple being the original direction of the conntrack, and writing
+ * these lines back hands the protocols to the conntracks still alive:
+ *	cat /proc/xt_ndpi/flows > /var/run/xt_ndpi.flows
+ *	rmmod xt_ndpi; modprobe xt_ndpi
+ *	cat /var/run/xt_ndpi.flows > /proc/xt_ndpi/flows
+ * Names are saved instead of ids, so an upgrade may renumber protocols.
+ * Flows whose entry is gone but whose protocol is in ct->mark (ct_mark_mask)
+ * are not listed, the mark outlives the module anyway.
+ */
+struct ndpi_saved_flow {
+	struct nf_conntrack_tuple	tuple;
+	u_int16_t			proto;
+};
+
+struct ndpi_flow_dump {
+	u_int32_t		n, max;
+	u_int8_t		truncated;
+	struct ndpi_saved_flow	flow[0];
+};
+
+
+/* caller holds the unit lock of the entry and rcu_read_lock() */
+static void ndpi_flow_dump_one( struct ndpi_flow_dump *dump, struct LruCacheEntryValue *entry )
+{
+	struct nf_conn			*ct = entry->ct;
+	struct nf_conntrack_tuple	*t;
+
+	if ( ct == NULL || !entry->protocol_detected || entry->ndpi_proto == NOT_YET_PROTOCOL )
+		return;
+	if ( dump->n >= dump->max )
+	{
+		dump->truncated = 1;
+		return;
+	}
+
+	/* no reference is held, the copy only counts if the ct was alive around it */
+	if ( lru_entry_ct_dead( entry ) )
+		return;
+	t = &dump->flow[dump->n].tuple;
+	*t = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
+	smp_rmb();
+	if ( lru_entry_ct_dead( entry ) || !nf_ct_tuple_equal( t, &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple ) )
+		return;
+
+	dump->flow[dump->n].proto = entry->ndpi_proto;
+	dump->n++;
+}
+
+
+/* one unit lock at a time, packets of the other units are not held up */
+static void ndpi_flow_dump_lru( struct ndpi_flow_dump *dump )
+{
+	struct LruCacheUnit	*unit;
+	struct LruCacheNode	*node;
+	int			i;
+
+	for ( i = 0; i < NUM_LRU_CACHE_UNITS; i++ )
+	{
+		unit = &lru_cache->units[i];
+		rcu_read_lock();
+		spin_lock_bh( &unit->lock );
+		for ( node = unit->list_head; node != NULL; node = node->lru_list.next )
+			ndpi_flow_dump_one( dump, &node->node.value );
+		spin_unlock_bh( &unit->lock );
+		rcu_read_unlock();
+		cond_resched();
+	}
+}
+
+
+#ifdef NDPI_CT_EXT_ID
+/* flows kept in the ct extension are only reachable from the conntracks */
+static void ndpi_flow_dump_ct( struct nf_conn *ct, void *data )
+{
+	struct LruCacheEntryValue	*entry = __nf_ct_ext_find( ct, NDPI_CT_EXT_ID );
+	struct LruCacheUnit		*unit;
+
+	if ( entry == NULL )
+		return;
+
+	unit = LRU_CACHE_UNIT( lru_cache, toLruKey( ct ) );
+	spin_lock_bh( &unit->lock );
+	if ( entry->ct == ct )
+		ndpi_flow_dump_one( data, entry );
+	spin_unlock_bh( &unit->lock );
+}
+
+
+static void ndpi_flow_dump_ext( struct ndpi_flow_dump *dump )
+{
+	ndpi_ct_walk( ndpi_flow_dump_ct, dump );
+}
+#else
+static inline void ndpi_flow_dump_ext( struct ndpi_flow_dump *dump ) { }
+#endif
+
+
+static void *nflows_seq_start( struct seq_file *m, loff_t *pos )
+{
+	struct ndpi_flow_dump *dump = m->private;
+
+	if ( dump == NULL )
+		return(NULL);
+	if ( *pos < dump->n )
+		return(&dump->flow[*pos]);
+	/* one more line to tell the list is incomplete, see nflows_seq_show() */
+	return(dump->truncated && *pos == dump->n ? SEQ_START_TOKEN : NULL);
+}
+
+
+static void *nflows_seq_next( struct seq_file *m, void *v, loff_t *pos )
+{
+	++*pos;
+	return(nflows_seq_start( m, pos ) );
+}
+
+
+static void nflows_seq_stop( struct seq_file *m, void *v )
+{
+}
+
+
+static int nflows_seq_show( struct seq_file *m, void *v )
+{
+	const struct ndpi_saved_flow	*f = v;
+	const struct nf_conntrack_tuple *t = &f->tuple;
+	char				*name;
+
+	if ( v == SEQ_START_TOKEN )
+	{
+		seq_printf( m, "# truncated after %u flows\n", ((struct ndpi_flow_dump *) m->private)->n );
+		return(0);
+	}
+
+	name = ndpi_get_proto_by_id( ndpi_struct, f->proto );
+	if ( name == NULL )
+		return(0);
+	if ( t->src.l3num == NFPROTO_IPV6 )
+		seq_printf( m, "%u %u %pI6 %u %pI6 %u %s\n", t->src.l3num, t->dst.protonum,
+			    t->src.u3.ip6, ntohs( t->src.u.all ), t->dst.u3.ip6, ntohs( t->dst.u.all ), name );
+	else
+		seq_printf( m, "%u %u %pI4 %u %pI4 %u %s\n", t->src.l3num, t->dst.protonum,
+			    &t->src.u3.ip, ntohs( t->src.u.all ), &t->dst.u3.ip, ntohs( t->dst.u.all ), name );
+	return(0);
+}
+
+
+static const struct seq_operations nflows_seq_ops = {
+	.start	= nflows_seq_start,
+	.next	= nflows_seq_next,
+	.stop	= nflows_seq_stop,
+	.show	= nflows_seq_show,
+};
+
+
+/*
+ * Readers get a snapshot taken at open time, sized from the flows in the
+ * cache. Flows classified meanwhile may not fit: it is taken again in a
+ * larger buffer, and a last comment line reports what is still missing.
+ */
+#define NDPI_FLOW_DUMP_TRIES	3
+
+static int nflows_proc_open( struct inode *inode, struct file *file )
+{
+	struct ndpi_flow_dump	*dump = NULL;
+	unsigned long		max;
+	int			rc, try;
+
+	if ( file->f_mode & FMODE_READ )
+	{
+		max = lru_cache_flows( lru_cache ) + 1024;
+#ifdef NDPI_CT_EXT_ID
+		max += atomic_read( &init_net.ct.count );
+#endif
+		for ( try = 0; try < NDPI_FLOW_DUMP_TRIES; try++, max *= 2 )
+		{
+			vfree( dump );
+			dump = vmalloc( sizeof(*dump) + max * sizeof(dump->flow[0]) );
+			if ( dump == NULL )
+				return(-ENOMEM);
+			dump->n		= 0;
+			dump->max	= max;
+			dump->truncated = 0;
+			ndpi_flow_dump_lru( dump );
+			ndpi_flow_dump_ext( dump );
+			if ( !dump->truncated )
+				break;
+		}
+		if ( dump->truncated )
+			pr_warning( "[NDPI] /proc/%s/%s: more than %u classified flows, the list is truncated\n",
+				    PDE_ROOT, PDE_FLOWS, dump->max );
+	}
+
+	if ( (rc = seq_open( file, &nflows_seq_ops ) ) < 0 )
+	{
+		vfree( dump );
+		return(rc);
+	}
+	((struct seq_file *) file->private_data)->private = dump;
+	return(0);
+}
+
+
+static int nflows_proc_release( struct inode *inode, struct file *file )
+{
+	vfree( ((struct seq_file *) file->private_data)->private );
+	return(seq_release( inode, file ) );
+}
+
+
+/* the conntrack is alive and the module has not classified it since */
+static void ndpi_flow_restore( struct nf_conn *ct, u_int16_t proto )
+{
+	LruKey				key	= toLruKey( ct );
+	struct LruCacheUnit		*unit	= LRU_CACHE_UNIT( lru_cache, key );
+	struct LruCacheEntryValue	*entry;
+
+	spin_lock_bh( &unit->lock );
+	entry = get_flow_entry( ct, key );
+	if ( entry && !(entry->ct == ct && entry->protocol_detected && entry_matches_ct( entry, ct ) ) )
+	{
+		/* inspecting it from mid-stream would not do better */
+		free_LruCacheEntryValue( entry );
+		init_entry_tuple( entry, ct );
+		entry->ndpi_proto = proto;
+		smp_wmb();
+		entry->protocol_detected = 1;
+		ndpi_ct_mark_set( ct, proto );
+		NDPI_STAT_INC( NDPI_STAT_RESTORED );
+	}
+	spin_unlock_bh( &unit->lock );
+}
+
+
+static int ndpi_flow_parse( char *line )
+{
+	struct nf_conntrack_tuple	t;
+	struct nf_conntrack_tuple_hash	*h;
+	char				src[48], dst[48], name[32], *proto, *end;
+	unsigned int			l3, l4, sport, dport, i, id;
+	int				ok;
+
+	if ( sscanf( line, "%u %u %47s %u %47s %u %31s", &l3, &l4, src, &sport, dst, &dport, name ) != 7 )
+		return(line[0] == '\0' || line[0] == '#' ? 0 : -EINVAL);
+
+	memset( &t, 0, sizeof(t) );
+	t.src.l3num	= l3;
+	t.dst.protonum	= l4;
+	t.src.u.all	= htons( sport );
+	t.dst.u.all	= htons( dport );
+	t.dst.dir	= IP_CT_DIR_ORIGINAL;
+	if ( l3 == NFPROTO_IPV6 )
+		ok = in6_pton( src, -1, (u8 *) t.src.u3.ip6, -1, NULL ) && in6_pton( dst, -1, (u8 *) t.dst.u3.ip6, -1, NULL );
+	else if ( l3 == NFPROTO_IPV4 )
+		ok = in4_pton( src, -1, (u8 *) &t.src.u3.ip, -1, NULL ) && in4_pton( dst, -1, (u8 *) &t.dst.u3.ip, -1, NULL );
+	else
+		ok = 0;
+	if ( !ok )
+		return(-EINVAL);
+
+	id = simple_strtoul( name, &end, 0 );
+	if ( *end != '\0' )
+	{
+		for ( i = 0; i <= ndpi_get_num_supported_protocols( ndpi_struct ); i++ )
+		{
+			proto = ndpi_get_proto_by_id( ndpi_struct, i );
+			if ( proto && !strcasecmp( name, proto ) )
+				break;
+		}
+		/* the protocol is gone from this build, let nDPI try again */
+		if ( i > ndpi_get_num_supported_protocols( ndpi_struct ) )
+			return(0);
+		id = i;
+	}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION( 2, 6, 34 )
+	h = nf_conntrack_find_get( &init_net, &t );
+#else
+	h = nf_conntrack_find_get( &init_net, NF_CT_DEFAULT_ZONE, &t );
+#endif
+	if ( h == NULL )
+		return(0); /* closed meanwhile */
+
+	ndpi_flow_restore( nf_ct_tuplehash_to_ctrack( h ), id );
+	nf_ct_put( nf_ct_tuplehash_to_ctrack( h ) );
+	return(0);
+}
+
+
+/* takes whole lines, a short count makes the writer send the rest again */
+static ssize_t nflows_proc_write( struct file *file, const char __user *buffer, size_t count, loff_t *ppos )
+{
+	char	*buf, *line, *next, *last;
+	size_t	len = min_t( size_t, count, PAGE_SIZE );
+	int	rc = 0;
+
+	if ( (buf = kmalloc( len + 1, GFP_KERNEL ) ) == NULL )
+		return(-ENOMEM);
+	if ( copy_from_user( buf, buffer, len ) )
+	{
+		kfree( buf );
+		return(-EFAULT);
+	}
+	buf[len] = '\0';
+
+	if ( (last = strrchr( buf, '\n' ) ) != NULL )
+		len = last - buf + 1;
+	else if ( len < count )
+		rc = -EINVAL; /* longer than a page */
+	buf[len] = '\0';
+
+	for ( next = buf; rc == 0 && (line = strsep( &next, "\n" ) ) != NULL; )
+		rc = ndpi_flow_parse( line );
+
+	kfree( buf );
+	return(rc < 0 ? rc : len);
+}
+
+
+static const struct file_operations ndpi_flows_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nflows_proc_open,
+	.read		= seq_read,
+	.write		= nflows_proc_write,
+	.llseek		= seq_lseek,
+	.release	= nflows_proc_release,
+};
+
+
 static int init_proc_engine( void )
 {
 	pde = proc_mkdir( PDE_ROOT, NULL );
@@ -615,7 +1790,49 @@ static int init_proc_engine( void )
 	if ( pde_proto == NULL )
 		goto out_pde_proto;
 	pde_proto->read_proc = nproto_proc_read;
+	pde_stats = proc_create( PDE_STATS, S_IRUGO, pde, &ndpi_stats_fops );
+	if ( pde_stats == NULL )
+		goto out_pde_stats;
+	pde_cache = create_proc_entry( PDE_CACHE, S_IRUGO | S_IWUSR, pde );
+	if ( pde_cache == NULL )
+		goto out_pde_cache;
+	pde_cache->read_proc = ncache_proc_read;
+	pde_cache->write_proc = ncache_proc_write;
+	pde_policy = proc_create( PDE_POLICY, S_IRUGO | S_IWUSR, pde, &ndpi_policy_fops );
+	if ( pde_policy == NULL )
+		goto out_pde_policy;
+	pde_acct = proc_create( PDE_ACCT, S_IRUSR | S_IWUSR, pde, &ndpi_acct_fops );
+	if ( pde_acct == NULL )
+		goto out_pde_acct;
+	pde_shaping = proc_create( PDE_SHAPING, S_IRUGO | S_IWUSR, pde, &ndpi_shaping_fops );
+	if ( pde_shaping == NULL )
+		goto out_pde_shaping;
+	pde_early = proc_create( PDE_EARLY, S_IRUGO | S_IWUSR, pde, &ndpi_early_fops );
+	if ( pde_early == NULL )
+		goto out_pde_early;
+	pde_hist = proc_create( PDE_HIST, S_IRUGO | S_IWUSR, pde, &ndpi_hist_fops );
+	if ( pde_hist == NULL )
+		goto out_pde_hist;
+	pde_flows = proc_create( PDE_FLOWS, S_IRUSR | S_IWUSR, pde, &ndpi_flows_fops );
+	if ( pde_flows == NULL )
+		goto out_pde_flows;
 	return(0);
+out_pde_flows:
+	remove_proc_entry( PDE_HIST, pde );
+out_pde_hist:
+	remove_proc_entry( PDE_EARLY, pde );
+out_pde_early:
+	remove_proc_entry( PDE_SHAPING, pde );
+out_pde_shaping:
+	remove_proc_entry( PDE_ACCT, pde );
+out_pde_acct:
+	remove_proc_entry( PDE_POLICY, pde );
+out_pde_policy:
+	remove_proc_entry( PDE_CACHE, pde );
+out_pde_cache:
+	remove_proc_entry( PDE_STATS, pde );
+out_pde_stats:
+	remove_proc_entry( PDE_PROTO, pde );
 out_pde_proto:
 	remove_proc_entry( PDE_ROOT, NULL );
 out_pde:
@@ -625,15 +1842,175 @@ out_pde:
 
 static void term_proc_engine( void )
 {
+	remove_proc_entry( PDE_FLOWS, pde );
+	remove_proc_entry( PDE_HIST, pde );
+	remove_proc_entry( PDE_EARLY, pde );
+	remove_proc_entry( PDE_SHAPING, pde );
+	remove_proc_entry( PDE_ACCT, pde );
+	remove_proc_entry( PDE_POLICY, pde );
+	remove_proc_entry( PDE_CACHE, pde );
+	remove_proc_entry( PDE_STATS, pde );
 	remove_proc_entry( PDE_PROTO, pde );
 	remove_proc_entry( PDE_ROOT, NULL );
 }
 
+
+static void term_scratch_engine( void )
+{
+	int cpu;
+
+	for_each_possible_cpu( cpu )
+	{
+		kfree( per_cpu( ndpi_scratch, cpu ) );
+		per_cpu( ndpi_scratch, cpu ) = NULL;
+	}
+}
+
+
+/* per-CPU buffers for the inspection window of non linear skbs */
+static int init_scratch_engine( void )
+{
+	int cpu;
+
+	if ( inspect_window == 0 || inspect_window > 65535 )
+		inspect_window = 65535;
+
+	for_each_possible_cpu( cpu )
+	{
+		per_cpu( ndpi_scratch, cpu ) = kmalloc_node( inspect_window, GFP_KERNEL, cpu_to_node( cpu ) );
+		if ( per_cpu( ndpi_scratch, cpu ) == NULL )
+			goto out_nomem;
+	}
+	return(0);
+out_nomem:
+	term_scratch_engine();
+	return(-ENOMEM);
+}
+
+
+static void term_async_engine( void )
+{
+	struct ndpi_async_ring	*ring;
+	int			cpu;
+
+	/* runs what is still queued, the target is gone so nothing new comes */
+	if ( ndpi_async_wq )
+		destroy_workqueue( ndpi_async_wq );
+	ndpi_async_wq = NULL;
+
+	for_each_possible_cpu( cpu )
+	{
+		ring = per_cpu( ndpi_async_ring, cpu );
+		if ( ring == NULL )
+			continue;
+		for ( ; ring->tail != ring->head; ring->tail++ )
+			nf_ct_put( ring->item[ring->tail & (NDPI_ASYNC_RING_SIZE - 1)].ct );
+		vfree( ring->buf );
+		kfree( ring );
+		per_cpu( ndpi_async_ring, cpu ) = NULL;
+	}
+}
+
+
+static int init_async_engine( void )
+{
+	struct ndpi_async_ring	*ring;
+	int			cpu, i;
+
+	if ( !async_classify )
+		return(0);
+
+	for_each_possible_cpu( cpu )
+	{
+		ring = kzalloc_node( sizeof(*ring), GFP_KERNEL, cpu_to_node( cpu ) );
+		if ( ring == NULL )
+			goto out_nomem;
+		per_cpu( ndpi_async_ring, cpu ) = ring;
+
+		ring->buf = vmalloc_node( NDPI_ASYNC_RING_SIZE * inspect_window, cpu_to_node( cpu ) );
+		if ( ring->buf == NULL )
+			goto out_nomem;
+		for ( i = 0; i < NDPI_ASYNC_RING_SIZE; i++ )
+			ring->item[i].data = ring->buf + i * inspect_window;
+
+		spin_lock_init( &ring->lock );
+		ring->cpu = cpu;
+		INIT_WORK( &ring->work, ndpi_async_work );
+	}
+
+	ndpi_async_wq = create_workqueue( "xt_ndpi" );
+	if ( ndpi_async_wq == NULL )
+		goto out_nomem;
+
+	pr_info( "[NDPI] NDPI target classifies asynchronously\n" );
+	return(0);
+out_nomem:
+	term_async_engine();
+	return(-ENOMEM);
+}
+
+
+static int init_ct_event_engine( void )
+{
+#ifdef CONFIG_NF_CONNTRACK_EVENTS
+	if ( !ct_events )
+		return(0);
+
+	/* there is a single notifier slot, ctnetlink may own it already */
+	if ( nf_conntrack_register_notifier( &ndpi_ct_notifier ) < 0 )
+	{
+		pr_warning( "[NDPI] conntrack notifier is busy, dead flows are left to the LRU\n" );
+		return(0);
+	}
+	ct_notifier_registered = 1;
+#endif
+	return(0);
+}
+
+
+static void term_ct_event_engine( void )
+{
+#ifdef CONFIG_NF_CONNTRACK_EVENTS
+	if ( ct_notifier_registered )
+	{
+		nf_conntrack_unregister_notifier( &ndpi_ct_notifier );
+		/* wait for the callbacks still running */
+		synchronize_rcu();
+		ct_notifier_registered = 0;
+	}
+#endif
+}
+
+
+static int init_ct_ext_engine( void )
+{
+#ifdef NDPI_CT_EXT_ID
+	int rc = nf_ct_extend_register( &ndpi_ct_extend );
+
+	if ( rc < 0 )
+	{
+		pr_err( "[NDPI] conntrack extension %d is busy\n", NDPI_CT_EXT_ID );
+		return(rc);
+	}
+#endif
+	return(0);
+}
+
+
+static void term_ct_ext_engine( void )
+{
+#ifdef NDPI_CT_EXT_ID
+	nf_ct_iterate_cleanup( &init_net, ndpi_ct_ext_cleanup, NULL );
+	nf_ct_extend_unregister( &ndpi_ct_extend );
+#endif
+}
+
 static unsigned int ndpi_tg( struct sk_buff *skb, const struct xt_target_param *par )
 {
     const struct xt_ndpi_tginfo *target_info;
     struct nf_conn              *ct;
     enum ip_conntrack_info      ctinfo;
+    struct LruCacheUnit         *unit;
     target_info = par->targinfo;
     ct   = nf_ct_get( skb, &ctinfo );
     if ( (ct == NULL) || (skb == NULL) ) {
@@ -646,15 +2023,55 @@ static unsigned int ndpi_tg( struct sk_buff *skb, const struct xt_target_param *
 #endif
         return XT_CONTINUE;
     }
-    spin_lock_bh(&ndpi_lock);
-    /* just check and update lrucache, therefore, I ignore the return value */
-    ndpi_process_packet(skb, NULL, target_info, ct);
-    spin_unlock_bh(&ndpi_lock);
+    if ( ndpi_cb_verdict( skb, NULL, ct ) < 0 && ndpi_detected_verdict( skb, NULL, ct ) < 0 ) {
+        unit = LRU_CACHE_UNIT(lru_cache, toLruKey(ct));
+        spin_lock_bh(&unit->lock);
+        /* just check and update lrucache, therefore, I ignore the return value */
+        ndpi_process_packet(skb, NULL, target_info, ct);
+        spin_unlock_bh(&unit->lock);
+    }
+
+    /* whichever path ran, it left the protocol of this packet in the cb */
+    if ( (target_info->flags & NDPI_TG_SHAPING) && NDPI_CB( skb ).tag == ndpi_cb_tag( skb, ct ) )
+        ndpi_shaping_apply( skb, NDPI_CB_APPID( skb ) );
 
     return XT_CONTINUE;
 }
 
 
+/*
+ * The target classifies every flow, so it needs every dissector. With
+ * --shaping it also has to see every packet: offloaded flows would skip it.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION( 2, 6, 35 )
+static bool ndpi_tg_check( const struct xt_tgchk_param *par )
+#else
+static int ndpi_tg_check( const struct xt_tgchk_param *par )
+#endif
+{
+	const struct xt_ndpi_tginfo *info = par->targinfo;
+	int rc = ndpi_dispatch_get( NULL );
+
+	if ( rc >= 0 && (info->flags & NDPI_TG_SHAPING) && ndpi_wanted_all_get() )
+		ndpi_offload_revoke();
+#if LINUX_VERSION_CODE < KERNEL_VERSION( 2, 6, 35 )
+	return(rc == 0);
+#else
+	return(rc);
+#endif
+}
+
+
+static void ndpi_tg_destroy( const struct xt_tgdtor_param *par )
+{
+	const struct xt_ndpi_tginfo *info = par->targinfo;
+
+	if ( info->flags & NDPI_TG_SHAPING )
+		ndpi_wanted_all_put();
+	ndpi_dispatch_put( NULL );
+}
+
+
 static struct xt_target ndpi_tg_regs[] __read_mostly = {
 	{
 		.name		= "NDPI",
@@ -665,6 +2082,8 @@ static struct xt_target ndpi_tg_regs[] __read_mostly = {
 		.family = NFPROTO_IPV4,
 #endif
 		.target		= ndpi_tg,
+		.checkentry	= ndpi_tg_check,
+		.destroy	= ndpi_tg_destroy,
 		.targetsize	= sizeof(struct xt_ndpi_tginfo),
 		.me		= THIS_MODULE,
 	}
@@ -684,12 +2103,52 @@ static int __init ndpi_init( void )
 	pr_info("Initializing nDPI module...\n" );
 #endif
 
+	if ( !ct_mark_mask_valid() )
+	{
+		pr_err( "[NDPI] ct_mark_mask 0x%x is not usable\n", ct_mark_mask );
+		return -EINVAL;
+	}
+#ifndef CONFIG_NF_CONNTRACK_MARK
+	if ( offload_mark )
+#else
+	if ( offload_mark & ct_mark_mask )
+#endif
+	{
+		pr_err( "[NDPI] offload_mark 0x%x is not usable\n", offload_mark );
+		return -EINVAL;
+	}
+
+	if ( (rc = init_scratch_engine() ) < 0 )
+		goto out_scratch;
 	if ( (rc = init_lru_engine() ) < 0 )
 		goto out_lru;
 	if ( (rc = init_ndpi_engine() ) < 0 )
 		goto out_ndpi;
+	if ( (rc = init_stats_engine() ) < 0 )
+		goto out_stats;
+	if ( (rc = init_policy_engine() ) < 0 )
+		goto out_policy;
+	if ( (rc = init_acct_engine() ) < 0 )
+		goto out_acct;
+	if ( (rc = init_shaping_engine() ) < 0 )
+		goto out_shaping;
+	if ( (rc = init_early_engine() ) < 0 )
+		goto out_early;
+	if ( (rc = init_hist_engine() ) < 0 )
+		goto out_hist;
+	if ( (rc = init_async_engine() ) < 0 )
+		goto out_async;
 	if ( (rc = init_proc_engine() ) < 0 )
 		goto out_proc;
+	if ( (rc = init_ct_ext_engine() ) < 0 )
+		goto out_ct_ext;
+	if ( (rc = init_ct_event_engine() ) < 0 )
+		goto out_ct_event;
+	lru_sweep_start();
+
+//打开skb时间戳
+	get_random_bytes( &ndpi_cb_secret, sizeof(ndpi_cb_secret) );
+	net_enable_timestamp();
 	if ( (rc = xt_register_matches( ndpi_regs, ARRAY_SIZE( ndpi_regs ) ) ) < 0 )
 		goto out_mt;
 	if ( (rc = xt_register_targets( ndpi_tg_regs, ARRAY_SIZE( ndpi_tg_regs ) ) ) < 0 )
@@ -699,16 +2158,37 @@ static int __init ndpi_init( void )
 out_tg:
 	xt_unregister_matches( ndpi_regs, ARRAY_SIZE( ndpi_regs ) );
 out_mt:
+	net_disable_timestamp();
+	ndpi_offload_flush();
+	lru_sweep_stop();
+	term_ct_event_engine();
+out_ct_event:
+	term_ct_ext_engine();
+out_ct_ext:
 	term_proc_engine();
+	ndpi_offload_flush();
 out_proc:
+	term_async_engine();
+out_async:
+	term_hist_engine();
+out_hist:
+	term_early_engine();
+out_early:
+	term_shaping_engine();
+out_shaping:
+	term_acct_engine();
+out_acct:
+	term_policy_engine();
+out_policy:
+	term_stats_engine();
+out_stats:
 	term_ndpi_engine();
 out_ndpi:
 	term_lru_engine();
 out_lru:
+	term_scratch_engine();
+out_scratch:
 	pr_err("nDPI module initialized FAILED\n" );
-
-//打开skb时间戳
-	net_enable_timestamp();
 	return(rc);
 }
 
@@ -717,12 +2197,29 @@ out_lru:
 
 static void __exit ndpi_exit( void )
 {
+	/* no packet may reach us while the flow state is released */
+	xt_unregister_targets( ndpi_tg_regs, ARRAY_SIZE( ndpi_tg_regs ) );
+	xt_unregister_matches( ndpi_regs, ARRAY_SIZE( ndpi_regs ) );
+	/* queued packets still hold conntracks and look up flow state */
+	term_async_engine();
+	ndpi_offload_flush();
+	lru_sweep_stop();
+
+	term_ct_event_engine();
+	term_ct_ext_engine();
 	term_proc_engine();
-	term_ndpi_engine();
+	/* a write to /proc/xt_ndpi/early may have queued it again */
+	ndpi_offload_flush();
+	term_hist_engine();
+	term_early_engine();
+	term_shaping_engine();
+	term_acct_engine();
+	term_policy_engine();
+	term_stats_engine();
+	/* the LRU entries give their nDPI state back to the flow caches */
 	term_lru_engine();
-
-	xt_unregister_matches( ndpi_regs, ARRAY_SIZE( ndpi_regs ) );
-	xt_unregister_targets( ndpi_tg_regs, ARRAY_SIZE( ndpi_tg_regs ) );
+	term_ndpi_engine();
+	term_scratch_engine();
 
 //关闭skb时间戳
 	net_disable_timestamp();
@@ -8,15 +8,44 @@
  *	published by the Free Software Foundation.
  */
 
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/mempool.h>
+#include <linux/mutex.h>
+
 #include "ndpi.h"
 #include "lru.h"
+#include "../include/xt_ndpi.h"
 
 /* ************************************* */
 struct ndpi_detection_module_struct *ndpi_struct;
 u_int32_t ndpi_detection_tick_resolution;
 u_int32_t ndpi_proto_size, ndpi_flow_struct_size;
-/* define and init ndpi_lock */
-DEFINE_SPINLOCK( ndpi_lock );
+
+/* per flow objects, see /proc/slabinfo */
+static struct kmem_cache	*ndpi_flow_cache, *ndpi_id_cache;
+static mempool_t		*ndpi_flow_pool, *ndpi_id_pool;
+
+/* flows whose state is kept in reserve for allocation failures */
+unsigned int flow_reserve = 1024;
+module_param( flow_reserve, uint, 0444 );
+MODULE_PARM_DESC( flow_reserve, "flows preallocated for memory pressure (default 1024)" );
+
+/* classified flows are cheap, the ones still inspected hold the nDPI state */
+unsigned int max_inspecting = 8192;
+module_param( max_inspecting, uint, 0444 );
+MODULE_PARM_DESC( max_inspecting, "flows inspected at the same time, new ones wait for a slot (default 8192)" );
+
+static bool dispatch_all;
+module_param( dispatch_all, bool, 0444 );
+MODULE_PARM_DESC( dispatch_all, "run every dissector, not only those of the protocols loaded rules use (default 0)" );
+
+/* how many loaded rules want each dissector, NULL protocols meaning all of them */
+static DEFINE_MUTEX( ndpi_dispatch_lock );
+static unsigned int ndpi_dispatch_refs[NDPI_NUM_BITS];
+static unsigned int ndpi_dispatch_all_refs;
+/* targets that act on every classified packet, see ndpi_proto_wanted() */
+static unsigned int ndpi_wanted_all_refs;
 /* ************************************* */
 
 static void debug_printf( u_int32_t protocol, void *id_struct,
@@ -56,6 +85,196 @@ static void free_wrapper( void *freeable )
 }
 
 
+/* ********************************** */
+
+struct ndpi_flow_struct *ndpi_flow_alloc( void )
+{
+	return(mempool_alloc( ndpi_flow_pool, GFP_ATOMIC ) );
+}
+
+
+void ndpi_flow_free( struct ndpi_flow_struct *flow )
+{
+	if ( flow )
+		mempool_free( flow, ndpi_flow_pool );
+}
+
+
+struct ndpi_id_struct *ndpi_id_alloc( void )
+{
+	return(mempool_alloc( ndpi_id_pool, GFP_ATOMIC ) );
+}
+
+
+void ndpi_id_free( struct ndpi_id_struct *id )
+{
+	if ( id )
+		mempool_free( id, ndpi_id_pool );
+}
+
+
+/* ********************************** */
+
+static void term_flow_caches( void )
+{
+	if ( ndpi_id_pool )
+		mempool_destroy( ndpi_id_pool );
+	if ( ndpi_flow_pool )
+		mempool_destroy( ndpi_flow_pool );
+	if ( ndpi_id_cache )
+		kmem_cache_destroy( ndpi_id_cache );
+	if ( ndpi_flow_cache )
+		kmem_cache_destroy( ndpi_flow_cache );
+	ndpi_id_pool = ndpi_flow_pool = NULL;
+	ndpi_id_cache = ndpi_flow_cache = NULL;
+}
+
+
+static int init_flow_caches( void )
+{
+	ndpi_flow_cache = kmem_cache_create( "xt_ndpi_flow", ndpi_flow_struct_size, 0, SLAB_HWCACHE_ALIGN, NULL );
+	ndpi_id_cache	= kmem_cache_create( "xt_ndpi_id", ndpi_proto_size, 0, SLAB_HWCACHE_ALIGN, NULL );
+	if ( ndpi_flow_cache == NULL || ndpi_id_cache == NULL )
+		goto out_nomem;
+
+	/* every flow holds one ndpi_flow_struct and two ndpi_id_struct */
+	ndpi_flow_pool	= mempool_create_slab_pool( flow_reserve, ndpi_flow_cache );
+	ndpi_id_pool	= mempool_create_slab_pool( 2 * flow_reserve, ndpi_id_cache );
+	if ( ndpi_flow_pool == NULL || ndpi_id_pool == NULL )
+		goto out_nomem;
+
+	return(0);
+out_nomem:
+	term_flow_caches();
+	return(-ENOMEM);
+}
+
+
+/* ********************************** */
+
+/* true when the union of the wanted dissectors changed */
+static bool ndpi_dispatch_account( const NDPI_PROTOCOL_BITMASK *protos, int delta )
+{
+	unsigned int	edge = delta > 0 ? 1 : 0;
+	bool		changed = false;
+	u_int		i;
+
+	if ( protos == NULL )
+	{
+		ndpi_dispatch_all_refs += delta;
+		return(ndpi_dispatch_all_refs == edge);
+	}
+
+	for ( i = 0; i < NDPI_NUM_BITS; i++ )
+	{
+		if ( !NDPI_COMPARE_PROTOCOL_TO_BITMASK( *protos, i ) )
+			continue;
+		ndpi_dispatch_refs[i] += delta;
+		if ( ndpi_dispatch_refs[i] == edge )
+			changed = true;
+	}
+
+	/* only running every dissector tells what stays unknown, or not yet known */
+	if ( NDPI_COMPARE_PROTOCOL_TO_BITMASK( *protos, NDPI_PROTOCOL_UNKNOWN )
+	     || NDPI_COMPARE_PROTOCOL_TO_BITMASK( *protos, NOT_YET_PROTOCOL ) )
+	{
+		ndpi_dispatch_all_refs += delta;
+		if ( ndpi_dispatch_all_refs == edge )
+			changed = true;
+	}
+	return(changed);
+}
+
+
+/*
+ * Rebuild the dissector lists from the refcounts. Only the dispatch is
+ * trimmed, ndpi_struct->detection_bitmask keeps every protocol so that what
+ * a running dissector finds is still reported.
+ */
+static int ndpi_dispatch_rebuild( void )
+{
+	NDPI_PROTOCOL_BITMASK	protos;
+	u_int			i;
+
+	if ( dispatch_all || ndpi_dispatch_all_refs )
+	{
+		NDPI_BITMASK_SET_ALL( protos );
+	}
+	else
+	{
+		NDPI_BITMASK_RESET( protos );
+		for ( i = 0; i < NDPI_NUM_BITS; i++ )
+			if ( ndpi_dispatch_refs[i] )
+				NDPI_ADD_PROTOCOL_TO_BITMASK( protos, i );
+
+		/* most applications are only told apart by the host these see */
+		NDPI_ADD_PROTOCOL_TO_BITMASK( protos, NDPI_PROTOCOL_HTTP );
+		NDPI_ADD_PROTOCOL_TO_BITMASK( protos, NDPI_PROTOCOL_SSL );
+		NDPI_ADD_PROTOCOL_TO_BITMASK( protos, NDPI_PROTOCOL_DNS );
+	}
+
+	if ( ndpi_set_protocol_dispatch_bitmask( ndpi_struct, &protos ) < 0 )
+	{
+		pr_err( "[NDPI] rebuilding the dissector lists failed.\n" );
+		return(-ENOMEM);
+	}
+	return(0);
+}
+
+
+int ndpi_dispatch_get( const NDPI_PROTOCOL_BITMASK *protos )
+{
+	int rc = 0;
+
+	mutex_lock( &ndpi_dispatch_lock );
+	if ( ndpi_dispatch_account( protos, 1 ) )
+	{
+		if ( (rc = ndpi_dispatch_rebuild() ) < 0 )
+			ndpi_dispatch_account( protos, -1 );
+		else if ( protos != NULL )
+			rc = 1;
+	}
+	mutex_unlock( &ndpi_dispatch_lock );
+	return(rc);
+}
+
+
+bool ndpi_proto_wanted( u_int16_t proto )
+{
+	return(proto >= NDPI_NUM_BITS || ACCESS_ONCE( ndpi_wanted_all_refs ) != 0
+	       || ACCESS_ONCE( ndpi_dispatch_refs[proto] ) != 0);
+}
+
+
+int ndpi_wanted_all_get( void )
+{
+	int rc;
+
+	mutex_lock( &ndpi_dispatch_lock );
+	rc = ndpi_wanted_all_refs++ == 0;
+	mutex_unlock( &ndpi_dispatch_lock );
+	return(rc);
+}
+
+
+void ndpi_wanted_all_put( void )
+{
+	mutex_lock( &ndpi_dispatch_lock );
+	ndpi_wanted_all_refs--;
+	mutex_unlock( &ndpi_dispatch_lock );
+}
+
+
+void ndpi_dispatch_put( const NDPI_PROTOCOL_BITMASK *protos )
+{
+	mutex_lock( &ndpi_dispatch_lock );
+	/* on failure the previous, larger, lists stay in place */
+	if ( ndpi_dispatch_account( protos, -1 ) )
+		ndpi_dispatch_rebuild();
+	mutex_unlock( &ndpi_dispatch_lock );
+}
+
+
 /* ********************************** */
 
 int init_ndpi_engine( void )
@@ -68,16 +287,34 @@ int init_ndpi_engine( void )
 	if ( ndpi_struct == NULL )
 	{
 		pr_err( "[NDPI] global structure initialization failed.\n" );
-		free_lru_cache( lru_cache );
-		kfree( lru_cache );
-		return(ENOMEM);
+		return(-ENOMEM);
 	}
 
+	/*
+	 * Everything built below (callback buffers, port trees, the finalized
+	 * host automaton, proto_defaults) is shared by all CPUs and never written
+	 * again: the per packet state lives in the flow entry and on the stack of
+	 * ndpi_detection_process_packet(), so no global lock is needed around it.
+	 * The exception are the dissector lists, replaced under RCU when rules
+	 * come and go (ndpi_dispatch_get/put).
+	 */
+	ndpi_finalize_automa( ndpi_struct );
 	NDPI_BITMASK_SET_ALL( all );
-	ndpi_set_protocol_detection_bitmask2( ndpi_struct, &all );
+	if ( ndpi_set_protocol_detection_bitmask2( ndpi_struct, &all ) < 0 || ndpi_dispatch_rebuild() < 0 )
+	{
+		ndpi_exit_detection_module( ndpi_struct, free_wrapper );
+		return(-ENOMEM);
+	}
 	ndpi_proto_size		= ndpi_detection_get_sizeof_ndpi_id_struct();
 	ndpi_flow_struct_size	= ndpi_detection_get_sizeof_ndpi_flow_struct();
 
+	if ( init_flow_caches() < 0 )
+	{
+		pr_err( "[NDPI] flow caches initialization failed.\n" );
+		ndpi_exit_detection_module( ndpi_struct, free_wrapper );
+		return(-ENOMEM);
+	}
+
 	pr_info( "[NDPI] nDPI initialized [ndpi_proto_size: %u][ndpi_flow_struct_size: %u]\n",
 		 ndpi_proto_size, ndpi_flow_struct_size );
 
@@ -89,6 +326,9 @@ int init_ndpi_engine( void )
 
 void term_ndpi_engine( void )
 {
+	term_flow_caches();
+	/* dissector lists retired by ndpi_dispatch_put() */
+	rcu_barrier();
 	ndpi_exit_detection_module( ndpi_struct, free_wrapper );
 }
 
@@ -13,10 +13,11 @@
 #ifdef __KERNEL__
 
 /* Globals */
-extern spinlock_t				ndpi_lock;      /*flow lock*/
 extern u_int32_t				ndpi_proto_size, ndpi_flow_struct_size;
-extern struct ndpi_detection_module_struct	*ndpi_struct;
+extern struct ndpi_detection_module_struct	*ndpi_struct;	/* read only once initialized */
 extern u_int32_t				ndpi_detection_tick_resolution;
+extern unsigned int				flow_reserve;
+extern unsigned int				max_inspecting;
 
 /* ********************************** */
 
@@ -24,4 +25,36 @@ int init_ndpi_engine( void );
 
 void term_ndpi_engine( void );
 
+/*
+ * Rules hold the dissectors of the protocols they match on (NULL: all of
+ * them) from checkentry to destroy. Process context only. get returns 1
+ * when some protocol in protos had no rule matching on it before.
+ */
+int ndpi_dispatch_get( const NDPI_PROTOCOL_BITMASK *protos );
+
+void ndpi_dispatch_put( const NDPI_PROTOCOL_BITMASK *protos );
+
+/* after a get returned 1, offloaded flows go through the rules again (main.c) */
+void ndpi_offload_revoke( void );
+
+/* some loaded ndpi match rule matches on proto, lockless */
+bool ndpi_proto_wanted( u_int16_t proto );
+
+/*
+ * Held by targets that need to see the packets of every protocol, e.g.
+ * NDPI --shaping: no flow is wanted by nobody. get returns 1 for the first.
+ */
+int ndpi_wanted_all_get( void );
+
+void ndpi_wanted_all_put( void );
+
+/* per flow nDPI state, backed by a reserve for atomic context */
+struct ndpi_flow_struct *ndpi_flow_alloc( void );
+
+void ndpi_flow_free( struct ndpi_flow_struct *flow );
+
+struct ndpi_id_struct *ndpi_id_alloc( void );
+
+void ndpi_id_free( struct ndpi_id_struct *id );
+
 #endif
@@ -0,0 +1,257 @@
+/*
+ *	xt_ndpi - Netfilter module to match nDPI-detected sessions
+ *
+ *	(C) 2013 Luca Deri <deri@ntop.org>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License version 2 as
+ *	published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/jiffies.h>
+#include <linux/in.h>
+#include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include <asm/uaccess.h>
+
+#include "ndpi.h"
+#include "lru.h"
+#include "stats.h"
+#include "policy.h"
+
+/* ************************************* */
+
+struct ndpi_giveup_rule {
+	u_int32_t	max_packets, max_bytes, max_msecs;
+	u_int8_t	active;
+	atomic_long_t	hits[NDPI_GIVEUP_MAX];
+};
+
+enum { NDPI_L4_TCP, NDPI_L4_UDP, NDPI_L4_OTHER, NDPI_L4_MAX };
+
+static const char *ndpi_l4_names[NDPI_L4_MAX] = { "tcp", "udp", "other" };
+
+/* rules are updated in place under the mutex, packets read them unlocked */
+static struct ndpi_giveup_rule	l4_rules[NDPI_L4_MAX];
+static struct ndpi_giveup_rule	*proto_rules;
+static u_int32_t		num_proto_rules;
+static DEFINE_MUTEX( policy_mutex );
+
+/* ************************************* */
+
+static void set_rule( struct ndpi_giveup_rule *rule, u_int32_t packets, u_int32_t bytes, u_int32_t msecs )
+{
+	rule->max_packets	= packets;
+	rule->max_bytes		= bytes;
+	rule->max_msecs		= msecs;
+	smp_wmb();
+	rule->active		= 1;
+}
+
+
+static bool rule_reached( struct ndpi_giveup_rule *rule, u_int32_t packets, const struct LruCacheDpiState *dpi )
+{
+	int reason;
+
+	if ( rule->max_packets && packets >= rule->max_packets )
+		reason = NDPI_GIVEUP_PACKETS;
+	else if ( rule->max_bytes && dpi->bytes >= rule->max_bytes )
+		reason = NDPI_GIVEUP_BYTES;
+	else if ( rule->max_msecs && time_after_eq( jiffies, dpi->first_seen + msecs_to_jiffies( rule->max_msecs ) ) )
+		reason = NDPI_GIVEUP_TIME;
+	else
+		return(false);
+
+	atomic_long_inc( &rule->hits[reason] );
+	NDPI_STAT_INC( NDPI_STAT_GIVEUP_PACKETS + reason );
+	return(true);
+}
+
+
+static inline struct ndpi_giveup_rule *proto_rule( u_int16_t ndpi_proto )
+{
+	if ( ndpi_proto >= num_proto_rules || !proto_rules[ndpi_proto].active )
+		return(NULL);
+	smp_rmb();
+	return(&proto_rules[ndpi_proto]);
+}
+
+
+bool ndpi_giveup_partial( u_int16_t ndpi_proto )
+{
+	return(proto_rule( ndpi_proto ) != NULL);
+}
+
+
+bool ndpi_giveup( u_int16_t ndpi_proto, u_int8_t l4proto, const struct LruCacheDpiState *dpi )
+{
+	struct ndpi_giveup_rule *rule = proto_rule( ndpi_proto );
+
+	if ( rule )
+		return(rule_reached( rule, dpi->flow->packet_counter, dpi ) );
+
+	switch ( l4proto )
+	{
+	case IPPROTO_TCP:
+		rule = &l4_rules[NDPI_L4_TCP];
+		break;
+	case IPPROTO_UDP:
+		rule = &l4_rules[NDPI_L4_UDP];
+		break;
+	default:
+		rule = &l4_rules[NDPI_L4_OTHER];
+		break;
+	}
+	return(rule_reached( rule, dpi->num_packets_processed, dpi ) );
+}
+
+
+/* ************************************* */
+
+static void show_rule( struct seq_file *m, const char *name, struct ndpi_giveup_rule *rule )
+{
+	seq_printf( m, "%-20s %8u %10u %8u   %lu/%lu/%lu\n", name,
+		    rule->max_packets, rule->max_bytes, rule->max_msecs,
+		    atomic_long_read( &rule->hits[NDPI_GIVEUP_PACKETS] ),
+		    atomic_long_read( &rule->hits[NDPI_GIVEUP_BYTES] ),
+		    atomic_long_read( &rule->hits[NDPI_GIVEUP_TIME] ) );
+}
+
+
+static int ndpi_policy_show( struct seq_file *m, void *v )
+{
+	u_int32_t	i;
+	char		*name;
+
+	seq_printf( m, "# %-18s %8s %10s %8s   %s\n", "rule", "packets", "bytes", "msecs", "hits packets/bytes/time" );
+	for ( i = 0; i < NDPI_L4_MAX; i++ )
+		show_rule( m, ndpi_l4_names[i], &l4_rules[i] );
+	for ( i = 0; i < num_proto_rules; i++ )
+	{
+		if ( !proto_rules[i].active )
+			continue;
+		name = ndpi_get_proto_by_id( ndpi_struct, i );
+		show_rule( m, name ? name : "?", &proto_rules[i] );
+	}
+	return(0);
+}
+
+
+static struct ndpi_giveup_rule *find_rule( const char *name )
+{
+	u_int32_t	i;
+	char		*end, *proto;
+	unsigned long	id;
+
+	for ( i = 0; i < NDPI_L4_MAX; i++ )
+		if ( !strcasecmp( name, ndpi_l4_names[i] ) )
+			return(&l4_rules[i]);
+
+	id = simple_strtoul( name, &end, 0 );
+	if ( *end == '\0' )
+		return(id < num_proto_rules ? &proto_rules[id] : NULL);
+
+	for ( i = 0; i < num_proto_rules; i++ )
+	{
+		proto = ndpi_get_proto_by_id( ndpi_struct, i );
+		if ( proto && !strcasecmp( name, proto ) )
+			return(&proto_rules[i]);
+	}
+	return(NULL);
+}
+
+
+static int parse_rule( char *line )
+{
+	struct ndpi_giveup_rule	*rule;
+	char			name[32], limits[8];
+	u_int32_t		packets, bytes, msecs;
+
+	if ( sscanf( line, "%31s", name ) != 1 || name[0] == '#' )
+		return(0);
+	if ( (rule = find_rule( name ) ) == NULL )
+		return(-ENOENT);
+
+	if ( sscanf( line, "%*s %u %u %u", &packets, &bytes, &msecs ) == 3 )
+		set_rule( rule, packets, bytes, msecs );
+	else if ( sscanf( line, "%*s %7s", limits ) == 1 && !strcmp( limits, "off" )
+		  && (rule < l4_rules || rule >= l4_rules + NDPI_L4_MAX) )
+		rule->active = 0;
+	else
+		return(-EINVAL);
+
+	return(0);
+}
+
+
+static ssize_t ndpi_policy_write( struct file *file, const char __user *buffer, size_t count, loff_t *ppos )
+{
+	char	*buf, *line, *next;
+	int	rc = 0;
+
+	if ( count == 0 || count > PAGE_SIZE )
+		return(-EINVAL);
+	if ( (buf = kmalloc( count + 1, GFP_KERNEL ) ) == NULL )
+		return(-ENOMEM);
+	if ( copy_from_user( buf, buffer, count ) )
+	{
+		kfree( buf );
+		return(-EFAULT);
+	}
+	buf[count] = '\0';
+
+	mutex_lock( &policy_mutex );
+	for ( next = buf; (line = strsep( &next, "\n" ) ) != NULL && rc == 0; )
+		rc = parse_rule( line );
+	mutex_unlock( &policy_mutex );
+
+	kfree( buf );
+	return(rc < 0 ? rc : count);
+}
+
+
+static int ndpi_policy_open( struct inode *inode, struct file *file )
+{
+	return(single_open( file, ndpi_policy_show, NULL ) );
+}
+
+
+const struct file_operations ndpi_policy_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ndpi_policy_open,
+	.read		= seq_read,
+	.write		= ndpi_policy_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* ********************************** */
+
+/* after init_ndpi_engine(), the protocol count comes from nDPI */
+int init_policy_engine( void )
+{
+	num_proto_rules = ndpi_get_num_supported_protocols( ndpi_struct ) + 1;
+	proto_rules = kcalloc( num_proto_rules, sizeof(struct ndpi_giveup_rule), GFP_KERNEL );
+	if ( proto_rules == NULL )
+		return(-ENOMEM);
+
+	/* the thresholds the module always had */
+	set_rule( &l4_rules[NDPI_L4_TCP], 20, 0, 0 );
+	set_rule( &l4_rules[NDPI_L4_UDP], 20, 0, 0 );
+	set_rule( &l4_rules[NDPI_L4_OTHER], 0, 0, 0 );
+	set_rule( &proto_rules[NDPI_PROTOCOL_HTTP], 5, 0, 0 );
+	/* the data connections are only known while the control one is inspected */
+	set_rule( &proto_rules[NDPI_PROTOCOL_FTP_CONTROL], 0, 0, 0 );
+
+	return(0);
+}
+
+
+void term_policy_engine( void )
+{
+	kfree( proto_rules );
+	proto_rules = NULL;
+	num_proto_rules = 0;
+}
@@ -0,0 +1,45 @@
+/*
+ *	xt_ndpi - Netfilter module to match nDPI-detected sessions
+ *
+ *	(C) 2013 Luca Deri <deri@ntop.org>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License version 2 as
+ *	published by the Free Software Foundation.
+ */
+
+/*
+ * When to stop inspecting a flow. A rule gives up after max_packets
+ * packets, max_bytes IP bytes or max_msecs since the first packet,
+ * whichever comes first; 0 disables a limit.
+ *
+ * A flow nDPI has partially classified (e.g. HTTP before the host is
+ * known) follows the rule of that protocol when there is one, counting
+ * the packets nDPI saw with payload. Any other undetected flow follows
+ * the rule of its L4 protocol, counting all its packets.
+ *
+ * Rules are read and written through /proc/xt_ndpi/policy, one per line:
+ *	<tcp|udp|other|protocol name|protocol id> <max_packets> <max_bytes> <max_msecs>
+ *	<protocol name|protocol id> off
+ */
+
+enum ndpi_giveup_reason {
+	NDPI_GIVEUP_PACKETS,
+	NDPI_GIVEUP_BYTES,
+	NDPI_GIVEUP_TIME,
+	NDPI_GIVEUP_MAX
+};
+
+struct LruCacheDpiState;
+
+/* true when the flow has to be finalized with what nDPI knows by now */
+bool ndpi_giveup( u_int16_t ndpi_proto, u_int8_t l4proto, const struct LruCacheDpiState *dpi );
+
+/* partially detected protocols keep being inspected while their rule allows */
+bool ndpi_giveup_partial( u_int16_t ndpi_proto );
+
+extern const struct file_operations ndpi_policy_fops;
+
+int init_policy_engine( void );
+
+void term_policy_engine( void );
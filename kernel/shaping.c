@@ -0,0 +1,223 @@
+/*
+ *	xt_ndpi - Netfilter module to match nDPI-detected sessions
+ *
+ *	(C) 2013 Luca Deri <deri@ntop.org>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License version 2 as
+ *	published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/skbuff.h>
+#include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include <asm/uaccess.h>
+
+#include "ndpi.h"
+#include "shaping.h"
+#include "../include/xt_ndpi.h"
+
+/* ************************************* */
+
+static unsigned int shaping_mask = 0xffff;
+module_param( shaping_mask, uint, 0444 );
+MODULE_PARM_DESC( shaping_mask, "skb->mark bits holding the id of <id>#<name> shaping lines (default 0xffff)" );
+
+struct ndpi_shaping_rule {
+	u_int32_t	mark, mask, priority;
+	u_int8_t	set_priority;
+	u_int8_t	active;
+};
+
+/* rules are updated in place under the mutex, packets read them unlocked */
+static struct ndpi_shaping_rule	*shaping_rules;
+static u_int32_t		num_shaping_rules;
+static DEFINE_MUTEX( shaping_mutex );
+
+/* ************************************* */
+
+void ndpi_shaping_apply( struct sk_buff *skb, u_int16_t ndpi_proto )
+{
+	struct ndpi_shaping_rule *rule;
+
+	if ( ndpi_proto >= num_shaping_rules || !shaping_rules[ndpi_proto].active )
+		return;
+	smp_rmb();
+
+	rule = &shaping_rules[ndpi_proto];
+	skb->mark = (skb->mark & ~rule->mask) | rule->mark;
+	if ( rule->set_priority )
+		skb->priority = rule->priority;
+}
+
+
+static void set_rule( struct ndpi_shaping_rule *rule, u_int32_t mark, u_int32_t mask,
+		      u_int32_t priority, u_int8_t set_priority )
+{
+	rule->active		= 0;
+	smp_wmb();
+	rule->mark		= mark & mask;
+	rule->mask		= mask;
+	rule->priority		= priority;
+	rule->set_priority	= set_priority;
+	smp_wmb();
+	rule->active		= 1;
+}
+
+
+/* ************************************* */
+
+static int ndpi_shaping_show( struct seq_file *m, void *v )
+{
+	struct ndpi_shaping_rule	*rule;
+	u_int32_t			i;
+	char				*name;
+
+	seq_printf( m, "# %-18s %-23s %s\n", "protocol", "mark/mask", "priority" );
+	for ( i = 0; i < num_shaping_rules; i++ )
+	{
+		rule = &shaping_rules[i];
+		if ( !rule->active )
+			continue;
+		name = (i == NOT_YET_PROTOCOL) ? "NOT_YET" : ndpi_get_proto_by_id( ndpi_struct, i );
+		seq_printf( m, "%-20s 0x%08x/0x%08x  ", name ? name : "?", rule->mark, rule->mask );
+		if ( rule->set_priority )
+			seq_printf( m, "%u\n", rule->priority );
+		else
+			seq_printf( m, "-\n" );
+	}
+	return(0);
+}
+
+
+static int find_rule( const char *name )
+{
+	u_int32_t	i;
+	char		*end, *proto;
+	unsigned long	id;
+
+	id = simple_strtoul( name, &end, 0 );
+	if ( *end == '\0' )
+		return(id < num_shaping_rules ? (int) id : -ENOENT);
+
+	if ( !strcasecmp( name, "NOT_YET" ) )
+		return(NOT_YET_PROTOCOL);
+	for ( i = 0; i < num_shaping_rules; i++ )
+	{
+		proto = ndpi_get_proto_by_id( ndpi_struct, i );
+		if ( proto && !strcasecmp( name, proto ) )
+			return(i);
+	}
+	return(-ENOENT);
+}
+
+
+static int parse_rule( char *line )
+{
+	char		name[32], spec[32], *hash, *end;
+	u_int32_t	mark, mask = 0xffffffff, priority;
+	unsigned long	id;
+	int		i, n;
+
+	if ( sscanf( line, "%31s", name ) != 1 || name[0] == '#' )
+		return(0);
+
+	/* app_support_shaping: <id>#<name> */
+	if ( (hash = strchr( name, '#' ) ) != NULL )
+	{
+		*hash	= '\0';
+		id	= simple_strtoul( name, &end, 10 );
+		if ( *end != '\0' || id >= num_shaping_rules || shaping_mask == 0 )
+			return(-EINVAL);
+		if ( (id << __ffs( shaping_mask ) ) & ~shaping_mask )
+			return(-ERANGE);
+		set_rule( &shaping_rules[id], id << __ffs( shaping_mask ), shaping_mask, 0, 0 );
+		return(0);
+	}
+
+	if ( (i = find_rule( name ) ) < 0 )
+		return(i);
+
+	n = sscanf( line, "%*s %31s %u", spec, &priority );
+	if ( n < 1 )
+		return(-EINVAL);
+	if ( !strcmp( spec, "off" ) )
+	{
+		shaping_rules[i].active = 0;
+		return(0);
+	}
+
+	mark = simple_strtoul( spec, &end, 0 );
+	if ( *end == '/' )
+		mask = simple_strtoul( end + 1, &end, 0 );
+	if ( *end != '\0' )
+		return(-EINVAL);
+
+	set_rule( &shaping_rules[i], mark, mask, n == 2 ? priority : 0, n == 2 );
+	return(0);
+}
+
+
+static ssize_t ndpi_shaping_write( struct file *file, const char __user *buffer, size_t count, loff_t *ppos )
+{
+	char	*buf, *line, *next;
+	int	rc = 0;
+
+	if ( count == 0 || count > PAGE_SIZE )
+		return(-EINVAL);
+	if ( (buf = kmalloc( count + 1, GFP_KERNEL ) ) == NULL )
+		return(-ENOMEM);
+	if ( copy_from_user( buf, buffer, count ) )
+	{
+		kfree( buf );
+		return(-EFAULT);
+	}
+	buf[count] = '\0';
+
+	mutex_lock( &shaping_mutex );
+	for ( next = buf; (line = strsep( &next, "\n" ) ) != NULL && rc == 0; )
+		rc = parse_rule( line );
+	mutex_unlock( &shaping_mutex );
+
+	kfree( buf );
+	return(rc < 0 ? rc : count);
+}
+
+
+static int ndpi_shaping_open( struct inode *inode, struct file *file )
+{
+	return(single_open( file, ndpi_shaping_show, NULL ) );
+}
+
+
+const struct file_operations ndpi_shaping_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ndpi_shaping_open,
+	.read		= seq_read,
+	.write		= ndpi_shaping_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* ********************************** */
+
+/* after init_ndpi_engine(), the protocol count comes from nDPI */
+int init_shaping_engine( void )
+{
+	num_shaping_rules = max_t( u_int32_t, ndpi_get_num_supported_protocols( ndpi_struct ), NOT_YET_PROTOCOL ) + 1;
+	shaping_rules = kcalloc( num_shaping_rules, sizeof(struct ndpi_shaping_rule), GFP_KERNEL );
+	if ( shaping_rules == NULL )
+		return(-ENOMEM);
+
+	return(0);
+}
+
+
+void term_shaping_engine( void )
+{
+	kfree( shaping_rules );
+	shaping_rules = NULL;
+	num_shaping_rules = 0;
+}
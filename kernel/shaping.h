@@ -0,0 +1,31 @@
+/*
+ *	xt_ndpi - Netfilter module to match nDPI-detected sessions
+ *
+ *	(C) 2013 Luca Deri <deri@ntop.org>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License version 2 as
+ *	published by the Free Software Foundation.
+ */
+
+/*
+ * What `-j NDPI --shaping' writes into skb->mark and skb->priority for each
+ * application, so that one rule feeds the tc classifiers. The map is read
+ * and written through /proc/xt_ndpi/shaping, one entry per line:
+ *	<protocol name|protocol id> <mark>[/<mask>] [<priority>]
+ *	<protocol name|protocol id> off
+ *	<protocol id>#<comment>
+ * The last form is the one of app_support_shaping: the mark is the id,
+ * shifted into shaping_mask. Lines starting with '#' are ignored.
+ */
+
+struct sk_buff;
+
+/* one lookup, applications without an entry leave the skb alone */
+void ndpi_shaping_apply( struct sk_buff *skb, u_int16_t ndpi_proto );
+
+extern const struct file_operations ndpi_shaping_fops;
+
+int init_shaping_engine( void );
+
+void term_shaping_engine( void );
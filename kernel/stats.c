@@ -0,0 +1,139 @@
+/*
+ *	xt_ndpi - Netfilter module to match nDPI-detected sessions
+ *
+ *	(C) 2013 Luca Deri <deri@ntop.org>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License version 2 as
+ *	published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/seq_file.h>
+
+#include "ndpi.h"
+#include "stats.h"
+#include "../include/xt_ndpi.h"
+
+/* ************************************* */
+
+struct ndpi_cpu_stats	*ndpi_stats;
+u_int32_t		ndpi_stats_protos;
+
+static const char *ndpi_stat_names[NDPI_STAT_MAX] = {
+	[NDPI_STAT_INSPECTED]	= "inspected",
+	[NDPI_STAT_FAST_PATH]	= "fast_path",
+	[NDPI_STAT_CB_HIT]	= "cb_hit",
+	[NDPI_STAT_DUPLICATE]	= "duplicate",
+	[NDPI_STAT_NEW_FLOW]	= "new_flows",
+	[NDPI_STAT_EVICTED]	= "evicted",
+	[NDPI_STAT_EXPIRED]	= "expired",
+	[NDPI_STAT_RECYCLED]	= "recycled",
+	[NDPI_STAT_ALLOC_FAIL]	= "alloc_fail",
+	[NDPI_STAT_DPI_LIMIT]	= "dpi_limit",
+	[NDPI_STAT_SKB_FAIL]	= "skb_fail",
+	[NDPI_STAT_GIVEUP_PACKETS] = "giveup_packets",
+	[NDPI_STAT_GIVEUP_BYTES] = "giveup_bytes",
+	[NDPI_STAT_GIVEUP_TIME]	= "giveup_time",
+	[NDPI_STAT_ASYNC_QUEUED] = "async_queued",
+	[NDPI_STAT_ASYNC_FULL]	= "async_full",
+	[NDPI_STAT_ACCT_FULL]	= "acct_full",
+	[NDPI_STAT_OFFLOADED]	= "offloaded",
+	[NDPI_STAT_OFFLOAD_REVOKED] = "offload_revoked",
+	[NDPI_STAT_EARLY_DROP]	= "early_drop",
+	[NDPI_STAT_EARLY_MARK]	= "early_mark",
+	[NDPI_STAT_EARLY_FULL]	= "early_full",
+	[NDPI_STAT_SHED]	= "shed",
+	[NDPI_STAT_SHED_SAMPLED] = "shed_sampled",
+	[NDPI_STAT_RESTORED]	= "restored",
+};
+
+/* ************************************* */
+
+u_int64_t ndpi_stat_sum( enum ndpi_stat_item i )
+{
+	u_int64_t	sum = 0;
+	int		cpu;
+
+	if ( ndpi_stats == NULL )
+		return(0);
+
+	for_each_possible_cpu( cpu )
+		sum += per_cpu_ptr( ndpi_stats, cpu )->item[i];
+	return(sum);
+}
+
+
+/*
+ * Counters are summed without stopping the writers, a line can be off by
+ * the packets that went through while it was printed.
+ */
+static int ndpi_stats_show( struct seq_file *m, void *v )
+{
+	u_int32_t	i, p;
+	int		cpu;
+	u_int64_t	flows, bytes;
+	char		*name;
+
+	for ( i = 0; i < NDPI_STAT_MAX; i++ )
+		seq_printf( m, "%-16s %llu\n", ndpi_stat_names[i], (unsigned long long) ndpi_stat_sum( i ) );
+
+	seq_printf( m, "\n%-4s %-20s %12s %16s\n", "id", "protocol", "flows", "bytes" );
+	for ( p = 0; p < ndpi_stats_protos; p++ )
+	{
+		flows = bytes = 0;
+		for_each_possible_cpu( cpu )
+		{
+			flows += per_cpu_ptr( ndpi_stats, cpu )->proto[p].flows;
+			bytes += per_cpu_ptr( ndpi_stats, cpu )->proto[p].bytes;
+		}
+		if ( flows == 0 && bytes == 0 )
+			continue;
+
+		name = (p == NOT_YET_PROTOCOL) ? "NotYet" : ndpi_get_proto_by_id( ndpi_struct, p );
+		seq_printf( m, "%-4u %-20s %12llu %16llu\n", p, name ? name : "?",
+			    (unsigned long long) flows, (unsigned long long) bytes );
+	}
+
+	return(0);
+}
+
+
+static int ndpi_stats_open( struct inode *inode, struct file *file )
+{
+	return(single_open( file, ndpi_stats_show, NULL ) );
+}
+
+
+const struct file_operations ndpi_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ndpi_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* ********************************** */
+
+/* after init_ndpi_engine(), the protocol count comes from nDPI */
+int init_stats_engine( void )
+{
+	ndpi_stats_protos = max_t( u_int32_t, ndpi_get_num_supported_protocols( ndpi_struct ), NOT_YET_PROTOCOL ) + 1;
+
+	ndpi_stats = __alloc_percpu( sizeof(struct ndpi_cpu_stats)
+				     + ndpi_stats_protos * sizeof(struct ndpi_proto_stats),
+				     __alignof__(struct ndpi_cpu_stats) );
+	if ( ndpi_stats == NULL )
+		return(-ENOMEM);
+
+	return(0);
+}
+
+
+void term_stats_engine( void )
+{
+	struct ndpi_cpu_stats *stats = ndpi_stats;
+
+	ndpi_stats = NULL;
+	free_percpu( stats );
+}
@@ -0,0 +1,86 @@
+/*
+ *	xt_ndpi - Netfilter module to match nDPI-detected sessions
+ *
+ *	(C) 2013 Luca Deri <deri@ntop.org>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License version 2 as
+ *	published by the Free Software Foundation.
+ */
+
+#include <linux/percpu.h>
+#include <linux/fs.h>
+
+/* Runtime counters, per CPU and summed up when /proc/xt_ndpi/stats is read */
+enum ndpi_stat_item {
+	NDPI_STAT_INSPECTED,		/* packets handed to nDPI */
+	NDPI_STAT_FAST_PATH,		/* packets answered without the unit lock */
+	NDPI_STAT_CB_HIT,		/* rules answered from the skb cb */
+	NDPI_STAT_DUPLICATE,		/* same skb seen again by another rule */
+	NDPI_STAT_NEW_FLOW,
+	NDPI_STAT_EVICTED,		/* flows pushed out of a full LRU unit */
+	NDPI_STAT_EXPIRED,		/* idle flows reclaimed by the sweeper */
+	NDPI_STAT_RECYCLED,		/* entry reset because the ct tuple changed */
+	NDPI_STAT_ALLOC_FAIL,
+	NDPI_STAT_DPI_LIMIT,		/* new flows refused, max_inspecting reached */
+	NDPI_STAT_SKB_FAIL,		/* inspection window could not be read */
+	NDPI_STAT_GIVEUP_PACKETS,	/* flows finalized by a give-up limit, see policy.h */
+	NDPI_STAT_GIVEUP_BYTES,
+	NDPI_STAT_GIVEUP_TIME,
+	NDPI_STAT_ASYNC_QUEUED,		/* packets handed to the async workers */
+	NDPI_STAT_ASYNC_FULL,		/* inspected inline because the ring was full */
+	NDPI_STAT_ACCT_FULL,		/* packets not accounted, see acct.h */
+	NDPI_STAT_OFFLOADED,		/* flows given offload_mark */
+	NDPI_STAT_OFFLOAD_REVOKED,	/* rule updates that took offload_mark back */
+	NDPI_STAT_EARLY_DROP,		/* packets dropped before conntrack, see early.h */
+	NDPI_STAT_EARLY_MARK,		/* packets marked before conntrack */
+	NDPI_STAT_EARLY_FULL,		/* flow tuples that found no free early slot */
+	NDPI_STAT_SHED,			/* new flows finalized unseen, over dpi_budget */
+	NDPI_STAT_SHED_SAMPLED,		/* new flows inspected over dpi_budget anyway */
+	NDPI_STAT_RESTORED,		/* flows given their saved protocol, see /proc/xt_ndpi/flows */
+	NDPI_STAT_MAX
+};
+
+struct ndpi_proto_stats {
+	u_int64_t	flows, bytes;
+};
+
+struct ndpi_cpu_stats {
+	u_int64_t		item[NDPI_STAT_MAX];
+	struct ndpi_proto_stats	proto[0];	/* ndpi_stats_protos entries */
+};
+
+extern struct ndpi_cpu_stats	*ndpi_stats;
+extern u_int32_t		ndpi_stats_protos;
+extern const struct file_operations ndpi_stats_fops;
+
+/* ********************************** */
+
+/*
+ * Callers either run with BH disabled or hold a unit lock taken with _bh,
+ * the lockless rule paths disable BH themselves for OUTPUT packets.
+ */
+#define NDPI_STAT_INC( i )	NDPI_STAT_ADD( i, 1 )
+#define NDPI_STAT_ADD( i, n )	do {						\
+		struct ndpi_cpu_stats *__s = ACCESS_ONCE( ndpi_stats );		\
+		if ( likely( __s != NULL ) )					\
+			per_cpu_ptr( __s, smp_processor_id() )->item[(i)] += (n); \
+	} while (0)
+
+static inline void ndpi_stat_proto( u_int32_t proto, u_int32_t flows, u_int32_t bytes )
+{
+	struct ndpi_cpu_stats *s = ACCESS_ONCE( ndpi_stats );
+
+	if ( unlikely( s == NULL || proto >= ndpi_stats_protos ) )
+		return;
+
+	s = per_cpu_ptr( s, smp_processor_id() );
+	s->proto[proto].flows += flows;
+	s->proto[proto].bytes += bytes;
+}
+
+u_int64_t ndpi_stat_sum( enum ndpi_stat_item i );
+
+int init_stats_engine( void );
+
+void term_stats_engine( void );
@@ -532,6 +532,7 @@ static void setupDetection(void)
 
   if(_protoFilePath != NULL)
     ndpi_load_protocols_file(ndpi_struct, _protoFilePath);
+  ndpi_finalize_automa(ndpi_struct);
 
   raw_packet_count = ip_packet_count = total_bytes = 0;
   ndpi_flow_count = 0;
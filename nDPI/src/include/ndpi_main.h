@@ -31,6 +31,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <pthread.h>
 #endif
 
 #ifndef WIN32
@@ -46,6 +47,7 @@
 #else
 #include <asm/byteorder.h>
 #include <linux/ctype.h>
+#include <linux/rcupdate.h>
 #endif
 
 #endif
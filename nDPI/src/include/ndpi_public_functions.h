@@ -158,10 +158,22 @@ extern "C" {
    * This function sets the protocol bitmask2
    * @param ndpi_struct the detection module
    * @param detection_bitmask the protocol bitmask
+   * @return 0 on success, -1 if the dissector lists could not be allocated
    */
-  void
+  int
       ndpi_set_protocol_detection_bitmask2(struct ndpi_detection_module_struct *ndpi_struct, 
               const NDPI_PROTOCOL_BITMASK * detection_bitmask);
+  /**
+   * This function only changes which dissectors run, every protocol stays
+   * reportable. Safe against concurrent ndpi_detection_process_packet()
+   * callers as long as the calls to it are serialized.
+   * @param ndpi_struct the detection module
+   * @param detection_bitmask the protocols whose dissectors should run
+   * @return 0 on success, -1 if the dissector lists could not be allocated
+   */
+  int
+      ndpi_set_protocol_dispatch_bitmask(struct ndpi_detection_module_struct *ndpi_struct,
+              const NDPI_PROTOCOL_BITMASK * detection_bitmask);
   /**
    * This function will processes one packet and returns the ID of the detected protocol.
    * This is the main packet processing function. 
@@ -253,6 +265,7 @@ extern "C" {
 
   void* ndpi_create_empty_automa(struct ndpi_detection_module_struct *ndpi_struct);
   int ndpi_add_host_url_subprotocol_to_automa(struct ndpi_detection_module_struct *ndpi_struct, char *value, int protocol_id, void* automa);
+  void ndpi_finalize_automa(struct ndpi_detection_module_struct *ndpi_struct);
   void ndpi_set_automa(struct ndpi_detection_module_struct *ndpi_struct, void* automa);
 
   /* functions of operating hash table */
@@ -80,6 +80,12 @@ typedef struct ndpi_hash_t {
     int capacity_rest;                /* the capacity rest of hash table */
     struct pro_node *head, *tail;     /* maintain a lru list */
     u_int32_t (*hash_fn)(u_int8_t const *key, int len);
+    /* shared by every flow, so concurrent dissectors must serialize on it */
+#ifndef __KERNEL__
+    pthread_mutex_t lock;
+#else
+    spinlock_t lock;
+#endif
     struct pro_node *table[1];
 } ndpi_hash_t;
 
@@ -332,6 +338,26 @@ typedef struct ndpi_call_function_struct {
   u_int8_t detection_feature;
 } ndpi_call_function_struct_t;
 
+/* the dissectors split by l4, one allocation sized to what is enabled */
+typedef struct ndpi_callback_lists {
+  struct ndpi_call_function_struct *callback_buffer_tcp_no_payload;
+  u_int32_t callback_buffer_size_tcp_no_payload;
+
+  struct ndpi_call_function_struct *callback_buffer_tcp_payload;
+  u_int32_t callback_buffer_size_tcp_payload;
+
+  struct ndpi_call_function_struct *callback_buffer_udp;
+  u_int32_t callback_buffer_size_udp;
+
+  struct ndpi_call_function_struct *callback_buffer_non_tcp_udp;
+  u_int32_t callback_buffer_size_non_tcp_udp;
+
+#ifdef __KERNEL__
+  struct rcu_head rcu;
+#endif
+  struct ndpi_call_function_struct entries[0];
+} ndpi_callback_lists_t;
+
 typedef struct ndpi_subprotocol_conf_struct {
   void (*func) (struct ndpi_detection_module_struct *, char *attr, char *value, int protocol_id);
 } ndpi_subprotocol_conf_struct_t;
@@ -363,26 +389,13 @@ typedef struct ndpi_detection_module_struct {
 #ifdef NDPI_ENABLE_DEBUG_MESSAGES
   void *user_data;
 #endif
-  /* callback function buffer */
+  /* callback function buffer, only used while building callback_lists */
   //struct ndpi_call_function_struct callback_buffer[NDPI_MAX_SUPPORTED_PROTOCOLS + 1];
   struct ndpi_call_function_struct *callback_buffer;
   u_int32_t callback_buffer_size;
 
-  //struct ndpi_call_function_struct callback_buffer_tcp_no_payload[NDPI_MAX_SUPPORTED_PROTOCOLS + 1];
-  struct ndpi_call_function_struct *callback_buffer_tcp_no_payload;
-  u_int32_t callback_buffer_size_tcp_no_payload;
-
-  //struct ndpi_call_function_struct callback_buffer_tcp_payload[NDPI_MAX_SUPPORTED_PROTOCOLS + 1];
-  struct ndpi_call_function_struct *callback_buffer_tcp_payload;
-  u_int32_t callback_buffer_size_tcp_payload;
-
-  //struct ndpi_call_function_struct callback_buffer_udp[NDPI_MAX_SUPPORTED_PROTOCOLS + 1];
-  struct ndpi_call_function_struct *callback_buffer_udp;
-  u_int32_t callback_buffer_size_udp;
-
-  //struct ndpi_call_function_struct callback_buffer_non_tcp_udp[NDPI_MAX_SUPPORTED_PROTOCOLS + 1];
-  struct ndpi_call_function_struct *callback_buffer_non_tcp_udp;
-  u_int32_t callback_buffer_size_non_tcp_udp;
+  /* what the packet path walks, replaced as a whole (RCU in the kernel) */
+  struct ndpi_callback_lists *callback_lists;
 
   ndpi_default_ports_tree_node_t *tcpRoot, *udpRoot;
 
@@ -408,7 +421,7 @@ typedef struct ndpi_detection_module_struct {
 
   /* HTTP (and soon DNS) host matching */
   void *ac_automa; /* Real type is AC_AUTOMATA_t */
-  u_int8_t ac_automa_finalized;
+  u_int8_t ac_automa_finalized; /* by ndpi_finalize_automa(), searches use their own cursor */
 
   /* pplive params */
   u_int32_t pplive_connection_timeout;
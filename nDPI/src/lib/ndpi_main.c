@@ -879,24 +879,6 @@ static void init_string_based_protocols(struct ndpi_detection_module_struct *ndp
       ndpi_mod->proto_defaults[host_match[i].protocol_id].protoId = host_match[i].protocol_id;
     }
   }
-  
-#ifdef __KERNEL__
-if(!ndpi_mod->ac_automa_finalized) {
-  	#ifdef AC_DEBUG
-	printf("[NDPI] ac_automata_finalize start #0\n");
-	#endif
-    ac_automata_finalize((AC_AUTOMATA_t*)ndpi_mod->ac_automa);
-	#ifdef AC_DEBUG
-	printf("[NDPI] ac_automata_finalize end #0\n");
-	#endif
-    ndpi_mod->ac_automa_finalized = 1;
-  }else{
-	#ifdef AC_DEBUG
-	printf("[NDPI] ac_automata_finalize skip #0\n");
-	#endif
-  }
-#endif
-
 }
 
 /* ******************************************************************** */
@@ -1322,40 +1304,132 @@ struct ndpi_call_function_struct * get_ndpi_call_function_struct(uint32_t count)
 }
 
 
+#ifdef __KERNEL__
+#define ndpi_callback_lists_get(s)	rcu_dereference((s)->callback_lists)
+#define ndpi_callback_lists_set(s,l)	rcu_assign_pointer((s)->callback_lists, (l))
+#else
+#define ndpi_callback_lists_get(s)	((s)->callback_lists)
+#define ndpi_callback_lists_set(s,l)	((s)->callback_lists = (l))
+#endif
+
+static inline int ndpi_callback_on_tcp(NDPI_SELECTION_BITMASK_PROTOCOL_SIZE sel)
+{
+  return (sel & (NDPI_SELECTION_BITMASK_PROTOCOL_INT_TCP |
+		 NDPI_SELECTION_BITMASK_PROTOCOL_INT_TCP_OR_UDP |
+		 NDPI_SELECTION_BITMASK_PROTOCOL_COMPLETE_TRAFFIC)) != 0;
+}
+
+static inline int ndpi_callback_on_tcp_no_payload(NDPI_SELECTION_BITMASK_PROTOCOL_SIZE sel)
+{
+  return ndpi_callback_on_tcp(sel) && (sel & NDPI_SELECTION_BITMASK_PROTOCOL_HAS_PAYLOAD) == 0;
+}
+
+static inline int ndpi_callback_on_udp(NDPI_SELECTION_BITMASK_PROTOCOL_SIZE sel)
+{
+  return (sel & (NDPI_SELECTION_BITMASK_PROTOCOL_INT_UDP |
+		 NDPI_SELECTION_BITMASK_PROTOCOL_INT_TCP_OR_UDP |
+		 NDPI_SELECTION_BITMASK_PROTOCOL_COMPLETE_TRAFFIC)) != 0;
+}
+
+static inline int ndpi_callback_on_non_tcp_udp(NDPI_SELECTION_BITMASK_PROTOCOL_SIZE sel)
+{
+  return (sel & (NDPI_SELECTION_BITMASK_PROTOCOL_INT_TCP |
+		 NDPI_SELECTION_BITMASK_PROTOCOL_INT_UDP |
+		 NDPI_SELECTION_BITMASK_PROTOCOL_INT_TCP_OR_UDP)) == 0
+    || (sel & NDPI_SELECTION_BITMASK_PROTOCOL_COMPLETE_TRAFFIC) != 0;
+}
+
+/* split callback_buffer into the per l4 lists walked by the packet path */
+static struct ndpi_callback_lists *ndpi_build_callback_lists(struct ndpi_detection_module_struct *ndpi_struct)
+{
+  struct ndpi_callback_lists *lists;
+  struct ndpi_call_function_struct *e;
+  u_int32_t a, n_tcp = 0, n_tcp_no_payload = 0, n_udp = 0, n_non_tcp_udp = 0;
+
+  for (a = 0; a < ndpi_struct->callback_buffer_size; a++) {
+    NDPI_SELECTION_BITMASK_PROTOCOL_SIZE sel = ndpi_struct->callback_buffer[a].ndpi_selection_bitmask;
+
+    n_tcp += ndpi_callback_on_tcp(sel);
+    n_tcp_no_payload += ndpi_callback_on_tcp_no_payload(sel);
+    n_udp += ndpi_callback_on_udp(sel);
+    n_non_tcp_udp += ndpi_callback_on_non_tcp_udp(sel);
+  }
+
+  lists = ndpi_malloc(sizeof(struct ndpi_callback_lists) +
+		      (n_tcp + n_tcp_no_payload + n_udp + n_non_tcp_udp) * sizeof(struct ndpi_call_function_struct));
+  if (lists == NULL)
+    return NULL;
+  memset(lists, 0, sizeof(struct ndpi_callback_lists));
+
+  e = lists->entries;
+  lists->callback_buffer_tcp_payload = e;
+  e += n_tcp;
+  lists->callback_buffer_tcp_no_payload = e;
+  e += n_tcp_no_payload;
+  lists->callback_buffer_udp = e;
+  e += n_udp;
+  lists->callback_buffer_non_tcp_udp = e;
+
+  for (a = 0; a < ndpi_struct->callback_buffer_size; a++) {
+    NDPI_SELECTION_BITMASK_PROTOCOL_SIZE sel = ndpi_struct->callback_buffer[a].ndpi_selection_bitmask;
+
+    if (ndpi_callback_on_tcp(sel))
+      memcpy(&lists->callback_buffer_tcp_payload[lists->callback_buffer_size_tcp_payload++],
+	     &ndpi_struct->callback_buffer[a], sizeof(struct ndpi_call_function_struct));
+    if (ndpi_callback_on_tcp_no_payload(sel))
+      memcpy(&lists->callback_buffer_tcp_no_payload[lists->callback_buffer_size_tcp_no_payload++],
+	     &ndpi_struct->callback_buffer[a], sizeof(struct ndpi_call_function_struct));
+    if (ndpi_callback_on_udp(sel))
+      memcpy(&lists->callback_buffer_udp[lists->callback_buffer_size_udp++],
+	     &ndpi_struct->callback_buffer[a], sizeof(struct ndpi_call_function_struct));
+    if (ndpi_callback_on_non_tcp_udp(sel))
+      memcpy(&lists->callback_buffer_non_tcp_udp[lists->callback_buffer_size_non_tcp_udp++],
+	     &ndpi_struct->callback_buffer[a], sizeof(struct ndpi_call_function_struct));
+  }
+
+  return lists;
+}
+
+#ifdef __KERNEL__
+static void ndpi_free_callback_lists_rcu(struct rcu_head *head)
+{
+  ndpi_free(container_of(head, struct ndpi_callback_lists, rcu));
+}
+#endif
+
+/* packets already walking the old lists finish with them */
+static void ndpi_publish_callback_lists(struct ndpi_detection_module_struct *ndpi_struct,
+					struct ndpi_callback_lists *lists)
+{
+  struct ndpi_callback_lists *old = ndpi_struct->callback_lists;
+
+  ndpi_callback_lists_set(ndpi_struct, lists);
+  if (old == NULL)
+    return;
+#ifdef __KERNEL__
+  call_rcu(&old->rcu, ndpi_free_callback_lists_rcu);
+#else
+  ndpi_free(old);
+#endif
+}
+
 void init_ndpi_call_function_struct(struct ndpi_detection_module_struct * ndpi_struct, ndpi_debug_function_ptr ndpi_debug_printf){
 	ndpi_struct->callback_buffer                = get_ndpi_call_function_struct(NDPI_MAX_SUPPORTED_PROTOCOLS + 1);
-	ndpi_struct->callback_buffer_tcp_no_payload = get_ndpi_call_function_struct(NDPI_MAX_SUPPORTED_PROTOCOLS + 1);
-	ndpi_struct->callback_buffer_tcp_payload    = get_ndpi_call_function_struct(NDPI_MAX_SUPPORTED_PROTOCOLS + 1);
-	ndpi_struct->callback_buffer_udp            = get_ndpi_call_function_struct(NDPI_MAX_SUPPORTED_PROTOCOLS + 1);
-	ndpi_struct->callback_buffer_non_tcp_udp    = get_ndpi_call_function_struct(NDPI_MAX_SUPPORTED_PROTOCOLS + 1);
+	ndpi_struct->callback_buffer_size           = 0;
+	ndpi_struct->callback_lists                 = ndpi_build_callback_lists(ndpi_struct);
 	if(ndpi_struct->callback_buffer == NULL){
 		ndpi_debug_printf(0, NULL, NDPI_LOG_DEBUG, "callback_buffer initial malloc failed\n");
 	}
-	if(ndpi_struct->callback_buffer_tcp_no_payload == NULL){
-		ndpi_debug_printf(0, NULL, NDPI_LOG_DEBUG, "callback_buffer_tcp_no_payload initial malloc failed\n");
-	}
-	if(ndpi_struct->callback_buffer_tcp_payload == NULL){
-		ndpi_debug_printf(0, NULL, NDPI_LOG_DEBUG, "callback_buffer_tcp_payload initial malloc failed\n");
-	}
-	if(ndpi_struct->callback_buffer_udp == NULL){
-		ndpi_debug_printf(0, NULL, NDPI_LOG_DEBUG, "callback_buffer_udp initial malloc failed\n");
-	}
-	if(ndpi_struct->callback_buffer_non_tcp_udp == NULL){
-		ndpi_debug_printf(0, NULL, NDPI_LOG_DEBUG, "callback_buffer_non_tcp_udp initial malloc failed\n");
+	if(ndpi_struct->callback_lists == NULL){
+		ndpi_debug_printf(0, NULL, NDPI_LOG_DEBUG, "callback_lists initial malloc failed\n");
 	}
 }
 
 void finalize_ndpi_call_function_struct(struct ndpi_detection_module_struct * ndpi_struct){
 	ndpi_free(ndpi_struct->callback_buffer);
-	ndpi_free(ndpi_struct->callback_buffer_tcp_no_payload);
-	ndpi_free(ndpi_struct->callback_buffer_tcp_payload);
-	ndpi_free(ndpi_struct->callback_buffer_udp);
-	ndpi_free(ndpi_struct->callback_buffer_non_tcp_udp);
+	ndpi_free(ndpi_struct->callback_lists);
 	ndpi_struct->callback_buffer = NULL;
-	ndpi_struct->callback_buffer_tcp_no_payload = NULL;
-	ndpi_struct->callback_buffer_tcp_payload = NULL;
-	ndpi_struct->callback_buffer_udp = NULL;
-	ndpi_struct->callback_buffer_non_tcp_udp = NULL;
+	ndpi_struct->callback_lists = NULL;
 }
 
 struct ndpi_detection_module_struct *ndpi_init_detection_module(u_int32_t ticks_per_second,
@@ -1652,11 +1726,24 @@ int ndpi_load_protocols_file(struct ndpi_detection_module_struct *ndpi_mod, char
 
 /* ******************************************************************** */
 
-void ndpi_set_protocol_detection_bitmask2(struct ndpi_detection_module_struct *ndpi_struct,
-					  const NDPI_PROTOCOL_BITMASK * dbm)
+int ndpi_set_protocol_detection_bitmask2(struct ndpi_detection_module_struct *ndpi_struct,
+					 const NDPI_PROTOCOL_BITMASK * dbm)
+{
+  if (ndpi_set_protocol_dispatch_bitmask(ndpi_struct, dbm) != 0)
+    return -1;
+
+  NDPI_BITMASK_SET(ndpi_struct->detection_bitmask, *dbm);
+  return 0;
+}
+
+/* ******************************************************************** */
+
+int ndpi_set_protocol_dispatch_bitmask(struct ndpi_detection_module_struct *ndpi_struct,
+				       const NDPI_PROTOCOL_BITMASK * dbm)
 {
   NDPI_PROTOCOL_BITMASK detection_bitmask_local;
   NDPI_PROTOCOL_BITMASK *detection_bitmask = &detection_bitmask_local;
+  struct ndpi_callback_lists *lists;
   u_int32_t a = 0;
 
   #ifdef DEBUG
@@ -1664,10 +1751,14 @@ void ndpi_set_protocol_detection_bitmask2(struct ndpi_detection_module_struct *n
 	//printf("[PT]2)a is %x, should be 0\n", a);
   #endif
   NDPI_BITMASK_SET(detection_bitmask_local, *dbm);
-  NDPI_BITMASK_SET(ndpi_struct->detection_bitmask, *dbm);
 
-  /* set this here to zero to be interrupt safe */
+  if (ndpi_struct->callback_buffer == NULL)
+    return -1;
+
+  /* the packet path only reads callback_lists, this buffer is ours */
   ndpi_struct->callback_buffer_size = 0;
+  memset(ndpi_struct->callback_buffer, 0,
+	 sizeof(struct ndpi_call_function_struct) * (NDPI_MAX_SUPPORTED_PROTOCOLS + 1));
   NDPI_LOG(NDPI_PROTOCOL_UNKNOWN, ndpi_struct, NDPI_LOG_DEBUG,
 		 "callback_buffer_size is %u, should be 0\n", ndpi_struct->callback_buffer_size);
 
@@ -2933,65 +3024,12 @@ void ndpi_set_protocol_detection_bitmask2(struct ndpi_detection_module_struct *n
 	   "callback_buffer_size is %u, it should be %u\n", ndpi_struct->callback_buffer_size, a);
 
   /* now build the specific buffer for tcp, udp and non_tcp_udp */
-  ndpi_struct->callback_buffer_size_tcp_payload = 0;
-  ndpi_struct->callback_buffer_size_tcp_no_payload = 0;
-  for (a = 0; a < ndpi_struct->callback_buffer_size; a++) {
-    if ((ndpi_struct->callback_buffer[a].ndpi_selection_bitmask & (NDPI_SELECTION_BITMASK_PROTOCOL_INT_TCP |
-								   NDPI_SELECTION_BITMASK_PROTOCOL_INT_TCP_OR_UDP |
-								   NDPI_SELECTION_BITMASK_PROTOCOL_COMPLETE_TRAFFIC))
-	!= 0) {
-     //  NDPI_LOG(NDPI_PROTOCOL_UNKNOWN, ndpi_struct, NDPI_LOG_DEBUG,
-	 //      "callback_buffer_tcp_payload, adding buffer %u as entry %u\n", a,
-	 //    ndpi_struct->callback_buffer_size_tcp_payload);
-
-      memcpy(&ndpi_struct->callback_buffer_tcp_payload[ndpi_struct->callback_buffer_size_tcp_payload],
-	     &ndpi_struct->callback_buffer[a], sizeof(struct ndpi_call_function_struct));
-      ndpi_struct->callback_buffer_size_tcp_payload++;
-
-      if ((ndpi_struct->
-	   callback_buffer[a].ndpi_selection_bitmask & NDPI_SELECTION_BITMASK_PROTOCOL_HAS_PAYLOAD) == 0) {
-	//NDPI_LOG(NDPI_PROTOCOL_UNKNOWN, ndpi_struct, NDPI_LOG_DEBUG,
-	//	 "callback_buffer_tcp_no_payload, additional adding buffer %u to no_payload process\n", a);
-
-	memcpy(&ndpi_struct->callback_buffer_tcp_no_payload
-	       [ndpi_struct->callback_buffer_size_tcp_no_payload], &ndpi_struct->callback_buffer[a],
-	       sizeof(struct ndpi_call_function_struct));
-	ndpi_struct->callback_buffer_size_tcp_no_payload++;
-      }
-    }
-  }
-
-  ndpi_struct->callback_buffer_size_udp = 0;
-  for (a = 0; a < ndpi_struct->callback_buffer_size; a++) {
-    if ((ndpi_struct->callback_buffer[a].ndpi_selection_bitmask & (NDPI_SELECTION_BITMASK_PROTOCOL_INT_UDP |
-								   NDPI_SELECTION_BITMASK_PROTOCOL_INT_TCP_OR_UDP |
-								   NDPI_SELECTION_BITMASK_PROTOCOL_COMPLETE_TRAFFIC))
-	!= 0) {
-     // NDPI_LOG(NDPI_PROTOCOL_UNKNOWN, ndpi_struct, NDPI_LOG_DEBUG,
-	  //     "callback_buffer_size_udp, adding buffer %u\n", a);
-
-      memcpy(&ndpi_struct->callback_buffer_udp[ndpi_struct->callback_buffer_size_udp],
-	     &ndpi_struct->callback_buffer[a], sizeof(struct ndpi_call_function_struct));
-      ndpi_struct->callback_buffer_size_udp++;
-    }
-  }
+  lists = ndpi_build_callback_lists(ndpi_struct);
+  if (lists == NULL)
+    return -1;
 
-  ndpi_struct->callback_buffer_size_non_tcp_udp = 0;
-  for (a = 0; a < ndpi_struct->callback_buffer_size; a++) {
-    if ((ndpi_struct->callback_buffer[a].ndpi_selection_bitmask & (NDPI_SELECTION_BITMASK_PROTOCOL_INT_TCP |
-								   NDPI_SELECTION_BITMASK_PROTOCOL_INT_UDP |
-								   NDPI_SELECTION_BITMASK_PROTOCOL_INT_TCP_OR_UDP))
-	== 0
-	|| (ndpi_struct->
-	    callback_buffer[a].ndpi_selection_bitmask & NDPI_SELECTION_BITMASK_PROTOCOL_COMPLETE_TRAFFIC) != 0) {
-    //  NDPI_LOG(NDPI_PROTOCOL_UNKNOWN, ndpi_struct, NDPI_LOG_DEBUG,
-	//       "callback_buffer_size_non_tcp_udp, adding buffer %u\n", a);
-
-      memcpy(&ndpi_struct->callback_buffer_non_tcp_udp[ndpi_struct->callback_buffer_size_non_tcp_udp],
-	     &ndpi_struct->callback_buffer[a], sizeof(struct ndpi_call_function_struct));
-      ndpi_struct->callback_buffer_size_non_tcp_udp++;
-    }
-  }
+  ndpi_publish_callback_lists(ndpi_struct, lists);
+  return 0;
 }
 
 #ifdef NDPI_DETECTION_SUPPORT_IPV6
@@ -3044,14 +3082,17 @@ static int ndpi_handle_ipv6_extension_headers(struct ndpi_detection_module_struc
 #endif							/* NDPI_DETECTION_SUPPORT_IPV6 */
 
 
+/* ipsize may be shorter than tot_len: callers are allowed to hand over only
+ * the first bytes of a packet (e.g. a bounded inspection window) */
 static u_int8_t ndpi_iph_is_valid_and_not_fragmented(const struct ndpi_iphdr *iph, const u_int16_t ipsize)
 {
-  //#ifdef REQUIRE_FULL_PACKETS
   if (ipsize < iph->ihl * 4 ||
-      ipsize < ntohs(iph->tot_len) || ntohs(iph->tot_len) < iph->ihl * 4 || (iph->frag_off & htons(0x1FFF)) != 0) {
+#ifdef REQUIRE_FULL_PACKETS
+      ipsize < ntohs(iph->tot_len) ||
+#endif
+      ntohs(iph->tot_len) < iph->ihl * 4 || (iph->frag_off & htons(0x1FFF)) != 0) {
     return 0;
   }
-  //#endif
 
   return 1;
 }
@@ -3104,15 +3145,20 @@ static u_int8_t ndpi_detection_get_l4_internal(struct ndpi_detection_module_stru
 
     l4ptr = (((const u_int8_t *) iph) + iph->ihl * 4);
 
-    if(len == 0) len = l3_len;
+    /* TSO packets have no total length, truncated ones only carry l3_len bytes */
+    if(len == 0 || len > l3_len) len = l3_len;
 
     l4len = (len > hlen) ? (len - hlen) : 0;
     l4protocol = iph->protocol;
   }
 #ifdef NDPI_DETECTION_SUPPORT_IPV6
-  else if (iph_v6 != NULL && (l3_len - sizeof(struct ndpi_ipv6hdr)) >= ntohs(iph_v6->payload_len)) {
+  else if (iph_v6 != NULL) {
     l4ptr = (((const u_int8_t *) iph_v6) + sizeof(struct ndpi_ipv6hdr));
     l4len = ntohs(iph_v6->payload_len);
+
+    /* jumbograms have no payload length, truncated packets only carry l3_len bytes */
+    if(l4len == 0 || l4len > l3_len - sizeof(struct ndpi_ipv6hdr))
+      l4len = l3_len - sizeof(struct ndpi_ipv6hdr);
     l4protocol = iph_v6->nexthdr;
 
     // we need to handle IPv6 extension headers if present
@@ -3429,6 +3475,7 @@ unsigned int ndpi_detection_process_packet_by_bitmask(struct ndpi_detection_modu
   u_int32_t a;
   NDPI_SELECTION_BITMASK_PROTOCOL_SIZE ndpi_selection_packet;
   NDPI_PROTOCOL_BITMASK detection_bitmask;
+  const struct ndpi_callback_lists *cbl;
   printf("#1\n");
   if(flow == NULL)
     return(NDPI_PROTOCOL_UNKNOWN);
@@ -3491,16 +3538,21 @@ unsigned int ndpi_detection_process_packet_by_bitmask(struct ndpi_detection_modu
 
   NDPI_SAVE_AS_BITMASK(detection_bitmask, flow->packet.detected_protocol_stack[0]);
 
+  /* in the kernel the caller holds rcu_read_lock() */
+  cbl = ndpi_callback_lists_get(ndpi_struct);
+  if (cbl == NULL)
+    return NDPI_PROTOCOL_UNKNOWN;
+
   if (flow != NULL && flow->packet.tcp != NULL) {
     if (flow->packet.payload_packet_len != 0) {
-      for (a = 0; a < ndpi_struct->callback_buffer_size_tcp_payload; a++) {
-	if ((ndpi_struct->callback_buffer_tcp_payload[a].ndpi_selection_bitmask & ndpi_selection_packet) ==
-	    ndpi_struct->callback_buffer_tcp_payload[a].ndpi_selection_bitmask
+      for (a = 0; a < cbl->callback_buffer_size_tcp_payload; a++) {
+	if ((cbl->callback_buffer_tcp_payload[a].ndpi_selection_bitmask & ndpi_selection_packet) ==
+	    cbl->callback_buffer_tcp_payload[a].ndpi_selection_bitmask
 	    && NDPI_BITMASK_COMPARE(flow->excluded_protocol_bitmask,
-				    ndpi_struct->callback_buffer_tcp_payload[a].excluded_protocol_bitmask) == 0
-	    && NDPI_BITMASK_COMPARE(ndpi_struct->callback_buffer_tcp_payload[a].detection_bitmask,
+				    cbl->callback_buffer_tcp_payload[a].excluded_protocol_bitmask) == 0
+	    && NDPI_BITMASK_COMPARE(cbl->callback_buffer_tcp_payload[a].detection_bitmask,
 				    detection_bitmask) != 0) {
-	  ndpi_struct->callback_buffer_tcp_payload[a].func(ndpi_struct, flow);
+	  cbl->callback_buffer_tcp_payload[a].func(ndpi_struct, flow);
 	  #ifdef DEBUG
 		printf("[zllz] ----- after func payload:{%s}\n",flow->packet.payload);
 	  #endif
@@ -3511,14 +3563,14 @@ unsigned int ndpi_detection_process_packet_by_bitmask(struct ndpi_detection_modu
       }
     } else {				/* no payload */
 
-      for (a = 0; a < ndpi_struct->callback_buffer_size_tcp_no_payload; a++) {
-	if ((ndpi_struct->callback_buffer_tcp_no_payload[a].ndpi_selection_bitmask & ndpi_selection_packet) ==
-	    ndpi_struct->callback_buffer_tcp_no_payload[a].ndpi_selection_bitmask
+      for (a = 0; a < cbl->callback_buffer_size_tcp_no_payload; a++) {
+	if ((cbl->callback_buffer_tcp_no_payload[a].ndpi_selection_bitmask & ndpi_selection_packet) ==
+	    cbl->callback_buffer_tcp_no_payload[a].ndpi_selection_bitmask
 	    && NDPI_BITMASK_COMPARE(flow->excluded_protocol_bitmask,
-				    ndpi_struct->callback_buffer_tcp_no_payload[a].excluded_protocol_bitmask) == 0
-	    && NDPI_BITMASK_COMPARE(ndpi_struct->callback_buffer_tcp_no_payload[a].detection_bitmask,
+				    cbl->callback_buffer_tcp_no_payload[a].excluded_protocol_bitmask) == 0
+	    && NDPI_BITMASK_COMPARE(cbl->callback_buffer_tcp_no_payload[a].detection_bitmask,
 				    detection_bitmask) != 0) {
-	  ndpi_struct->callback_buffer_tcp_no_payload[a].func(ndpi_struct, flow);
+	  cbl->callback_buffer_tcp_no_payload[a].func(ndpi_struct, flow);
 
 	  if(flow->detected_protocol_stack[0] != NDPI_PROTOCOL_UNKNOWN)
 	    break; /* Stop after detecting the first protocol */
@@ -3526,14 +3578,14 @@ unsigned int ndpi_detection_process_packet_by_bitmask(struct ndpi_detection_modu
       }
     }
   } else if (flow != NULL && flow->packet.udp != NULL) {
-    for (a = 0; a < ndpi_struct->callback_buffer_size_udp; a++) {
-      if ((ndpi_struct->callback_buffer_udp[a].ndpi_selection_bitmask & ndpi_selection_packet) ==
-	  ndpi_struct->callback_buffer_udp[a].ndpi_selection_bitmask
+    for (a = 0; a < cbl->callback_buffer_size_udp; a++) {
+      if ((cbl->callback_buffer_udp[a].ndpi_selection_bitmask & ndpi_selection_packet) ==
+	  cbl->callback_buffer_udp[a].ndpi_selection_bitmask
 	  && NDPI_BITMASK_COMPARE(flow->excluded_protocol_bitmask,
-				  ndpi_struct->callback_buffer_udp[a].excluded_protocol_bitmask) == 0
-	  && NDPI_BITMASK_COMPARE(ndpi_struct->callback_buffer_udp[a].detection_bitmask,
+				  cbl->callback_buffer_udp[a].excluded_protocol_bitmask) == 0
+	  && NDPI_BITMASK_COMPARE(cbl->callback_buffer_udp[a].detection_bitmask,
 				  detection_bitmask) != 0) {
-	ndpi_struct->callback_buffer_udp[a].func(ndpi_struct, flow);
+	cbl->callback_buffer_udp[a].func(ndpi_struct, flow);
 
 	if(flow->detected_protocol_stack[0] != NDPI_PROTOCOL_UNKNOWN)
 	  break; /* Stop after detecting the first protocol */
@@ -3541,18 +3593,18 @@ unsigned int ndpi_detection_process_packet_by_bitmask(struct ndpi_detection_modu
     }
   } else {
 
-    for (a = 0; a < ndpi_struct->callback_buffer_size_non_tcp_udp; a++) {
-      if ((ndpi_struct->callback_buffer_non_tcp_udp[a].ndpi_selection_bitmask & ndpi_selection_packet) ==
-	  ndpi_struct->callback_buffer_non_tcp_udp[a].ndpi_selection_bitmask
+    for (a = 0; a < cbl->callback_buffer_size_non_tcp_udp; a++) {
+      if ((cbl->callback_buffer_non_tcp_udp[a].ndpi_selection_bitmask & ndpi_selection_packet) ==
+	  cbl->callback_buffer_non_tcp_udp[a].ndpi_selection_bitmask
 	  && (flow == NULL
 	      ||
 	      NDPI_BITMASK_COMPARE
 	      (flow->excluded_protocol_bitmask,
-	       ndpi_struct->callback_buffer_non_tcp_udp[a].excluded_protocol_bitmask) == 0)
-	  && NDPI_BITMASK_COMPARE(ndpi_struct->callback_buffer_non_tcp_udp[a].detection_bitmask,
+	       cbl->callback_buffer_non_tcp_udp[a].excluded_protocol_bitmask) == 0)
+	  && NDPI_BITMASK_COMPARE(cbl->callback_buffer_non_tcp_udp[a].detection_bitmask,
 				  detection_bitmask) != 0) {
 
-	ndpi_struct->callback_buffer_non_tcp_udp[a].func(ndpi_struct, flow);
+	cbl->callback_buffer_non_tcp_udp[a].func(ndpi_struct, flow);
 
 	if(flow->detected_protocol_stack[0] != NDPI_PROTOCOL_UNKNOWN)
 	  break; /* Stop after detecting the first protocol */
@@ -3616,6 +3668,7 @@ unsigned int ndpi_detection_process_packet(struct ndpi_detection_module_struct *
     u_int32_t a;
     NDPI_SELECTION_BITMASK_PROTOCOL_SIZE ndpi_selection_packet;
     NDPI_PROTOCOL_BITMASK detection_bitmask;
+    const struct ndpi_callback_lists *cbl;
 #ifdef DEBUG
     printf("[NDPI][NDPI2] --------- 2) START in ndpi_detection_process_packet\n");
     printf("[NDPI][NDPI2] --------------a. flow:%s packet: %s strlen(packet):%d packetlen:%u \n",flow == NULL? "null":"not null", packet == NULL?"null":"not null", packet==NULL?(-1):strlen(packet), packetlen);//no any payload here
@@ -3707,6 +3760,11 @@ unsigned int ndpi_detection_process_packet(struct ndpi_detection_module_struct *
 
   NDPI_SAVE_AS_BITMASK(detection_bitmask, flow->packet.detected_protocol_stack[0]);
 
+  /* in the kernel the caller holds rcu_read_lock() */
+  cbl = ndpi_callback_lists_get(ndpi_struct);
+  if (cbl == NULL)
+    return NDPI_PROTOCOL_UNKNOWN;
+
   if (flow != NULL && flow->packet.tcp != NULL) {
   #ifdef DEBUG
   	printf("[NDPI][NDPI2] check top of tcp \n");
@@ -3716,20 +3774,20 @@ unsigned int ndpi_detection_process_packet(struct ndpi_detection_module_struct *
 				print_payload(ndpi_struct, flow, "tcp");
 				printf("[NDPI][NDPI2] checking number:");
 		#endif
-      for (a = 0; a < ndpi_struct->callback_buffer_size_tcp_payload; a++) {
+      for (a = 0; a < cbl->callback_buffer_size_tcp_payload; a++) {
 	  	#ifdef DEBUG
 	  	printf(",%u ",a);
 		#endif
-	if ((ndpi_struct->callback_buffer_tcp_payload[a].ndpi_selection_bitmask & ndpi_selection_packet) ==
-	    ndpi_struct->callback_buffer_tcp_payload[a].ndpi_selection_bitmask
+	if ((cbl->callback_buffer_tcp_payload[a].ndpi_selection_bitmask & ndpi_selection_packet) ==
+	    cbl->callback_buffer_tcp_payload[a].ndpi_selection_bitmask
 	    && NDPI_BITMASK_COMPARE(flow->excluded_protocol_bitmask,
-				    ndpi_struct->callback_buffer_tcp_payload[a].excluded_protocol_bitmask) == 0
-	    && NDPI_BITMASK_COMPARE(ndpi_struct->callback_buffer_tcp_payload[a].detection_bitmask,
+				    cbl->callback_buffer_tcp_payload[a].excluded_protocol_bitmask) == 0
+	    && NDPI_BITMASK_COMPARE(cbl->callback_buffer_tcp_payload[a].detection_bitmask,
 				    detection_bitmask) != 0) {
 					  #ifdef DEBUG
 						//printf("[zllz] ----- before func payload:{%s}\n",flow->packet.payload);
 					  #endif				    
-	  ndpi_struct->callback_buffer_tcp_payload[a].func(ndpi_struct, flow);
+	  cbl->callback_buffer_tcp_payload[a].func(ndpi_struct, flow);
 	  #ifdef DEBUG
 		//printf("[zllz] ----- after func payload:{%s}\n",flow->packet.payload);
 	  #endif
@@ -3751,18 +3809,17 @@ unsigned int ndpi_detection_process_packet(struct ndpi_detection_module_struct *
 	  #ifdef DEBUG
 			printf("[NDPI][NDPI2] no payload\n");
 	  #endif
-      for (a = 0; a < ndpi_struct->callback_buffer_size_tcp_no_payload; a++) {
+      for (a = 0; a < cbl->callback_buffer_size_tcp_no_payload; a++) {
 	  	#ifdef DEBUG
 			printf(",%u ",a);
 		#endif
-	if ((ndpi_struct->callback_buffer_tcp_no_payload[a].ndpi_selection_bitmask & ndpi_selection_packet) ==
-	    ndpi_struct->callback_buffer_tcp_no_payload[a].ndpi_selection_bitmask
+	if ((cbl->callback_buffer_tcp_no_payload[a].ndpi_selection_bitmask & ndpi_selection_packet) ==
+	    cbl->callback_buffer_tcp_no_payload[a].ndpi_selection_bitmask
 	    && NDPI_BITMASK_COMPARE(flow->excluded_protocol_bitmask,
-				    ndpi_struct->
-				    callback_buffer_tcp_no_payload[a].excluded_protocol_bitmask) == 0
-	    && NDPI_BITMASK_COMPARE(ndpi_struct->callback_buffer_tcp_no_payload[a].detection_bitmask,
+				    cbl->callback_buffer_tcp_no_payload[a].excluded_protocol_bitmask) == 0
+	    && NDPI_BITMASK_COMPARE(cbl->callback_buffer_tcp_no_payload[a].detection_bitmask,
 				    detection_bitmask) != 0) {
-	  ndpi_struct->callback_buffer_tcp_no_payload[a].func(ndpi_struct, flow);
+	  cbl->callback_buffer_tcp_no_payload[a].func(ndpi_struct, flow);
 
 	  if(flow->detected_protocol_stack[0] != NDPI_PROTOCOL_UNKNOWN){
 	  	#ifdef DEBUG
@@ -3783,17 +3840,17 @@ unsigned int ndpi_detection_process_packet(struct ndpi_detection_module_struct *
 		print_payload(ndpi_struct,flow, "udp");
 		printf("[NDPI][NDPI2] checking number:");
   #endif
-	for (a = 0; a < ndpi_struct->callback_buffer_size_udp; a++) {
+	for (a = 0; a < cbl->callback_buffer_size_udp; a++) {
 	  #ifdef DEBUG
 		printf(",%u ",a);
 	  #endif
-      if ((ndpi_struct->callback_buffer_udp[a].ndpi_selection_bitmask & ndpi_selection_packet) ==
-	  ndpi_struct->callback_buffer_udp[a].ndpi_selection_bitmask
+      if ((cbl->callback_buffer_udp[a].ndpi_selection_bitmask & ndpi_selection_packet) ==
+	  cbl->callback_buffer_udp[a].ndpi_selection_bitmask
 	  && NDPI_BITMASK_COMPARE(flow->excluded_protocol_bitmask,
-				  ndpi_struct->callback_buffer_udp[a].excluded_protocol_bitmask) == 0
-	  && NDPI_BITMASK_COMPARE(ndpi_struct->callback_buffer_udp[a].detection_bitmask,
+				  cbl->callback_buffer_udp[a].excluded_protocol_bitmask) == 0
+	  && NDPI_BITMASK_COMPARE(cbl->callback_buffer_udp[a].detection_bitmask,
 				  detection_bitmask) != 0) {
-	ndpi_struct->callback_buffer_udp[a].func(ndpi_struct, flow);
+	cbl->callback_buffer_udp[a].func(ndpi_struct, flow);
 
 	if(flow->detected_protocol_stack[0] != NDPI_PROTOCOL_UNKNOWN){
 		#ifdef DEBUG
@@ -3813,21 +3870,21 @@ unsigned int ndpi_detection_process_packet(struct ndpi_detection_module_struct *
 	  //printf("[NDPI][NDPI2] payload:%s\n",flow->packet.payload);
 	  printf("[NDPI][NDPI2] checking number:");
   #endif
-    for (a = 0; a < ndpi_struct->callback_buffer_size_non_tcp_udp; a++) {
+    for (a = 0; a < cbl->callback_buffer_size_non_tcp_udp; a++) {
 	#ifdef DEBUG
 		printf(",%u ",a);
 	#endif
-      if ((ndpi_struct->callback_buffer_non_tcp_udp[a].ndpi_selection_bitmask & ndpi_selection_packet) ==
-	  ndpi_struct->callback_buffer_non_tcp_udp[a].ndpi_selection_bitmask
+      if ((cbl->callback_buffer_non_tcp_udp[a].ndpi_selection_bitmask & ndpi_selection_packet) ==
+	  cbl->callback_buffer_non_tcp_udp[a].ndpi_selection_bitmask
 	  && (flow == NULL
 	      ||
 	      NDPI_BITMASK_COMPARE
 	      (flow->excluded_protocol_bitmask,
-	       ndpi_struct->callback_buffer_non_tcp_udp[a].excluded_protocol_bitmask) == 0)
-	  && NDPI_BITMASK_COMPARE(ndpi_struct->callback_buffer_non_tcp_udp[a].detection_bitmask,
+	       cbl->callback_buffer_non_tcp_udp[a].excluded_protocol_bitmask) == 0)
+	  && NDPI_BITMASK_COMPARE(cbl->callback_buffer_non_tcp_udp[a].detection_bitmask,
 				  detection_bitmask) != 0) {
 
-	ndpi_struct->callback_buffer_non_tcp_udp[a].func(ndpi_struct, flow);
+	cbl->callback_buffer_non_tcp_udp[a].func(ndpi_struct, flow);
 
 	if(flow->detected_protocol_stack[0] != NDPI_PROTOCOL_UNKNOWN){
 	#ifdef DEBUG
@@ -4111,6 +4168,25 @@ u_int32_t ndpi_bytestream_to_ipv4(const u_int8_t * str, u_int16_t max_chars_to_r
   return htonl(val);
 }
 
+/* print the string representation of ip into a caller supplied buffer,
+ * safe to be used concurrently from the packet path */
+static char *ndpi_format_ip_string(const ndpi_ip_addr_t * ip, char *buf, u_int buf_len)
+{
+  const u_int8_t *a = (const u_int8_t *) &ip->ipv4;
+
+#ifdef NDPI_DETECTION_SUPPORT_IPV6
+  if (ip->ipv6.ndpi_v6_u.u6_addr32[1] != 0 || ip->ipv6.ndpi_v6_u.u6_addr64[1] != 0) {
+    const u_int16_t *b = ip->ipv6.ndpi_v6_u.u6_addr16;
+    snprintf(buf, buf_len, "%x:%x:%x:%x:%x:%x:%x:%x",
+	     ntohs(b[0]), ntohs(b[1]), ntohs(b[2]), ntohs(b[3]),
+	     ntohs(b[4]), ntohs(b[5]), ntohs(b[6]), ntohs(b[7]));
+    return buf;
+  }
+#endif
+  snprintf(buf, buf_len, "%u.%u.%u.%u", a[0], a[1], a[2], a[3]);
+  return buf;
+}
+
 /* internal function for every detection to parse one packet and to increase the info buffer */
 void ndpi_parse_packet_line_info(struct ndpi_detection_module_struct *ndpi_struct,
 				 struct ndpi_flow_struct *flow)
@@ -4167,7 +4243,6 @@ void ndpi_parse_packet_line_info(struct ndpi_detection_module_struct *ndpi_struc
     /* parse over. */
     if (!packet->host_line.ptr) {
         ndpi_ip_addr_t ip;
-        const char *ipstr;
         int len;
         /* client to server */
         if (packet->client2server) {
@@ -4175,10 +4250,9 @@ void ndpi_parse_packet_line_info(struct ndpi_detection_module_struct *ndpi_struc
         } else {
             ndpi_packet_src_ip_get(packet, &ip);
         }
-        ipstr = ndpi_get_ip_string(ndpi_struct, &ip);
-        len = ndpi_min(strlen(ipstr), NDPI_IP_STRING_SIZE);
-        strncpy(flow->host_server_name, ipstr, len);
-        flow->host_server_name[len] = '\0';
+        /* print straight into the flow, the module wide ip_string is not per packet */
+        ndpi_format_ip_string(&ip, (char *)flow->host_server_name, NDPI_IP_STRING_SIZE);
+        len = strlen((char *)flow->host_server_name);
         packet->host_line.ptr = flow->host_server_name;
         packet->host_line.len = len;
     }
@@ -4944,19 +5018,7 @@ void ndpi_packet_dst_ip_get(const struct ndpi_packet_struct *packet, ndpi_ip_add
 extern char *ndpi_get_ip_string(struct ndpi_detection_module_struct *ndpi_struct,
 			 const ndpi_ip_addr_t * ip)
 {
-  const u_int8_t *a = (const u_int8_t *) &ip->ipv4;
-
-#ifdef NDPI_DETECTION_SUPPORT_IPV6
-  if (ip->ipv6.ndpi_v6_u.u6_addr32[1] != 0 || ip->ipv6.ndpi_v6_u.u6_addr64[1] != 0) {
-    const u_int16_t *b = ip->ipv6.ndpi_v6_u.u6_addr16;
-    snprintf(ndpi_struct->ip_string, NDPI_IP_STRING_SIZE, "%x:%x:%x:%x:%x:%x:%x:%x",
-	     ntohs(b[0]), ntohs(b[1]), ntohs(b[2]), ntohs(b[3]),
-	     ntohs(b[4]), ntohs(b[5]), ntohs(b[6]), ntohs(b[7]));
-    return ndpi_struct->ip_string;
-  }
-#endif
-  snprintf(ndpi_struct->ip_string, NDPI_IP_STRING_SIZE, "%u.%u.%u.%u", a[0], a[1], a[2], a[3]);
-  return ndpi_struct->ip_string;
+  return ndpi_format_ip_string(ip, ndpi_struct->ip_string, NDPI_IP_STRING_SIZE);
 }
 
 
@@ -5097,36 +5159,22 @@ static int ndpi_match_string_subprotocol2(struct ndpi_detection_module_struct *n
   int matching_protocol_id;
   struct ndpi_packet_struct *packet = &flow->packet;
   AC_TEXT_t ac_input_text;
+  AC_CURSOR_t ac_cursor;
 
   if((ndpi_struct->ac_automa == NULL) || (string_to_match_len== 0)) return(NDPI_PROTOCOL_UNKNOWN);
 
-  if(!ndpi_struct->ac_automa_finalized) {
-  	#ifdef AC_DEBUG
-	printf("[NDPI] ac_automata_finalize start\n");
-	#endif
-    ac_automata_finalize((AC_AUTOMATA_t*)ndpi_struct->ac_automa);
-	#ifdef AC_DEBUG
-	printf("[NDPI] ac_automata_finalize end\n");
-	#endif
-    ndpi_struct->ac_automa_finalized = 1;
-  }else{
-	#ifdef AC_DEBUG
-	printf("[NDPI] ac_automata_finalize skip\n");
-	#endif
-  }
+  /* ndpi_finalize_automa() runs once before any packet is processed */
+  if(!ndpi_struct->ac_automa_finalized) return(NDPI_PROTOCOL_UNKNOWN);
 
   matching_protocol_id = NDPI_PROTOCOL_UNKNOWN;
 
   ac_input_text.astring = string_to_match, ac_input_text.length = string_to_match_len;
+  /* the cursor lives on our stack, the shared automata is only read */
+  ac_automata_reset_r(((AC_AUTOMATA_t*)ndpi_struct->ac_automa), &ac_cursor);
   #ifdef AC_DEBUG
 	printf("[NDPI] ac_automata_search \n");
   #endif
-  ac_automata_search (((AC_AUTOMATA_t*)ndpi_struct->ac_automa), &ac_input_text, (void*)&matching_protocol_id);
-  #ifdef AC_DEBUG
-	  printf("[NDPI] ac_automata_reset \n");
-  #endif
-
-  ac_automata_reset(((AC_AUTOMATA_t*)ndpi_struct->ac_automa));
+  ac_automata_search_r (((AC_AUTOMATA_t*)ndpi_struct->ac_automa), &ac_cursor, &ac_input_text, (void*)&matching_protocol_id);
 
 #ifdef DEBUG
   {
@@ -5222,6 +5270,21 @@ int ndpi_add_host_url_subprotocol_to_automa(struct ndpi_detection_module_struct
 
 /* ****************************************************** */
 
+/*
+  Call once all the host patterns are in (ndpi_init_detection_module() plus
+  any ndpi_load_protocols_file()), before the first packet is processed:
+  the automata is searched without locks and can't be changed afterwards.
+*/
+void ndpi_finalize_automa(struct ndpi_detection_module_struct *ndpi_struct) {
+  if(ndpi_struct->ac_automa_finalized || (ndpi_struct->ac_automa == NULL))
+    return;
+
+  ac_automata_finalize((AC_AUTOMATA_t*)ndpi_struct->ac_automa);
+  ndpi_struct->ac_automa_finalized = 1;
+}
+
+/* ****************************************************** */
+
 void ndpi_set_automa(struct ndpi_detection_module_struct *ndpi_struct, void* automa) {
   void *old_automa;
 
@@ -5336,6 +5399,14 @@ extern void *memfind(const void *_mem, ssize_t memlen, const void *_pat, ssize_t
     return NULL;
 }
 
+#ifndef __KERNEL__
+#define ndpi_hash_lock(t)   pthread_mutex_lock(&(t)->lock)
+#define ndpi_hash_unlock(t) pthread_mutex_unlock(&(t)->lock)
+#else
+#define ndpi_hash_lock(t)   spin_lock_bh(&(t)->lock)
+#define ndpi_hash_unlock(t) spin_unlock_bh(&(t)->lock)
+#endif
+
 static u_int32_t ndpi_default_hash_fn(u_int8_t const *key, int len)
 {
     u_int32_t hash = 0;
@@ -5423,6 +5494,11 @@ extern ndpi_hash_t *ndpi_hash_create(int tablesize, int capacity,
     new->lru_prev = new->lru_next = new;
     ret->head = ret->tail = new;
     ret->hash_fn  = hash_fn? hash_fn: ndpi_default_hash_fn;
+#ifndef __KERNEL__
+    pthread_mutex_init(&ret->lock, NULL);
+#else
+    spin_lock_init(&ret->lock);
+#endif
     /* set NULL */
     memset(ret->table, 0, sizeof(struct pro_node*) * tablesize);
 
@@ -5439,9 +5515,13 @@ extern int ndpi_hash_add(ndpi_hash_t *t, u_int8_t const *key, int len, int proto
     /* -1 imply that key is not found */
     if (!t) return -1;
     hash = t->hash_fn(key, len);
+    ndpi_hash_lock(t);
     node = &t->table[hash % t->table_size];
     new = ndpi_hash_node_new(t);
-    if (!new) return -1;
+    if (!new) {
+        ndpi_hash_unlock(t);
+        return -1;
+    }
 
 //#define LOCAL_DEBUG_HASH
 #if (defined(LOCAL_DEBUG_HASH) && defined(__KERNEL__))
@@ -5454,6 +5534,7 @@ extern int ndpi_hash_add(ndpi_hash_t *t, u_int8_t const *key, int len, int proto
     new->hash = hash;
     new->next = *node;
     *node = new;
+    ndpi_hash_unlock(t);
 
     return protocol;
 }
@@ -5468,14 +5549,19 @@ extern int ndpi_hash_search(ndpi_hash_t *t, u_int8_t const *key, int len, int pr
 {
     u_int32_t hash;
     struct pro_node *node;
+    int found = 0;
     if (!t) return 0;
     hash = t->hash_fn(key, len);
+    ndpi_hash_lock(t);
     for (node = t->table[hash % t->table_size]; node; node = node->next) {
-        if (hash == node->hash && protocol == node->pro)
-            return 1;
+        if (hash == node->hash && protocol == node->pro) {
+            found = 1;
+            break;
+        }
     }
+    ndpi_hash_unlock(t);
 
-    return 0;
+    return found;
 }
 /**
  * Same as ndpi_hash_search(), but if found key-protocol pair, then remove it from the table.
@@ -5497,14 +5583,19 @@ extern int ndpi_hash_remove(ndpi_hash_t *t, u_int8_t const *key, int len, int pr
         printk("ndpi_hash_remove: remove from the link with only one node.\n");
     }
 #endif
+    ndpi_hash_lock(t);
     node = &t->table[idx];
     while (*node && !((*node)->hash == hash && (*node)->pro == protocol))
         node = &(*node)->next;
 
-    if (!*node) return 0;
+    if (!*node) {
+        ndpi_hash_unlock(t);
+        return 0;
+    }
     next = (*node)->next;
     ndpi_hash_node_free(t, *node);
     *node = next;
+    ndpi_hash_unlock(t);
 
     return 1;
 }
@@ -5521,6 +5612,9 @@ extern void ndpi_hash_destory(ndpi_hash_t **t)
     }
     ndpi_free((*t)->tail);
 
+#ifndef __KERNEL__
+    pthread_mutex_destroy(&(*t)->lock);
+#endif
     ndpi_free(*t);
     *t = NULL;
 }
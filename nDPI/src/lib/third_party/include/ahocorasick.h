@@ -57,12 +57,25 @@ typedef struct
 
 } AC_AUTOMATA_t;
 
+/* AC_CURSOR_t:
+ * The searching state of one caller. ac_automata_search_r() keeps all of its
+ * state in the cursor and only reads the automata, so a finalized automata
+ * can be shared by many concurrent searchers, each with its own cursor. */
+typedef struct
+{
+  AC_NODE_t * current_node; /* Pointer to current node while searching */
+  unsigned long base_position; /* Position of current chunk in whole text */
+  AC_MATCH_t match; /* Any match is reported with this */
+} AC_CURSOR_t;
+
 
 AC_AUTOMATA_t * ac_automata_init     (MATCH_CALBACK_f mc);
 AC_ERROR_t      ac_automata_add      (AC_AUTOMATA_t * thiz, AC_PATTERN_t * str);
 void            ac_automata_finalize (AC_AUTOMATA_t * thiz);
 int             ac_automata_search   (AC_AUTOMATA_t * thiz, AC_TEXT_t * str, void * param);
 void            ac_automata_reset    (AC_AUTOMATA_t * thiz);
+int             ac_automata_search_r (AC_AUTOMATA_t * thiz, AC_CURSOR_t * cur, AC_TEXT_t * str, void * param);
+void            ac_automata_reset_r  (AC_AUTOMATA_t * thiz, AC_CURSOR_t * cur);
 void            ac_automata_release  (AC_AUTOMATA_t * thiz);
 void            ac_automata_display  (AC_AUTOMATA_t * thiz, char repcast);
 
@@ -216,6 +216,34 @@ void ac_automata_finalize (AC_AUTOMATA_t * thiz)
  *  1: success; stop searching; call-back sent me a non-0 value
  ******************************************************************************/
 int ac_automata_search (AC_AUTOMATA_t * thiz, AC_TEXT_t * txt, void * param)
+{
+  AC_CURSOR_t cur;
+  int ret;
+
+  cur.current_node = thiz->current_node;
+  cur.base_position = thiz->base_position;
+
+  ret = ac_automata_search_r(thiz, &cur, txt, param);
+
+  /* save status variables */
+  thiz->match = cur.match;
+  thiz->current_node = cur.current_node;
+  thiz->base_position = cur.base_position;
+  return ret;
+}
+
+/******************************************************************************
+ * FUNCTION: ac_automata_search_r
+ * Same as ac_automata_search() but the searching state lives in the caller's
+ * cursor, the automata itself is never written.
+ * PARAMS:
+ * AC_AUTOMATA_t * thiz: the pointer to the automata
+ * AC_CURSOR_t * cur: the searching state, prepared by ac_automata_reset_r()
+ * AC_TEXT_t * txt: the input text that must be searched
+ * void * param: this parameter will be send to call-back function.
+ * RETURN VALUE: same as ac_automata_search()
+ ******************************************************************************/
+int ac_automata_search_r (AC_AUTOMATA_t * thiz, AC_CURSOR_t * cur, AC_TEXT_t * txt, void * param)
 {
   unsigned long position;
   AC_NODE_t *curr;
@@ -226,7 +254,7 @@ int ac_automata_search (AC_AUTOMATA_t * thiz, AC_TEXT_t * txt, void * param)
     return -1;
 
   position = 0;
-  curr = thiz->current_node;
+  curr = cur->current_node;
 
   /* This is the main search loop.
    * it must be keep as lightweight as possible. */
@@ -250,18 +278,18 @@ int ac_automata_search (AC_AUTOMATA_t * thiz, AC_TEXT_t * txt, void * param)
 	 * transition or due to a fail. in second case we should not report
 	 * matching because it was reported in previous node */
 	{
-	  thiz->match.position = position + thiz->base_position;
-	  thiz->match.match_num = curr->matched_patterns_num;
-	  thiz->match.patterns = curr->matched_patterns;
+	  cur->match.position = position + cur->base_position;
+	  cur->match.match_num = curr->matched_patterns_num;
+	  cur->match.patterns = curr->matched_patterns;
 	  /* we found a match! do call-back */
-	  if (thiz->match_callback(&thiz->match, param))
+	  if (thiz->match_callback(&cur->match, param))
 	    return 1;
 	}
     }
 
   /* save status variables */
-  thiz->current_node = curr;
-  thiz->base_position += position;
+  cur->current_node = curr;
+  cur->base_position += position;
   return 0;
 }
 
@@ -279,6 +307,20 @@ void ac_automata_reset (AC_AUTOMATA_t * thiz)
   thiz->base_position = 0;
 }
 
+/******************************************************************************
+ * FUNCTION: ac_automata_reset_r
+ * Prepare a caller owned cursor for doing a new search with
+ * ac_automata_search_r().
+ * PARAMS:
+ * AC_AUTOMATA_t * thiz: the pointer to the automata
+ * AC_CURSOR_t * cur: the cursor to be reset
+ ******************************************************************************/
+void ac_automata_reset_r (AC_AUTOMATA_t * thiz, AC_CURSOR_t * cur)
+{
+  cur->current_node = thiz->root;
+  cur->base_position = 0;
+}
+
 /******************************************************************************
  * FUNCTION: ac_automata_release
  * Release all allocated memories to the automata
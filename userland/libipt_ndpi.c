@@ -325,7 +325,7 @@ ndpi_reg = {
   .version = XTABLES_VERSION,
   .name = "ndpi",
   .revision = 0,
-  .family = NFPROTO_IPV4,
+  .family = NFPROTO_UNSPEC,
   .size = XT_ALIGN(sizeof(struct xt_ndpi_protocols)),
   .userspacesize = XT_ALIGN(sizeof(struct xt_ndpi_protocols)),
   .help = ndpi_help,
@@ -341,37 +341,51 @@ ndpi_reg = {
 
 static void NDPI_help(void)
 {
-        printf("NDPI: Just use NDPI to check all packets(for update appid)\n");
+        printf("NDPI: Just use NDPI to check all packets(for update appid)\n"
+               " --shaping : also set skb mark and priority from /proc/xt_ndpi/shaping\n");
 }
 
-/*
 static void NDPI_print_v0(const void *ip,
                           const struct xt_entry_target *target, int numeric)
 {
-    const struct xt_ndpi_tginfo *info = (const struct xt_ndpi_tginfo *)target->data;
-	char buf[128];
-	int l;
-	l += snprintf(&buf[l],sizeof(buf)-l-1,"NDPI");
-	printf(buf);
+	const struct xt_ndpi_tginfo *info = (const struct xt_ndpi_tginfo *)target->data;
+
+	printf(" NDPI");
+	if (info->flags & NDPI_TG_SHAPING)
+		printf(" shaping");
 }
-*/
+
 static void NDPI_save_v0(const void *ip, const struct xt_entry_target *target)
 {
-	/*
-    const struct xt_ndpi_tginfo *info = (const struct xt_ndpi_tginfo *)target->data;
-	char buf[128];
-	int l = 0;
-	printf(buf);
-	*/
+	const struct xt_ndpi_tginfo *info = (const struct xt_ndpi_tginfo *)target->data;
+
+	if (info->flags & NDPI_TG_SHAPING)
+		printf(" --shaping");
 }
 
 static int NDPI_parse(int c, char **argv, int invert, unsigned int *flags,
               const void *entry, struct xt_entry_target **target)
 {
-    	// const struct xt_ndpi_tginfo *info = (const struct xt_ndpi_tginfo *)(*target)->data;
-	return 0;
+	struct xt_ndpi_tginfo *info = (void *)(*target)->data;
+
+	switch(c){
+	  case 'S': /*--shaping*/
+		if (invert)
+			xtables_error(PARAMETER_PROBLEM,
+				"Unexpected `!' before --shaping");
+		info->flags |= NDPI_TG_SHAPING;
+		break;
+	  default:
+		return 0;
+	}
+	return 1;
 }
 
+static const struct option NDPI_opts[] = {
+	{"shaping", 0, NULL, 'S'},
+	{.name=NULL}
+};
+
 
 static struct xtables_target ndpi_tg_reg[] = {
         {
@@ -379,11 +393,13 @@ static struct xtables_target ndpi_tg_reg[] = {
                 .name          = "NDPI",
                 .version       = XTABLES_VERSION,
                 .revision      = 0,
-                .size          = XT_ALIGN(0),
-                .userspacesize = XT_ALIGN(0),
+                .size          = XT_ALIGN(sizeof(struct xt_ndpi_tginfo)),
+                .userspacesize = XT_ALIGN(sizeof(struct xt_ndpi_tginfo)),
                 .help          = NDPI_help,
 				.parse		   = NDPI_parse,
-				.save 		   = NDPI_save_v0
+				.print		   = NDPI_print_v0,
+				.save 		   = NDPI_save_v0,
+				.extra_opts	   = NDPI_opts
         },
 };
 
@@ -0,0 +1,391 @@
+/*
+ * ndpibench.c
+ * Copyright (C) 2013 Luca Deri <deri@ntop.org>
+ *
+ * Stress benchmark of one nDPI detection module shared by many threads,
+ * the way xt_ndpi.ko shares it between the CPUs since the flows are locked
+ * per LRU unit instead of globally.
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+  Every thread owns its flows, the detection module is the only shared
+  state. A flow is an HTTP request and its response, repeated until the
+  flow has seen -n packets, then it starts over with the next host. Per
+  packet, besides ndpi_detection_process_packet():
+  - the host is searched in the shared automata with a cursor of the
+    thread (ac_automata_reset_r() / ac_automata_search_r()),
+  - the flow tuple is looked up in meta2protocol, the locked ndpi_hash_t
+    the ftp_data and tftp dissectors use; it is added when the flow
+    starts and removed when it ends. The table keeps 1384 tuples, with
+    more flows than that the oldest are evicted and hash_hits drops.
+
+  ndpibench -d 5 -n 8
+
+  prints the packets per second with 1, 2, 4 and N threads, N being the
+  online CPUs unless -t says otherwise. Run it on an idle box, with the
+  CPU frequency governor set to performance, and compare the 1 thread
+  line against the others: perfect scaling is pps(1) * threads.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ndpi_main.h"
+#include "ahocorasick.h"
+
+#define DETECTION_TICK_RESOLUTION	1000
+#define FLOWS_PER_THREAD		1024
+#define MAX_PACKET			512
+
+/* ******************************************* */
+
+struct bench_flow {
+	struct ndpi_flow_struct	*ndpi_flow;
+	struct ndpi_id_struct	*id[2];
+	u_int32_t		saddr;		/* client address, unique per thread and flow */
+	u_int16_t		sport;
+	u_int32_t		packets;
+	u_int32_t		host;		/* index in hosts[] */
+};
+
+struct worker {
+	pthread_t		thread;
+	u_int32_t		num;
+	struct bench_flow	*flows;
+	u_int64_t		packets, detected, ac_hits, hash_hits;
+};
+
+/* mostly names of host_match[], the others walk the automata without a match */
+static const char *hosts[] = {
+	"www.facebook.com", "api.twitter.com", "down.xunlei.com", "weixin.qq.com",
+	"api.weibo.com", "hi.baidu.com", "v.ku6.com", "static.fbcdn.net",
+	"www.dingtalk.com", "www.example.org", "mirror.example.net", "unknown.example.org",
+};
+#define NUM_HOSTS	(sizeof(hosts) / sizeof(hosts[0]))
+
+/* request and response of each host, addresses and ports patched per flow */
+static u_int8_t		templates[NUM_HOSTS][2][MAX_PACKET];
+static u_int16_t	template_len[NUM_HOSTS][2];
+
+static struct ndpi_detection_module_struct *ndpi_struct;
+static u_int32_t	flow_struct_size, id_struct_size;
+static u_int32_t	max_packets = 8;
+static u_int32_t	duration = 5;
+static volatile int	running;
+
+/* ******************************************* */
+
+static void debug_printf(u_int32_t protocol, void *id_struct, ndpi_log_level_t log_level, const char *format, ...) { }
+static void *malloc_wrapper(unsigned long size) { return malloc(size); }
+static void free_wrapper(void *freeable)        { free(freeable);      }
+
+static u_int64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* ******************************************* */
+
+/* IPv4 + TCP with PSH|ACK, the checksums are not looked at by nDPI */
+static u_int16_t build_packet(u_int8_t *p, int response, const char *host) {
+	u_int16_t	len;
+	int		plen;
+
+	memset(p, 0, 40);
+	if (response)
+		plen = snprintf((char *) p + 40, MAX_PACKET - 40,
+				"HTTP/1.1 200 OK\r\nServer: ndpibench\r\nContent-Type: text/html\r\n"
+				"Content-Length: 0\r\n\r\n");
+	else
+		plen = snprintf((char *) p + 40, MAX_PACKET - 40,
+				"GET / HTTP/1.1\r\nHost: %s\r\nUser-Agent: ndpibench\r\nAccept: */*\r\n\r\n", host);
+	len = 40 + plen;
+
+	p[0] = 0x45;
+	*(u_int16_t *) (p + 2) = htons(len);
+	p[8] = 64;
+	p[9] = IPPROTO_TCP;
+	p[20 + 12] = 5 << 4;
+	p[20 + 13] = 0x18;
+	*(u_int16_t *) (p + 20 + 14) = htons(65535);
+	return len;
+}
+
+
+static void patch_packet(u_int8_t *p, const struct bench_flow *f, int response) {
+	u_int32_t server = htonl(0x0a000001);
+	u_int16_t http = htons(80);
+
+	*(u_int32_t *) (p + 12) = response ? server : f->saddr;
+	*(u_int32_t *) (p + 16) = response ? f->saddr : server;
+	*(u_int16_t *) (p + 20) = response ? http : f->sport;
+	*(u_int16_t *) (p + 22) = response ? f->sport : http;
+	/* sequence numbers follow the payload, no packet looks retransmitted */
+	*(u_int32_t *) (p + 24) = htonl(1000 + (f->packets / 2) * 512);
+	*(u_int32_t *) (p + 28) = htonl(2000 + (f->packets / 2) * 512);
+}
+
+
+/* the 5-tuple of the flow, as a key of meta2protocol */
+static void flow_meta(const struct bench_flow *f, u_int8_t *meta) {
+	u_int32_t server = htonl(0x0a000001);
+	u_int16_t http = htons(80);
+
+	memcpy(meta, &f->saddr, 4);
+	memcpy(meta + 4, &server, 4);
+	memcpy(meta + 8, &f->sport, 2);
+	memcpy(meta + 10, &http, 2);
+	meta[12] = IPPROTO_TCP;
+}
+
+/* ******************************************* */
+
+static int start_flow(struct bench_flow *f) {
+	u_int8_t meta[13];
+
+	if (f->ndpi_flow == NULL) {
+		f->ndpi_flow = malloc(flow_struct_size);
+		f->id[0] = malloc(id_struct_size);
+		f->id[1] = malloc(id_struct_size);
+		if (f->ndpi_flow == NULL || f->id[0] == NULL || f->id[1] == NULL)
+			return -1;
+	}
+	memset(f->ndpi_flow, 0, flow_struct_size);
+	memset(f->id[0], 0, id_struct_size);
+	memset(f->id[1], 0, id_struct_size);
+	f->sport = htons(1024 + (ntohs(f->sport) + 1) % 60000);
+	f->packets = 0;
+	f->host = (f->host + 1) % NUM_HOSTS;
+
+	flow_meta(f, meta);
+	ndpi_hash_add(ndpi_struct->meta2protocol, meta, sizeof(meta), NDPI_PROTOCOL_HTTP);
+	return 0;
+}
+
+
+static void end_flow(struct bench_flow *f) {
+	u_int8_t meta[13];
+
+	flow_meta(f, meta);
+	ndpi_hash_remove(ndpi_struct->meta2protocol, meta, sizeof(meta), NDPI_PROTOCOL_HTTP);
+}
+
+
+static void run_packet(struct worker *w, struct bench_flow *f, u_int8_t *buf, u_int64_t tick) {
+	AC_AUTOMATA_t	*ac = (AC_AUTOMATA_t *) ndpi_struct->ac_automa;
+	AC_CURSOR_t	cursor;
+	AC_TEXT_t	text;
+	u_int8_t	meta[13];
+	int		response = f->packets & 1, match = NDPI_PROTOCOL_UNKNOWN;
+	u_int16_t	len = template_len[f->host][response];
+
+	memcpy(buf, templates[f->host][response], len);
+	patch_packet(buf, f, response);
+	if (ndpi_detection_process_packet(ndpi_struct, f->ndpi_flow, buf, len, (u_int32_t) tick,
+					  f->id[response], f->id[!response]) != NDPI_PROTOCOL_UNKNOWN)
+		w->detected++;
+
+	/* the cursor is ours, the automata is shared and only read */
+	text.astring = (AC_ALPHABET_t *) hosts[f->host];
+	text.length = strlen(hosts[f->host]);
+	ac_automata_reset_r(ac, &cursor);
+	ac_automata_search_r(ac, &cursor, &text, &match);
+	if (match != NDPI_PROTOCOL_UNKNOWN)
+		w->ac_hits++;
+
+	flow_meta(f, meta);
+	if (ndpi_hash_search(ndpi_struct->meta2protocol, meta, sizeof(meta), NDPI_PROTOCOL_HTTP))
+		w->hash_hits++;
+
+	f->packets++;
+	w->packets++;
+}
+
+
+static void *worker_loop(void *arg) {
+	struct worker		*w = arg;
+	struct bench_flow	*f;
+	u_int8_t		buf[MAX_PACKET];
+	u_int64_t		tick;
+	u_int32_t		i;
+
+	for (i = 0; i < FLOWS_PER_THREAD; i++) {
+		f = &w->flows[i];
+		f->saddr = htonl(0xc0000000 | (w->num << 16) | i);
+		f->host = i % NUM_HOSTS;
+		if (start_flow(f) < 0)
+			return NULL;
+	}
+
+	while (running) {
+		tick = now_ns() / (1000000000ULL / DETECTION_TICK_RESOLUTION);
+		for (i = 0; i < FLOWS_PER_THREAD; i++) {
+			f = &w->flows[i];
+			run_packet(w, f, buf, tick);
+			if (f->packets >= max_packets) {
+				end_flow(f);
+				start_flow(f);
+			}
+		}
+	}
+
+	for (i = 0; i < FLOWS_PER_THREAD; i++)
+		end_flow(&w->flows[i]);
+	return NULL;
+}
+
+/* ******************************************* */
+
+static void free_workers(struct worker *workers, u_int32_t n) {
+	u_int32_t i, j;
+
+	for (i = 0; i < n; i++) {
+		if (workers[i].flows == NULL)
+			continue;
+		for (j = 0; j < FLOWS_PER_THREAD; j++) {
+			free(workers[i].flows[j].ndpi_flow);
+			free(workers[i].flows[j].id[0]);
+			free(workers[i].flows[j].id[1]);
+		}
+		free(workers[i].flows);
+	}
+	free(workers);
+}
+
+
+static int run(u_int32_t threads) {
+	struct worker	*workers;
+	u_int64_t	start, elapsed, packets = 0, detected = 0, ac_hits = 0, hash_hits = 0;
+	u_int32_t	i;
+
+	if ((workers = calloc(threads, sizeof(*workers))) == NULL)
+		return -1;
+	for (i = 0; i < threads; i++) {
+		workers[i].num = i;
+		if ((workers[i].flows = calloc(FLOWS_PER_THREAD, sizeof(struct bench_flow))) == NULL) {
+			free_workers(workers, threads);
+			return -1;
+		}
+	}
+
+	running = 1;
+	start = now_ns();
+	for (i = 0; i < threads; i++)
+		pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]);
+	sleep(duration);
+	running = 0;
+	for (i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		packets += workers[i].packets;
+		detected += workers[i].detected;
+		ac_hits += workers[i].ac_hits;
+		hash_hits += workers[i].hash_hits;
+	}
+	elapsed = now_ns() - start;
+
+	printf("%7u %14llu %12.0f %12llu %12llu %12llu\n", threads, (unsigned long long) packets,
+	       (double) packets * 1000000000.0 / elapsed, (unsigned long long) detected,
+	       (unsigned long long) ac_hits, (unsigned long long) hash_hits);
+	fflush(stdout);
+	free_workers(workers, threads);
+	return 0;
+}
+
+/* ******************************************* */
+
+static void help(void) {
+	printf("ndpibench [-d <secs>] [-n <packets>] [-t <threads>]\n"
+	       "  -d  seconds per thread count (default 5)\n"
+	       "  -n  packets per flow before it starts over (default 8)\n"
+	       "  -t  largest thread count (default: online CPUs)\n"
+	       "Runs with 1, 2, 4 and -t threads sharing one detection module.\n");
+	exit(1);
+}
+
+
+int main(int argc, char **argv) {
+	NDPI_PROTOCOL_BITMASK	all;
+	u_int32_t		counts[4] = { 1, 2, 4, 0 }, max_threads, last = 0, i;
+	long			cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int			c, rc = 0;
+
+	max_threads = cpus > 0 ? cpus : 1;
+	while ((c = getopt(argc, argv, "d:n:t:h")) != -1) {
+		switch (c) {
+		case 'd':
+			duration = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			max_packets = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			max_threads = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			help();
+		}
+	}
+	if (duration == 0 || max_packets == 0 || max_threads == 0)
+		help();
+	counts[3] = max_threads;
+
+	ndpi_struct = ndpi_init_detection_module(DETECTION_TICK_RESOLUTION, malloc_wrapper, free_wrapper, debug_printf);
+	if (ndpi_struct == NULL) {
+		fprintf(stderr, "ndpi_init_detection_module failed\n");
+		return 1;
+	}
+	NDPI_BITMASK_SET_ALL(all);
+	if (ndpi_set_protocol_detection_bitmask2(ndpi_struct, &all) < 0) {
+		fprintf(stderr, "ndpi_set_protocol_detection_bitmask2 failed\n");
+		ndpi_exit_detection_module(ndpi_struct, free_wrapper);
+		return 1;
+	}
+	ndpi_finalize_automa(ndpi_struct);
+
+	flow_struct_size = ndpi_detection_get_sizeof_ndpi_flow_struct();
+	id_struct_size = ndpi_detection_get_sizeof_ndpi_id_struct();
+	for (i = 0; i < NUM_HOSTS; i++) {
+		template_len[i][0] = build_packet(templates[i][0], 0, hosts[i]);
+		template_len[i][1] = build_packet(templates[i][1], 1, hosts[i]);
+	}
+
+	printf("%7s %14s %12s %12s %12s %12s\n", "threads", "packets", "pps", "detected", "ac_hits", "hash_hits");
+	for (i = 0; i < 4; i++) {
+		/* 1, 2, 4 and the largest count, each once and in order */
+		if (counts[i] > max_threads || counts[i] <= last)
+			continue;
+		last = counts[i];
+		if (run(counts[i]) < 0) {
+			fprintf(stderr, "%u threads: %s\n", counts[i], strerror(errno));
+			rc = 1;
+			break;
+		}
+	}
+
+	ndpi_exit_detection_module(ndpi_struct, free_wrapper);
+	return rc;
+}
@@ -0,0 +1,577 @@
+/*
+ * ndpiq.c
+ * Copyright (C) 2013 Luca Deri <deri@ntop.org>
+ *
+ * Userspace classifier for hosts that cannot load xt_ndpi.ko: packets
+ * come from NFQUEUE, nDPI classifies their flows and the verdict carries
+ * the protocol in the packet mark, saved into ct->mark by CONNMARK.
+ *
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+  The mark holds protocol + 1 in the bits of -m (default 0xff), the same
+  encoding as the ct_mark_mask of xt_ndpi.ko, so the same connmark rules
+  work with either. Only the first packets of a flow are queued, classified
+  flows bypass the daemon through their ct->mark:
+
+  iptables -t mangle -A PREROUTING -m connmark --mark 0/0xff \
+	-m connbytes --connbytes 0:16 --connbytes-dir both --connbytes-mode packets \
+	-j NFQUEUE --queue-balance 0:3 --queue-bypass
+  iptables -t mangle -A OUTPUT -m connmark --mark 0/0xff \
+	-m connbytes --connbytes 0:16 --connbytes-dir both --connbytes-mode packets \
+	-j NFQUEUE --queue-balance 0:3 --queue-bypass
+  iptables -t mangle -A INPUT -m mark ! --mark 0/0xff -j CONNMARK --save-mark --mask 0xff
+  iptables -t mangle -A POSTROUTING -m mark ! --mark 0/0xff -j CONNMARK --save-mark --mask 0xff
+
+  ndpiq -q 0:3 -n 16
+
+  Each queue gets its own thread, nDPI instance and flow table, --queue-balance
+  keeps a flow on one queue. -n has to match the connbytes limit: flows still
+  undetected at their n-th packet get the protocol guessed from the ports.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/netfilter.h>
+#include <libnetfilter_queue/libnetfilter_queue.h>
+
+#include "ndpi_main.h"
+
+#define DETECTION_TICK_RESOLUTION	1000
+#define FLOW_BUCKETS			65536	/* a power of 2 */
+#define RCVBUF_SIZE			(8 << 20)
+#define RCVTIMEO_MS			500	/* how late a worker may notice shutdown */
+
+/* ******************************************* */
+
+struct flow_key {
+	u_int8_t	addr[2][16];	/* lower address first */
+	u_int16_t	port[2];
+	u_int8_t	family, l4proto;
+};
+
+struct flow {
+	struct flow		*next;
+	struct flow_key		key;
+	struct ndpi_flow_struct	*ndpi_flow;	/* NULL once classified */
+	struct ndpi_id_struct	*id[2];		/* endpoints, in key order */
+	time_t			last_seen;
+	u_int32_t		packets;
+	u_int16_t		proto;
+	u_int8_t		detected;
+};
+
+/* the verdicts of consecutive packets sharing a mark go out as one message */
+struct batch {
+	u_int32_t		id;		/* last packet of the batch */
+	u_int32_t		mark;
+	u_int8_t		marked;
+	u_int32_t		count;
+	u_int64_t		recv_ns;	/* sum over the packets */
+};
+
+struct queue_stats {
+	u_int64_t		packets, flows, detected, guessed, batches, latency_ns;
+};
+
+struct queue {
+	u_int16_t		num;
+	pthread_t		thread;
+	struct nfq_handle	*h;
+	struct nfq_q_handle	*qh;
+	struct ndpi_detection_module_struct *ndpi_struct;
+	struct flow		**flows;
+	time_t			last_sweep;
+	struct batch		batch;
+	u_int64_t		now_ns;		/* when the current message was read */
+	struct queue_stats	stats;
+};
+
+static u_int16_t	first_queue = 0, last_queue = 0;
+static u_int32_t	mark_mask = 0xff, mark_shift;
+static u_int32_t	max_packets = 16;
+static u_int32_t	batch_size = 32;
+static u_int32_t	idle_timeout = 60;
+static u_int32_t	flow_struct_size, id_struct_size;
+static volatile sig_atomic_t	shutdown_requested, dump_requested;
+static struct queue	*queues;
+
+/* ******************************************* */
+
+static void debug_printf(u_int32_t protocol, void *id_struct, ndpi_log_level_t log_level, const char *format, ...) { }
+static void *malloc_wrapper(unsigned long size) { return malloc(size); }
+static void free_wrapper(void *freeable)        { free(freeable);      }
+
+static u_int64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* ******************************************* */
+
+/* both directions of a flow get the same key, dir tells which one this is */
+static int build_key(const u_int8_t *ip, u_int32_t len, struct flow_key *key, int *dir) {
+	const u_int8_t	*src, *dst, *l4;
+	u_int32_t	alen, hlen;
+	u_int16_t	sport = 0, dport = 0;
+	int		cmp;
+
+	memset(key, 0, sizeof(*key));
+	if (len >= 20 && (ip[0] >> 4) == 4) {
+		hlen = (ip[0] & 0x0f) * 4;
+		if (hlen < 20 || hlen > len)
+			return -1;
+		key->family = AF_INET;
+		key->l4proto = ip[9];
+		src = ip + 12; dst = ip + 16; alen = 4;
+		/* later fragments have no ports, they stay out of the flow */
+		if ((ntohs(*(const u_int16_t *) (ip + 6)) & 0x1fff) != 0)
+			return -1;
+	} else if (len >= 40 && (ip[0] >> 4) == 6) {
+		hlen = 40;
+		key->family = AF_INET6;
+		key->l4proto = ip[6];
+		src = ip + 8; dst = ip + 24; alen = 16;
+	} else
+		return -1;
+
+	l4 = ip + hlen;
+	if ((key->l4proto == IPPROTO_TCP || key->l4proto == IPPROTO_UDP) && len >= hlen + 4) {
+		sport = *(const u_int16_t *) l4;
+		dport = *(const u_int16_t *) (l4 + 2);
+	}
+
+	cmp = memcmp(src, dst, alen);
+	*dir = cmp > 0 || (cmp == 0 && sport > dport);
+	memcpy(key->addr[*dir], src, alen);
+	memcpy(key->addr[!*dir], dst, alen);
+	key->port[*dir] = sport;
+	key->port[!*dir] = dport;
+	return 0;
+}
+
+
+static u_int32_t key_hash(const struct flow_key *key) {
+	const u_int8_t	*p = (const u_int8_t *) key;
+	u_int32_t	h = 2166136261U, i;
+
+	for (i = 0; i < sizeof(*key); i++)
+		h = (h ^ p[i]) * 16777619U;
+	return h & (FLOW_BUCKETS - 1);
+}
+
+
+static void free_flow_state(struct flow *f) {
+	free(f->ndpi_flow); f->ndpi_flow = NULL;
+	free(f->id[0]); f->id[0] = NULL;
+	free(f->id[1]); f->id[1] = NULL;
+}
+
+
+static struct flow *get_flow(struct queue *q, const struct flow_key *key) {
+	struct flow **b = &q->flows[key_hash(key)], *f;
+
+	for (f = *b; f != NULL; f = f->next)
+		if (memcmp(&f->key, key, sizeof(*key)) == 0)
+			return f;
+
+	if ((f = calloc(1, sizeof(*f))) == NULL)
+		return NULL;
+	f->ndpi_flow = calloc(1, flow_struct_size);
+	f->id[0] = calloc(1, id_struct_size);
+	f->id[1] = calloc(1, id_struct_size);
+	if (f->ndpi_flow == NULL || f->id[0] == NULL || f->id[1] == NULL) {
+		free_flow_state(f);
+		free(f);
+		return NULL;
+	}
+	f->key = *key;
+	f->next = *b;
+	*b = f;
+	q->stats.flows++;
+	return f;
+}
+
+
+/* classified flows stay until idle, their late packets must not start over */
+static void sweep_flows(struct queue *q, time_t now) {
+	struct flow **p, *f;
+	u_int32_t i;
+
+	for (i = 0; i < FLOW_BUCKETS; i++) {
+		for (p = &q->flows[i]; (f = *p) != NULL; ) {
+			if (now - f->last_seen < (time_t) idle_timeout) {
+				p = &f->next;
+				continue;
+			}
+			*p = f->next;
+			free_flow_state(f);
+			free(f);
+		}
+	}
+	q->last_sweep = now;
+}
+
+/* ******************************************* */
+
+static void flush_batch(struct queue *q) {
+	struct batch *b = &q->batch;
+
+	if (b->count == 0)
+		return;
+
+	if (b->marked)
+		nfq_set_verdict_batch2(q->qh, b->id, NF_ACCEPT, b->mark);
+	else
+		nfq_set_verdict_batch(q->qh, b->id, NF_ACCEPT);
+
+	q->stats.batches++;
+	q->stats.latency_ns += b->count * now_ns() - b->recv_ns;
+	b->count = 0;
+	b->recv_ns = 0;
+}
+
+
+static void add_verdict(struct queue *q, u_int32_t id, u_int8_t marked, u_int32_t mark) {
+	struct batch *b = &q->batch;
+
+	if (b->count && (b->marked != marked || b->mark != mark))
+		flush_batch(q);
+
+	b->id = id;
+	b->marked = marked;
+	b->mark = mark;
+	b->count++;
+	b->recv_ns += q->now_ns;
+	if (b->count >= batch_size)
+		flush_batch(q);
+}
+
+/* ******************************************* */
+
+static u_int16_t classify(struct queue *q, struct flow *f, int dir, const u_int8_t *ip, u_int16_t len) {
+	struct flow_key *k = &f->key;
+	u_int64_t	tick = q->now_ns / (1000000000ULL / DETECTION_TICK_RESOLUTION);
+	u_int16_t	proto;
+
+	proto = ndpi_detection_process_packet(q->ndpi_struct, f->ndpi_flow, ip, len,
+					      (u_int32_t) tick, f->id[dir], f->id[!dir]);
+	if (proto != NDPI_PROTOCOL_UNKNOWN) {
+		q->stats.detected++;
+	} else if (f->packets >= max_packets) {
+		/* what the kernel module does at give-up, with IPv4 addresses only */
+		proto = ndpi_guess_undetected_protocol(q->ndpi_struct, k->l4proto,
+						       k->family == AF_INET ? ntohl(*(u_int32_t *) k->addr[dir]) : 0,
+						       ntohs(k->port[dir]),
+						       k->family == AF_INET ? ntohl(*(u_int32_t *) k->addr[!dir]) : 0,
+						       ntohs(k->port[!dir]));
+		q->stats.guessed++;
+	} else
+		return NDPI_PROTOCOL_UNKNOWN;
+
+	f->proto = proto;
+	f->detected = 1;
+	free_flow_state(f);
+	return proto;
+}
+
+
+static int queue_cb(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struct nfq_data *nfa, void *data) {
+	struct queue			*q = data;
+	struct nfqnl_msg_packet_hdr	*ph = nfq_get_msg_packet_hdr(nfa);
+	struct flow_key			key;
+	struct flow			*f;
+	unsigned char			*ip;
+	u_int32_t			id, mark;
+	time_t				now = time(NULL);
+	int				len, dir;
+
+	if (ph == NULL)
+		return 0;
+	id = ntohl(ph->packet_id);
+	q->stats.packets++;
+
+	len = nfq_get_payload(nfa, &ip);
+	if (len <= 0 || build_key(ip, len, &key, &dir) < 0 || (f = get_flow(q, &key)) == NULL) {
+		add_verdict(q, id, 0, 0);
+		return 0;
+	}
+	f->last_seen = now;
+	f->packets++;
+
+	if (!f->detected && classify(q, f, dir, ip, len) == NDPI_PROTOCOL_UNKNOWN) {
+		add_verdict(q, id, 0, 0);
+		return 0;
+	}
+
+	/* protocols that do not fit the mask are left unmarked */
+	if ((u_int32_t) f->proto + 1 > (mark_mask >> mark_shift)) {
+		add_verdict(q, id, 0, 0);
+		return 0;
+	}
+	mark = (nfq_get_nfmark(nfa) & ~mark_mask) | (((u_int32_t) f->proto + 1) << mark_shift);
+	add_verdict(q, id, 1, mark);
+	return 0;
+}
+
+/* ******************************************* */
+
+static void dump_stats(void) {
+	struct queue	*q;
+	u_int32_t	i;
+
+	for (i = 0; i <= (u_int32_t) (last_queue - first_queue); i++) {
+		q = &queues[i];
+		fprintf(stderr, "queue %u: packets %llu flows %llu detected %llu guessed %llu batches %llu"
+			" avg verdict latency %llu ns\n", q->num,
+			(unsigned long long) q->stats.packets, (unsigned long long) q->stats.flows,
+			(unsigned long long) q->stats.detected, (unsigned long long) q->stats.guessed,
+			(unsigned long long) q->stats.batches,
+			(unsigned long long) (q->stats.packets ? q->stats.latency_ns / q->stats.packets : 0));
+	}
+}
+
+
+static void *queue_loop(void *data) {
+	struct queue	*q = data;
+	char		buf[0xffff + 4096] __attribute__ ((aligned));
+	int		fd = nfq_fd(q->h), rv;
+	time_t		now;
+
+	while (!shutdown_requested) {
+		/*
+		 * drained: whatever is pending goes out now. A SIGTERM landing
+		 * before recv() blocks is lost, SO_RCVTIMEO bounds the wait.
+		 */
+		rv = recv(fd, buf, sizeof(buf), q->batch.count ? MSG_DONTWAIT : 0);
+		if (rv < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				flush_batch(q);
+				continue;
+			}
+			/* ENOBUFS: the kernel dropped messages, --queue-bypass does not help there */
+			if (errno == ENOBUFS || errno == EINTR)
+				continue;
+			fprintf(stderr, "queue %u: recv: %s\n", q->num, strerror(errno));
+			break;
+		}
+		q->now_ns = now_ns();
+		nfq_handle_packet(q->h, buf, rv);
+
+		now = time(NULL);
+		if (now - q->last_sweep >= 1) {
+			flush_batch(q);
+			sweep_flows(q, now);
+		}
+	}
+	flush_batch(q);
+	return NULL;
+}
+
+
+static int setup_queue(struct queue *q, u_int16_t num) {
+	NDPI_PROTOCOL_BITMASK all;
+	int rcvbuf = RCVBUF_SIZE;
+	struct timeval rcvtimeo = { 0, RCVTIMEO_MS * 1000 };
+
+	q->num = num;
+	q->ndpi_struct = ndpi_init_detection_module(DETECTION_TICK_RESOLUTION, malloc_wrapper, free_wrapper, debug_printf);
+	if (q->ndpi_struct == NULL)
+		return -1;
+	NDPI_BITMASK_SET_ALL(all);
+	if (ndpi_set_protocol_detection_bitmask2(q->ndpi_struct, &all) < 0)
+		return -1;
+	ndpi_finalize_automa(q->ndpi_struct);
+
+	if ((q->flows = calloc(FLOW_BUCKETS, sizeof(*q->flows))) == NULL)
+		return -1;
+	q->last_sweep = time(NULL);
+
+	if ((q->h = nfq_open()) == NULL)
+		return -1;
+	if ((q->qh = nfq_create_queue(q->h, num, queue_cb, q)) == NULL)
+		return -1;
+	if (nfq_set_mode(q->qh, NFQNL_COPY_PACKET, 0xffff) < 0)
+		return -1;
+	nfq_set_queue_maxlen(q->qh, 4096);
+	setsockopt(nfq_fd(q->h), SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	if (setsockopt(nfq_fd(q->h), SOL_SOCKET, SO_RCVTIMEO, &rcvtimeo, sizeof(rcvtimeo)) < 0)
+		return -1;
+	return 0;
+}
+
+
+static void term_queue(struct queue *q) {
+	struct flow	*f, *next;
+	u_int32_t	i;
+
+	if (q->qh)
+		nfq_destroy_queue(q->qh);
+	if (q->h)
+		nfq_close(q->h);
+	if (q->flows) {
+		for (i = 0; i < FLOW_BUCKETS; i++) {
+			for (f = q->flows[i]; f != NULL; f = next) {
+				next = f->next;
+				free_flow_state(f);
+				free(f);
+			}
+		}
+		free(q->flows);
+	}
+	if (q->ndpi_struct)
+		ndpi_exit_detection_module(q->ndpi_struct, free_wrapper);
+}
+
+/* ******************************************* */
+
+static void on_signal(int sig) {
+	if (sig == SIGUSR1)
+		dump_requested = 1;
+	else
+		shutdown_requested = 1;
+}
+
+
+static void help(void) {
+	printf("ndpiq [-q <first>[:<last>]] [-m <mask>] [-n <packets>] [-b <batch>] [-t <secs>]\n"
+	       "  -q  NFQUEUE numbers, one thread each (default 0)\n"
+	       "  -m  mark bits holding protocol + 1 (default 0xff)\n"
+	       "  -n  packets per flow, as in --connbytes 0:<n> (default 16)\n"
+	       "  -b  verdicts per batch at most (default 32)\n"
+	       "  -t  idle seconds before a flow is forgotten (default 60)\n"
+	       "SIGUSR1 prints the counters of each queue.\n");
+	exit(1);
+}
+
+
+int main(int argc, char **argv) {
+	struct nfq_handle	*h;
+	struct sigaction	sa;
+	sigset_t		workers;
+	u_int32_t		i, n;
+	char			*end;
+	int			c, rc = 0;
+
+	while ((c = getopt(argc, argv, "q:m:n:b:t:h")) != -1) {
+		switch (c) {
+		case 'q':
+			first_queue = last_queue = strtoul(optarg, &end, 0);
+			if (*end == ':')
+				last_queue = strtoul(end + 1, &end, 0);
+			if (*end != '\0' || last_queue < first_queue)
+				help();
+			break;
+		case 'm':
+			mark_mask = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			max_packets = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			batch_size = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			idle_timeout = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			help();
+		}
+	}
+	if (mark_mask == 0 || max_packets == 0 || batch_size == 0)
+		help();
+	mark_shift = __builtin_ctz(mark_mask);
+	if (((mark_mask >> mark_shift) & ((mark_mask >> mark_shift) + 1)) != 0) {
+		fprintf(stderr, "mark mask 0x%x is not contiguous\n", mark_mask);
+		return 1;
+	}
+
+	flow_struct_size = ndpi_detection_get_sizeof_ndpi_flow_struct();
+	id_struct_size = ndpi_detection_get_sizeof_ndpi_id_struct();
+
+	/* kernels before 3.8 want the family bound once, before any queue */
+	if ((h = nfq_open()) == NULL) {
+		fprintf(stderr, "nfq_open: %s\n", strerror(errno));
+		return 1;
+	}
+	nfq_unbind_pf(h, AF_INET);
+	nfq_bind_pf(h, AF_INET);
+	nfq_unbind_pf(h, AF_INET6);
+	nfq_bind_pf(h, AF_INET6);
+	nfq_close(h);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+
+	n = last_queue - first_queue + 1;
+	if ((queues = calloc(n, sizeof(*queues))) == NULL)
+		return 1;
+	for (i = 0; i < n; i++) {
+		if (setup_queue(&queues[i], first_queue + i) < 0) {
+			fprintf(stderr, "queue %u: setup failed: %s\n", first_queue + i, strerror(errno));
+			n = i + 1;
+			rc = 1;
+			goto out;
+		}
+	}
+
+	/* signals from outside go to this thread, workers only get SIGTERM from it */
+	sigemptyset(&workers);
+	sigaddset(&workers, SIGINT);
+	sigaddset(&workers, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &workers, NULL);
+	for (i = 0; i < n; i++)
+		pthread_create(&queues[i].thread, NULL, queue_loop, &queues[i]);
+	pthread_sigmask(SIG_UNBLOCK, &workers, NULL);
+
+	while (!shutdown_requested) {
+		sleep(1);
+		if (dump_requested) {
+			dump_requested = 0;
+			dump_stats();
+		}
+	}
+
+	/* a blocked recv() returns on the signal of its thread, or on SO_RCVTIMEO */
+	shutdown_requested = 1;
+	for (i = 0; i < n; i++)
+		pthread_kill(queues[i].thread, SIGTERM);
+	for (i = 0; i < n; i++)
+		pthread_join(queues[i].thread, NULL);
+	dump_stats();
+out:
+	for (i = 0; i < n; i++)
+		term_queue(&queues[i]);
+	free(queues);
+	return rc;
+}